@@ -0,0 +1,103 @@
+; kernel/ap_trampoline.asm - Application processor startup trampoline
+;
+; Copied to AP_TRAMPOLINE_BASE (below 1MB) by smp_init(). A STARTUP IPI
+; makes each AP begin here in real mode at AP_TRAMPOLINE_BASE. The code
+; goes straight to long mode on the kernel's page tables, takes the next
+; free stack and calls the C entry point. Everything runs from the copy,
+; so addresses are computed relative to the copy's base.
+
+global ap_trampoline_start
+global ap_trampoline_end
+global ap_tramp_cr3
+global ap_tramp_stacks
+global ap_tramp_stack_count
+global ap_tramp_next_stack
+global ap_tramp_entry
+
+AP_TRAMPOLINE_BASE equ 0x8000
+
+%define TADDR(label) (AP_TRAMPOLINE_BASE + (label) - ap_trampoline_start)
+
+section .text
+
+[BITS 16]
+ap_trampoline_start:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+
+    lgdt [TADDR(ap_tramp_gdt_ptr)]
+
+    ; PAE, the kernel's PML4 and EFER.LME, then protection and paging
+    ; together, which activates long mode directly from real mode
+    mov eax, cr4
+    or eax, (1 << 5)
+    mov cr4, eax
+
+    mov eax, [TADDR(ap_tramp_cr3)]
+    mov cr3, eax
+
+    mov ecx, 0xC0000080
+    rdmsr
+    or eax, (1 << 8)
+    wrmsr
+
+    mov eax, cr0
+    or eax, 0x80000001
+    mov cr0, eax
+
+    jmp dword 0x08:TADDR(ap_tramp_long_mode)
+
+[BITS 64]
+ap_tramp_long_mode:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    ; Each AP claims its own stack slot
+    mov eax, 1
+    lock xadd [TADDR(ap_tramp_next_stack)], eax
+    cmp eax, [TADDR(ap_tramp_stack_count)]
+    jae .park
+
+    mov rbx, [TADDR(ap_tramp_stacks)]
+    mov rsp, [rbx + rax * 8]
+    xor rbp, rbp
+
+    mov rax, [TADDR(ap_tramp_entry)]
+    call rax
+
+    ; More APs than stacks, or the entry point returned
+.park:
+    cli
+    hlt
+    jmp .park
+
+; Temporary GDT: just enough to reach the kernel's 64-bit code segment.
+; Each AP loads its own kernel GDT from C.
+align 8
+ap_tramp_gdt:
+    dq 0x0000000000000000
+    dq 0x00AF9A000000FFFF       ; 0x08: 64-bit kernel code
+    dq 0x00CF92000000FFFF       ; 0x10: kernel data
+ap_tramp_gdt_end:
+
+ap_tramp_gdt_ptr:
+    dw ap_tramp_gdt_end - ap_tramp_gdt - 1
+    dd TADDR(ap_tramp_gdt)
+
+; Filled in by smp_init() in the copy before the STARTUP IPIs
+align 8
+ap_tramp_cr3:           dq 0    ; Physical address of the kernel PML4 (below 4GB)
+ap_tramp_stacks:        dq 0    ; Array of stack tops, one per AP
+ap_tramp_entry:         dq 0    ; C entry point
+ap_tramp_stack_count:   dd 0    ; Entries in ap_tramp_stacks
+ap_tramp_next_stack:    dd 0    ; Next unclaimed entry
+
+ap_trampoline_end:
+
+section .note.GNU-stack noalloc noexec nowrite progbits
@@ -3,6 +3,7 @@
 #include "drivers/port_io.h"
 #include "drivers/console.h"
 #include "memory.h"
+#include "spinlock.h"
 #include <stdint.h>
 
 // LAPIC and IOAPIC base addresses (these will be detected during initialization)
@@ -55,13 +56,36 @@ void lapic_init(void) {
     // Print base address (simplified)
     console_write("\n");
     
+    lapic_enable();
+    
+    console_write("LAPIC initialized.\n");
+}
+
+// Enable the calling CPU's LAPIC (the base address is shared by all CPUs)
+void lapic_enable(void) {
     // Enable LAPIC by setting bit 8 in Spurious Interrupt Vector Register
     apic_write(APIC_SPURIOUS_INT, apic_read(APIC_SPURIOUS_INT) | APIC_SPURIOUS_ENABLE | 0xFF);
     
     // Set task priority to 0 (accept all interrupts)
     apic_write(APIC_TASK_PRIORITY, 0);
-    
-    console_write("LAPIC initialized.\n");
+}
+
+// Send an inter-processor interrupt. dest_apic_id is ignored when icr_low
+// uses a destination shorthand.
+void apic_send_ipi(uint32_t dest_apic_id, uint32_t icr_low) {
+    // An interrupt handler sending its own IPI between the two writes
+    // would redirect this one
+    uint64_t flags = local_irq_save();
+    
+    apic_write(APIC_ICR_HIGH, dest_apic_id << 24);
+    apic_write(APIC_ICR_LOW, icr_low);
+    
+    // Wait for the LAPIC to accept it
+    while (apic_read(APIC_ICR_LOW) & APIC_ICR_DELIVERY_STATUS) {
+        asm volatile("pause");
+    }
+    
+    local_irq_restore(flags);
 }
 
 // Function to initialize IOAPIC
@@ -7,6 +7,9 @@
 // APIC Base Address MSR
 #define IA32_APIC_BASE_MSR 0x1B
 
+// TSC value at which the LAPIC timer fires in TSC-deadline mode (0 disarms)
+#define IA32_TSC_DEADLINE_MSR 0x6E0
+
 // APIC Registers (offsets from base address)
 #define APIC_ID             0x20
 #define APIC_VERSION        0x30
@@ -41,8 +44,12 @@
 
 // LVT bits
 #define APIC_LVT_MASKED     0x10000
+#define APIC_LVT_TIMER_ONESHOT  0x00000
+#define APIC_LVT_TIMER_PERIODIC 0x20000
+#define APIC_LVT_TIMER_TSC_DEADLINE 0x40000
 
 // ICR bits
+#define APIC_ICR_NMI        0x400
 #define APIC_ICR_INIT       0x500
 #define APIC_ICR_STARTUP    0x600
 #define APIC_ICR_DELIVERY_STATUS 0x1000
@@ -62,6 +69,8 @@
 // Function prototypes
 void apic_init(void);
 void lapic_init(void);
+void lapic_enable(void);
+void apic_send_ipi(uint32_t dest_apic_id, uint32_t icr_low);
 void ioapic_init(void);
 void apic_eoi(void);
 void apic_write(uint32_t reg, uint32_t value);
@@ -0,0 +1,372 @@
+// kernel/bench.c
+#include "bench.h"
+#include "drivers/console.h"
+#include "cpu.h"
+#include "pmm.h"
+#include "scheduler.h"
+#include "spinlock.h"
+#include "vmalloc.h"
+#include "timer.h"
+#include <stdint.h>
+
+// Pages allocated and then freed per loop iteration
+#define BENCH_PMM_BATCH 32
+
+// Per-CPU result slot, padded to its own cache line
+struct bench_slot {
+    uint64_t ops;
+    uint32_t use_magazines;
+    uint32_t deadline;
+} __attribute__((aligned(64)));
+
+static struct bench_slot bench_slots[MAX_CPUS];
+static volatile uint32_t bench_start = 0;
+
+// Allocate and free pages in batches until the deadline tick
+static void bench_pmm_worker(void* arg) {
+    struct bench_slot* slot = (struct bench_slot*)arg;
+    void* pages[BENCH_PMM_BATCH];
+    uint64_t ops = 0;
+
+    while (!bench_start) {
+        asm volatile("pause");
+    }
+
+    while (get_tick_count() < slot->deadline) {
+        for (int i = 0; i < BENCH_PMM_BATCH; i++) {
+            pages[i] = slot->use_magazines ? pmm_alloc_page() : pmm_alloc_pages(0);
+        }
+        for (int i = 0; i < BENCH_PMM_BATCH; i++) {
+            if (pages[i] == NULL) {
+                continue;
+            }
+            if (slot->use_magazines) {
+                pmm_free_page((uint64_t)pages[i]);
+            } else {
+                pmm_free_pages((uint64_t)pages[i], 0);
+            }
+            ops++;
+        }
+    }
+
+    slot->ops = ops;
+}
+
+// Return this CPU's cached pages to the buddy allocator
+static void bench_drain_worker(void* arg) {
+    (void)arg;
+    pmm_drain_cpu_cache(cpu_current_id());
+}
+
+// Run the worker on the first ncpus CPUs and return total alloc/free pairs
+static uint64_t bench_pmm_run(uint32_t ncpus, uint32_t use_magazines) {
+    uint32_t deadline = get_tick_count() + BENCH_RUN_TICKS + 1;
+
+    bench_start = 0;
+    for (uint32_t cpu = 0; cpu < ncpus; cpu++) {
+        bench_slots[cpu].ops = 0;
+        bench_slots[cpu].use_magazines = use_magazines;
+        bench_slots[cpu].deadline = deadline;
+    }
+
+    // Remote CPUs first; they spin until bench_start is set
+    for (uint32_t cpu = 1; cpu < ncpus; cpu++) {
+        cpu_call(cpu, bench_pmm_worker, &bench_slots[cpu]);
+    }
+
+    // Line the start up with a tick boundary
+    uint32_t tick = get_tick_count();
+    while (get_tick_count() == tick) {
+        asm volatile("pause");
+    }
+    bench_start = 1;
+    bench_pmm_worker(&bench_slots[0]);
+
+    uint64_t total = bench_slots[0].ops;
+    for (uint32_t cpu = 1; cpu < ncpus; cpu++) {
+        cpu_wait_call(cpu);
+        total += bench_slots[cpu].ops;
+    }
+    return total;
+}
+
+// Page allocation throughput against the number of CPUs
+void bench_pmm_scaling(void) {
+    console_write("=== Benchmark: page allocator scaling ===\n");
+    console_write("CPUs  magazine allocs/sec  buddy allocs/sec\n");
+
+    uint32_t online = cpu_online_count();
+    for (uint32_t ncpus = 1; ncpus <= online; ncpus++) {
+        uint64_t mag_ops = bench_pmm_run(ncpus, 1);
+        uint64_t buddy_ops = bench_pmm_run(ncpus, 0);
+
+        console_write_dec(ncpus);
+        console_write("     ");
+        console_write_dec(mag_ops * TIMER_FREQUENCY / BENCH_RUN_TICKS);
+        console_write("     ");
+        console_write_dec(buddy_ops * TIMER_FREQUENCY / BENCH_RUN_TICKS);
+        console_write("\n");
+    }
+
+    // Leave the allocator in the same state for whatever runs next
+    for (uint32_t cpu = 0; cpu < online; cpu++) {
+        cpu_call(cpu, bench_drain_worker, NULL);
+        cpu_wait_call(cpu);
+    }
+
+    console_write("=== Benchmark Complete ===\n\n");
+}
+
+// Scheduler benchmark tasks run until this tick; the last one out clears
+// sched_bench_live
+static volatile uint32_t sched_bench_deadline = 0;
+static volatile uint32_t sched_bench_live = 0;
+
+// Yield back and forth with the other task pinned to this CPU
+static void bench_switch_task(void) {
+    while (get_tick_count() < sched_bench_deadline) {
+        scheduler_yield();
+    }
+    __atomic_fetch_sub(&sched_bench_live, 1, __ATOMIC_RELEASE);
+}
+
+// Child of bench_spawn_task: count itself and exit straight away
+static void bench_spawn_child(void) {
+    __atomic_fetch_add(&bench_slots[cpu_current_id()].ops, 1, __ATOMIC_RELAXED);
+}
+
+// Create short-lived tasks on this CPU and let each run to completion
+static void bench_spawn_task(void) {
+    int cpu = cpu_current_id();
+    while (get_tick_count() < sched_bench_deadline) {
+        scheduler_spawn(bench_spawn_child, TASK_PRIORITY_NORMAL, cpu);
+        scheduler_yield();
+    }
+    __atomic_fetch_sub(&sched_bench_live, 1, __ATOMIC_RELEASE);
+}
+
+// Start tasks_per_cpu copies of entry pinned to each of the first ncpus
+// CPUs and wait for them to finish
+static void bench_sched_run(uint32_t ncpus, void (*entry)(void), uint32_t tasks_per_cpu) {
+    for (uint32_t cpu = 0; cpu < ncpus; cpu++) {
+        bench_slots[cpu].ops = 0;
+    }
+    sched_bench_live = ncpus * tasks_per_cpu;
+    sched_bench_deadline = get_tick_count() + BENCH_RUN_TICKS + 1;
+
+    for (uint32_t cpu = 0; cpu < ncpus; cpu++) {
+        for (uint32_t i = 0; i < tasks_per_cpu; i++) {
+            if (scheduler_spawn(entry, TASK_PRIORITY_NORMAL, cpu) < 0) {
+                __atomic_fetch_sub(&sched_bench_live, 1, __ATOMIC_RELEASE);
+            }
+        }
+    }
+
+    while (__atomic_load_n(&sched_bench_live, __ATOMIC_ACQUIRE) != 0) {
+        scheduler_sleep(1);
+    }
+}
+
+// Context switch and task spawn throughput against the number of CPUs.
+// Every task is pinned, so each CPU runs its own independent copy of the
+// workload and the totals show how well the per-CPU run queues scale.
+void bench_sched_scaling(void) {
+    console_write("=== Benchmark: scheduler scaling ===\n");
+    console_write("CPUs  switches/sec  spawns/sec\n");
+
+    uint32_t online = cpu_online_count();
+    for (uint32_t ncpus = 1; ncpus <= online; ncpus++) {
+        uint64_t before = 0;
+        for (uint32_t cpu = 0; cpu < ncpus; cpu++) {
+            before += scheduler_switch_count(cpu);
+        }
+        bench_sched_run(ncpus, bench_switch_task, 2);
+        uint64_t switches = 0;
+        for (uint32_t cpu = 0; cpu < ncpus; cpu++) {
+            switches += scheduler_switch_count(cpu);
+        }
+        switches -= before;
+
+        bench_sched_run(ncpus, bench_spawn_task, 1);
+        uint64_t spawns = 0;
+        for (uint32_t cpu = 0; cpu < ncpus; cpu++) {
+            spawns += bench_slots[cpu].ops;
+        }
+
+        console_write_dec(ncpus);
+        console_write("     ");
+        console_write_dec(switches * TIMER_FREQUENCY / BENCH_RUN_TICKS);
+        console_write("     ");
+        console_write_dec(spawns * TIMER_FREQUENCY / BENCH_RUN_TICKS);
+        console_write("\n");
+    }
+
+    console_write("=== Benchmark Complete ===\n\n");
+}
+
+// Busy-loop until the deadline, as a CPU-bound task that never sleeps
+static void bench_hog_task(void) {
+    while (get_tick_count() < sched_bench_deadline) {
+        asm volatile("pause");
+    }
+    __atomic_fetch_sub(&sched_bench_live, 1, __ATOMIC_RELEASE);
+}
+
+// Wake-up latency seen by bench_interactive_task, in TSC cycles
+static uint64_t bench_latency_sum;
+static uint64_t bench_latency_max;
+static uint64_t bench_latency_count;
+
+// Sleep for one tick at a time, as an interactive task waiting on input
+// would, and record how long after its timer expired it got the CPU back
+static void bench_interactive_task(void) {
+    while (get_tick_count() < sched_bench_deadline) {
+        uint64_t due = timer_tick_to_tsc(timer_now() + 1);
+        scheduler_sleep(1);
+        uint64_t late = rdtsc() - due;
+        if ((int64_t)late < 0) {
+            late = 0;
+        }
+        bench_latency_sum += late;
+        bench_latency_count++;
+        if (late > bench_latency_max) {
+            bench_latency_max = late;
+        }
+    }
+    __atomic_fetch_sub(&sched_bench_live, 1, __ATOMIC_RELEASE);
+}
+
+// Wake-up latency of an interactive task sharing a CPU with a growing
+// number of CPU-bound ones. With fair scheduling the sleeper always has
+// less virtual runtime than the hogs, so its latency should stay near
+// one context switch rather than grow with their time slices.
+void bench_sched_latency(void) {
+    console_write("=== Benchmark: wake-up latency under load ===\n");
+    console_write("hogs  avg us  max us\n");
+
+    int cpu = cpu_current_id();
+    uint64_t cycles_per_us = timer_tsc_per_tick() * TIMER_FREQUENCY / 1000000;
+    if (cycles_per_us == 0) {
+        cycles_per_us = 1;
+    }
+
+    for (uint32_t hogs = 0; hogs <= 4; hogs += 2) {
+        bench_latency_sum = 0;
+        bench_latency_max = 0;
+        bench_latency_count = 0;
+        sched_bench_live = hogs + 1;
+        sched_bench_deadline = get_tick_count() + BENCH_RUN_TICKS + 1;
+
+        for (uint32_t i = 0; i < hogs; i++) {
+            if (scheduler_spawn(bench_hog_task, TASK_PRIORITY_NORMAL, cpu) < 0) {
+                __atomic_fetch_sub(&sched_bench_live, 1, __ATOMIC_RELEASE);
+            }
+        }
+        if (scheduler_spawn(bench_interactive_task, TASK_PRIORITY_NORMAL, cpu) < 0) {
+            __atomic_fetch_sub(&sched_bench_live, 1, __ATOMIC_RELEASE);
+        }
+        while (__atomic_load_n(&sched_bench_live, __ATOMIC_ACQUIRE) != 0) {
+            scheduler_sleep(1);
+        }
+
+        console_write_dec(hogs);
+        console_write("     ");
+        console_write_dec(bench_latency_count ?
+                          bench_latency_sum / bench_latency_count / cycles_per_us : 0);
+        console_write("      ");
+        console_write_dec(bench_latency_max / cycles_per_us);
+        console_write("\n");
+    }
+
+    console_write("=== Benchmark Complete ===\n\n");
+}
+
+// Round trips timed by the context switch benchmark
+#define BENCH_SWITCH_ROUNDS 100000
+#define BENCH_SWITCH_STACK_SIZE 16384
+
+static uint64_t bench_main_rsp;
+static uint64_t bench_partner_rsp;
+static volatile uint32_t bench_partner_done;
+
+// Other end of the raw switch ping-pong; never returns, its stack is
+// simply dropped afterwards
+static void bench_switch_partner(void* arg) {
+    (void)arg;
+    for (;;) {
+        context_switch(&bench_partner_rsp, bench_main_rsp);
+    }
+}
+
+// Yield back to the benchmark until it is done
+static void bench_yield_partner(void) {
+    while (!bench_partner_done) {
+        scheduler_yield();
+    }
+    __atomic_fetch_sub(&sched_bench_live, 1, __ATOMIC_RELEASE);
+}
+
+// Cycles per context switch: the bare stack switch, and a full
+// scheduler_yield() between two tasks on this CPU
+void bench_context_switch(void) {
+    console_write("=== Benchmark: context switch cost ===\n");
+
+    void* stack = vmalloc(BENCH_SWITCH_STACK_SIZE);
+    if (stack == NULL) {
+        console_write("ERROR: No stack for the context switch benchmark\n");
+        return;
+    }
+    bench_partner_rsp = context_init_stack((uint64_t)stack + BENCH_SWITCH_STACK_SIZE,
+                                           bench_switch_partner, NULL);
+
+    // Interrupts off so nothing but the switches lands in the window
+    uint64_t flags = local_irq_save();
+    uint64_t start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_SWITCH_ROUNDS; i++) {
+        context_switch(&bench_main_rsp, bench_partner_rsp);
+    }
+    uint64_t raw = rdtsc() - start;
+    local_irq_restore(flags);
+    vfree(stack);
+
+    console_write("context_switch:   ");
+    console_write_dec(raw / (2 * BENCH_SWITCH_ROUNDS));
+    console_write(" cycles/switch\n");
+
+    // Through the scheduler, against one task pinned to this CPU
+    bench_partner_done = 0;
+    sched_bench_live = 1;
+    if (scheduler_spawn(bench_yield_partner, TASK_PRIORITY_NORMAL, cpu_current_id()) < 0) {
+        return;
+    }
+    scheduler_yield();
+    uint64_t before = scheduler_switch_count(cpu_current_id());
+    start = rdtsc();
+    for (uint32_t i = 0; i < BENCH_SWITCH_ROUNDS; i++) {
+        scheduler_yield();
+    }
+    uint64_t yield = rdtsc() - start;
+    uint64_t switches = scheduler_switch_count(cpu_current_id()) - before;
+    bench_partner_done = 1;
+    while (__atomic_load_n(&sched_bench_live, __ATOMIC_ACQUIRE) != 0) {
+        scheduler_yield();
+    }
+
+    console_write("scheduler_yield:  ");
+    console_write_dec(switches ? yield / switches : 0);
+    console_write(" cycles/switch\n");
+
+    console_write("=== Benchmark Complete ===\n\n");
+}
+
+// Run all benchmarks
+void run_benchmarks(void) {
+    console_write("=== Running Benchmarks ===\n\n");
+
+    bench_pmm_scaling();
+    bench_context_switch();
+    bench_sched_scaling();
+    bench_sched_latency();
+
+    console_write("=== All Benchmarks Completed ===\n\n");
+}
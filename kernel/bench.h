@@ -0,0 +1,17 @@
+// kernel/bench.h
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+
+// Length of each benchmark run in timer ticks
+#define BENCH_RUN_TICKS 50
+
+// Function prototypes for benchmarks
+void bench_pmm_scaling(void);
+void bench_context_switch(void);
+void bench_sched_scaling(void);
+void bench_sched_latency(void);
+void run_benchmarks(void);
+
+#endif // BENCH_H
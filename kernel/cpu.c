@@ -0,0 +1,141 @@
+// kernel/cpu.c
+#include "cpu.h"
+#include "apic.h"
+#include "gdt.h"
+#include "drivers/console.h"
+#include <stdint.h>
+#include <stddef.h>
+
+struct cpu_features cpu_features;
+
+static struct cpu_info cpus[MAX_CPUS];
+static volatile uint32_t cpus_online = 0;
+
+// Register the bootstrap processor as CPU 0
+void cpu_init(void) {
+    for (int i = 0; i < MAX_CPUS; i++) {
+        cpus[i].id = i;
+        cpus[i].apic_id = 0;
+        cpus[i].online = 0;
+        cpus[i].call_pending = 0;
+        cpus[i].call_fn = NULL;
+        cpus[i].call_arg = NULL;
+    }
+
+    cpus[0].apic_id = cpu_initial_apic_id();
+    cpus[0].online = 1;
+    cpus_online = 1;
+
+    // Replace the bootloader's GDT with the kernel's own
+    gdt_init_cpu(0);
+
+    cpu_detect_features();
+}
+
+// Query CPUID for the optional features used elsewhere in the kernel
+void cpu_detect_features(void) {
+    uint32_t eax, ebx, ecx, edx;
+
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    uint32_t max_basic = eax;
+
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    cpu_features.pcid = (ecx >> 17) & 1;
+    cpu_features.tsc_deadline = (ecx >> 24) & 1;
+
+    if (max_basic >= 7) {
+        cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        cpu_features.invpcid = (ebx >> 10) & 1;
+    }
+
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    uint32_t max_extended = eax;
+
+    if (max_extended >= 0x80000001) {
+        cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        cpu_features.pages_1g = (edx >> 26) & 1;
+    }
+}
+
+// Record a newly started CPU and return its logical number (-1 if full)
+int cpu_register(uint32_t apic_id) {
+    uint32_t id = __atomic_fetch_add(&cpus_online, 1, __ATOMIC_ACQ_REL);
+    if (id >= MAX_CPUS) {
+        __atomic_fetch_sub(&cpus_online, 1, __ATOMIC_ACQ_REL);
+        return -1;
+    }
+
+    cpus[id].apic_id = apic_id;
+    cpus[id].online = 1;
+    return id;
+}
+
+// Logical number of the CPU executing this code
+uint32_t cpu_current_id(void) {
+    // Only the BSP runs until application processors are registered,
+    // and the LAPIC may not be mapped yet that early in boot
+    if (cpus_online <= 1) {
+        return 0;
+    }
+
+    uint32_t apic_id = apic_read(APIC_ID) >> 24;
+    for (uint32_t i = 0; i < cpus_online && i < MAX_CPUS; i++) {
+        if (cpus[i].apic_id == apic_id) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+// Number of CPUs currently running kernel code
+uint32_t cpu_online_count(void) {
+    return cpus_online;
+}
+
+// Get bookkeeping for a logical CPU
+struct cpu_info* cpu_get(uint32_t id) {
+    if (id >= MAX_CPUS) {
+        return NULL;
+    }
+    return &cpus[id];
+}
+
+// Run fn(arg) on the given CPU; runs inline when id is the current CPU
+int cpu_call(uint32_t id, cpu_call_fn_t fn, void* arg) {
+    if (id >= MAX_CPUS || !cpus[id].online) {
+        return -1;
+    }
+
+    if (id == cpu_current_id()) {
+        fn(arg);
+        return 0;
+    }
+
+    // Only one outstanding call per CPU
+    cpu_wait_call(id);
+
+    cpus[id].call_fn = fn;
+    cpus[id].call_arg = arg;
+    __atomic_store_n(&cpus[id].call_pending, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Wait until the last call queued for a CPU has finished
+void cpu_wait_call(uint32_t id) {
+    if (id >= MAX_CPUS) {
+        return;
+    }
+    while (__atomic_load_n(&cpus[id].call_pending, __ATOMIC_ACQUIRE)) {
+        asm volatile("pause");
+    }
+}
+
+// Run any call queued for this CPU (called from idle loops)
+void cpu_poll_calls(void) {
+    struct cpu_info* cpu = &cpus[cpu_current_id()];
+
+    if (__atomic_load_n(&cpu->call_pending, __ATOMIC_ACQUIRE)) {
+        cpu->call_fn(cpu->call_arg);
+        __atomic_store_n(&cpu->call_pending, 0, __ATOMIC_RELEASE);
+    }
+}
@@ -0,0 +1,75 @@
+// kernel/cpu.h
+#ifndef CPU_H
+#define CPU_H
+
+#include <stdint.h>
+
+// Maximum number of CPUs the kernel will track
+#define MAX_CPUS 16
+
+// CPU features the kernel cares about (detected on the BSP)
+struct cpu_features {
+    uint32_t pages_1g;              // 1GB pages (CPUID 0x80000001 EDX bit 26)
+    uint32_t pcid;                  // Process-context identifiers (CPUID 1 ECX bit 17)
+    uint32_t invpcid;               // INVPCID instruction (CPUID 7 EBX bit 10)
+    uint32_t tsc_deadline;          // LAPIC TSC-deadline timer mode (CPUID 1 ECX bit 24)
+};
+
+extern struct cpu_features cpu_features;
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf,
+                         uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    asm volatile("cpuid"
+                 : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                 : "a"(leaf), "c"(subleaf));
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    asm volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+// Initial APIC ID of the calling CPU (CPUID 1 EBX bits 31-24); usable
+// before the LAPIC is mapped
+static inline uint32_t cpu_initial_apic_id(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    return ebx >> 24;
+}
+
+// Function run on a remote CPU through cpu_call()
+typedef void (*cpu_call_fn_t)(void* arg);
+
+// Per-CPU bookkeeping
+struct cpu_info {
+    uint32_t id;                    // Dense logical CPU number
+    uint32_t apic_id;               // Local APIC ID
+    volatile uint32_t online;       // CPU is running kernel code
+    volatile uint32_t call_pending; // A cross-CPU call is waiting to run
+    cpu_call_fn_t call_fn;
+    void* call_arg;
+};
+
+// Function prototypes
+void cpu_init(void);
+void cpu_detect_features(void);
+uint32_t cpu_current_id(void);
+uint32_t cpu_online_count(void);
+struct cpu_info* cpu_get(uint32_t id);
+int cpu_register(uint32_t apic_id);
+int cpu_call(uint32_t id, cpu_call_fn_t fn, void* arg);
+void cpu_wait_call(uint32_t id);
+void cpu_poll_calls(void);
+
+#endif
@@ -0,0 +1,163 @@
+// kernel/dma.c
+#include "dma.h"
+#include "pmm.h"
+#include "memory.h"
+#include "spinlock.h"
+#include "drivers/console.h"
+#include <stdint.h>
+
+// Reserved ISA-zone region, handed out in page runs tracked by a bitmap
+static uint64_t isa_pool_base = 0;
+static uint64_t isa_pool_bitmap[DMA_ISA_POOL_PAGES / 64];
+static spinlock_t isa_pool_lock = SPINLOCK_INIT;
+
+static inline int pool_page_used(uint32_t page) {
+    return (isa_pool_bitmap[page / 64] >> (page % 64)) & 1;
+}
+
+static inline void pool_mark(uint32_t first, uint32_t count, int used) {
+    for (uint32_t page = first; page < first + count; page++) {
+        if (used) {
+            isa_pool_bitmap[page / 64] |= 1ULL << (page % 64);
+        } else {
+            isa_pool_bitmap[page / 64] &= ~(1ULL << (page % 64));
+        }
+    }
+}
+
+// First run of free pool pages starting on an align_pages boundary
+// (returns the physical address, or 0 if the pool has no such run)
+static uint64_t pool_alloc(uint32_t pages, uint32_t align_pages) {
+    if (isa_pool_base == 0 || pages > DMA_ISA_POOL_PAGES) {
+        return 0;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&isa_pool_lock);
+
+    for (uint32_t first = 0; first + pages <= DMA_ISA_POOL_PAGES; first += align_pages) {
+        uint32_t n = 0;
+        while (n < pages && !pool_page_used(first + n)) {
+            n++;
+        }
+        if (n == pages) {
+            pool_mark(first, pages, 1);
+            spin_unlock_irqrestore(&isa_pool_lock, flags);
+            return isa_pool_base + (uint64_t)first * PAGE_SIZE;
+        }
+    }
+
+    spin_unlock_irqrestore(&isa_pool_lock, flags);
+    return 0;
+}
+
+static void pool_free(uint64_t phys, size_t size) {
+    uint32_t first = (phys - isa_pool_base) / PAGE_SIZE;
+    uint32_t pages = size / PAGE_SIZE;
+
+    uint64_t flags = spin_lock_irqsave(&isa_pool_lock);
+    pool_mark(first, pages, 0);
+    spin_unlock_irqrestore(&isa_pool_lock, flags);
+}
+
+// Reserve the ISA-zone pool; call once the page allocator is up
+void dma_init(void) {
+    console_write("Initializing DMA allocator...\n");
+
+    void* pool = pmm_alloc_pages_below(DMA_ISA_POOL_ORDER, DMA_ZONE_ISA_LIMIT);
+    if (pool == NULL) {
+        console_write("WARNING: No memory below 16MB for the ISA DMA pool\n");
+        return;
+    }
+
+    isa_pool_base = (uint64_t)pool;
+    for (uint32_t i = 0; i < DMA_ISA_POOL_PAGES / 64; i++) {
+        isa_pool_bitmap[i] = 0;
+    }
+
+    console_write("DMA allocator initialized.\n");
+}
+
+// Allocate a zeroed, physically contiguous buffer of at least size bytes,
+// aligned to align (a power of two, 0 for page alignment) and lying
+// entirely inside zone. A buffer never crosses a boundary of its own
+// rounded-up size, which covers the 64KB rule of IDE PRD entries.
+// Returns 0 on success, -1 on failure.
+int dma_alloc(size_t size, size_t align, uint32_t zone, struct dma_buffer* buf) {
+    if (buf == NULL || size == 0 || zone > DMA_ZONE_ANY) {
+        return -1;
+    }
+    if (align & (align - 1)) {
+        console_write("ERROR: DMA alignment must be a power of two\n");
+        return -1;
+    }
+    if (align < PAGE_SIZE) {
+        align = PAGE_SIZE;
+    }
+
+    // Buddy blocks are naturally aligned to their size, so asking for an
+    // order large enough to cover the alignment satisfies it too
+    uint32_t order = pmm_order_for_size(size > align ? size : align);
+    if (order >= PMM_MAX_ORDER) {
+        console_write("ERROR: DMA buffer too large\n");
+        return -1;
+    }
+
+    uint64_t phys = 0;
+    buf->source = DMA_SOURCE_BUDDY;
+    buf->size = (size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+
+    if (zone == DMA_ZONE_ISA) {
+        // The reserved pool first; the buddy allocator may still have
+        // something low if it is exhausted. The pool base is only aligned
+        // to the pool's own order, so larger alignments skip it.
+        if (order <= DMA_ISA_POOL_ORDER) {
+            phys = pool_alloc(buf->size / PAGE_SIZE, 1U << order);
+        }
+        if (phys != 0) {
+            buf->source = DMA_SOURCE_POOL;
+        } else {
+            phys = (uint64_t)pmm_alloc_pages_below(order, DMA_ZONE_ISA_LIMIT);
+        }
+    } else if (zone == DMA_ZONE_32) {
+        phys = (uint64_t)pmm_alloc_pages_below(order, DMA_ZONE_32_LIMIT);
+    } else {
+        phys = (uint64_t)pmm_alloc_pages(order);
+    }
+
+    if (phys == 0) {
+        console_write("ERROR: Out of memory for DMA buffer\n");
+        return -1;
+    }
+
+    if (buf->source == DMA_SOURCE_BUDDY) {
+        buf->size = (size_t)PAGE_SIZE << order;
+    }
+    buf->phys = phys;
+    buf->virt = phys_to_virt(phys);
+    buf->zone = zone;
+    buf->order = order;
+
+    uint64_t* words = (uint64_t*)buf->virt;
+    for (size_t i = 0; i < buf->size / sizeof(uint64_t); i++) {
+        words[i] = 0;
+    }
+
+    return 0;
+}
+
+// Release a buffer returned by dma_alloc
+void dma_free(struct dma_buffer* buf) {
+    if (buf == NULL || buf->phys == 0) {
+        return;
+    }
+
+    if (buf->source == DMA_SOURCE_POOL) {
+        pool_free(buf->phys, buf->size);
+    } else {
+        pmm_free_pages(buf->phys, buf->order);
+    }
+
+    buf->phys = 0;
+    buf->virt = NULL;
+    buf->size = 0;
+}
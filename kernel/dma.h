@@ -0,0 +1,41 @@
+// kernel/dma.h
+#ifndef DMA_H
+#define DMA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Physical address zones a DMA buffer can be constrained to
+#define DMA_ZONE_ISA    0           // Below 16MB (ISA DMA, legacy controllers)
+#define DMA_ZONE_32     1           // Below 4GB (32-bit bus masters)
+#define DMA_ZONE_ANY    2           // Anywhere in physical memory
+
+#define DMA_ZONE_ISA_LIMIT 0x1000000ULL
+#define DMA_ZONE_32_LIMIT  0x100000000ULL
+
+// Contiguous region reserved below 16MB at boot so ISA-zone requests still
+// succeed once the buddy allocator has fragmented low memory
+#define DMA_ISA_POOL_ORDER 8        // 2^8 pages (1MB)
+#define DMA_ISA_POOL_PAGES (1U << DMA_ISA_POOL_ORDER)
+
+// Where a buffer's pages came from
+#define DMA_SOURCE_POOL  0
+#define DMA_SOURCE_BUDDY 1
+
+// A physically contiguous buffer. The kernel reaches it through the direct
+// map; x86 DMA is cache-coherent, so no flushing is needed around transfers.
+struct dma_buffer {
+    void* virt;                     // Kernel virtual address
+    uint64_t phys;                  // Bus/physical address for the device
+    size_t size;                    // Usable bytes (rounded up to whole pages)
+    uint32_t zone;
+    uint32_t source;
+    uint32_t order;                 // Buddy order (buddy buffers only)
+};
+
+// Function prototypes
+void dma_init(void);
+int dma_alloc(size_t size, size_t align, uint32_t zone, struct dma_buffer* buf);
+void dma_free(struct dma_buffer* buf);
+
+#endif
@@ -79,6 +79,31 @@ void console_write(const char* data) {
     }
 }
 
+// In số thập phân không dấu
+void console_write_dec(uint64_t value) {
+    char buf[21];
+    int i = 20;
+    buf[i] = '\0';
+    do {
+        buf[--i] = '0' + (value % 10);
+        value /= 10;
+    } while (value != 0);
+    console_write(&buf[i]);
+}
+
+// In số hex (không có tiền tố 0x)
+void console_write_hex(uint64_t value) {
+    const char* digits = "0123456789ABCDEF";
+    char buf[17];
+    int i = 16;
+    buf[i] = '\0';
+    do {
+        buf[--i] = digits[value & 0xF];
+        value >>= 4;
+    } while (value != 0);
+    console_write(&buf[i]);
+}
+
 
 // kernel/drivers/console.c
 
@@ -16,6 +16,8 @@ struct console {
 void console_initialize(void);
 void console_putchar(char c);
 void console_write(const char* data);
+void console_write_dec(uint64_t value);
+void console_write_hex(uint64_t value);
 void console_clear(void);
 void console_scroll(void);                    // THÊM DÒNG NÀY
 void console_update_cursor(void);             // THÊM DÒNG NÀY
@@ -2,11 +2,41 @@
 #include "loader.h"
 #include "drivers/console.h"
 #include "memory.h"
+#include "slab.h"
+#include "pmm.h"
 #include "fs/vfs.h"
 #include "process.h"
 #include <stdint.h>
 #include <string.h>
 
+// Program header tables with up to this many entries come from a slab cache
+#define ELF_PHDR_CACHE_ENTRIES 16
+
+static struct kmem_cache* elf_phdr_cache = NULL;
+
+// Allocate a program header table
+static Elf64_Phdr* elf_alloc_phdrs(uint32_t ph_size) {
+    if (ph_size > ELF_PHDR_CACHE_ENTRIES * sizeof(Elf64_Phdr)) {
+        return (Elf64_Phdr*)kmalloc(ph_size);
+    }
+    if (elf_phdr_cache == NULL) {
+        elf_phdr_cache = kmem_cache_create("elf_phdrs", ELF_PHDR_CACHE_ENTRIES * sizeof(Elf64_Phdr), 0, NULL);
+        if (elf_phdr_cache == NULL) {
+            return (Elf64_Phdr*)kmalloc(ph_size);
+        }
+    }
+    return (Elf64_Phdr*)kmem_cache_alloc(elf_phdr_cache);
+}
+
+// Free a program header table from elf_alloc_phdrs()
+static void elf_free_phdrs(Elf64_Phdr* phdrs, uint32_t ph_size) {
+    if (ph_size > ELF_PHDR_CACHE_ENTRIES * sizeof(Elf64_Phdr) || elf_phdr_cache == NULL) {
+        kfree(phdrs);
+    } else {
+        kmem_cache_free(elf_phdr_cache, phdrs);
+    }
+}
+
 // Load an ELF executable from a file
 int elf_load(const char* filename, struct process* proc) {
     console_write("Loading ELF executable: ");
@@ -72,7 +102,7 @@ int elf_load(const char* filename, struct process* proc) {
     
     // Read all program headers
     uint32_t ph_size = ehdr.e_phnum * ehdr.e_phentsize;
-    Elf64_Phdr* phdrs = (Elf64_Phdr*)kmalloc(ph_size);
+    Elf64_Phdr* phdrs = elf_alloc_phdrs(ph_size);
     if (!phdrs) {
         console_write("ERROR: Failed to allocate memory for program headers\n");
         vfs_close(&file);
@@ -81,7 +111,7 @@ int elf_load(const char* filename, struct process* proc) {
     
     if (!vfs_read(&file, phdrs, ph_size, &bytes_read) || bytes_read != ph_size) {
         console_write("ERROR: Failed to read program headers\n");
-        kfree(phdrs);
+        elf_free_phdrs(phdrs, ph_size);
         vfs_close(&file);
         return 0;
     }
@@ -100,12 +130,13 @@ int elf_load(const char* filename, struct process* proc) {
         uint64_t end_page = (phdr->p_vaddr + phdr->p_memsz + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
         uint64_t num_pages = (end_page - start_page) / PAGE_SIZE;
         
-        // Allocate and map pages
+        // Allocate and map pages; zeroed pages leave BSS and the slack
+        // around the file data cleared without touching them again
         for (uint64_t page = 0; page < num_pages; page++) {
-            void* phys_page = alloc_physical_page();
+            void* phys_page = pmm_alloc_page_flags(PMM_ALLOC_ZERO);
             if (!phys_page) {
                 console_write("ERROR: Failed to allocate physical page\n");
-                kfree(phdrs);
+                elf_free_phdrs(phdrs, ph_size);
                 vfs_close(&file);
                 return 0;
             }
@@ -121,10 +152,11 @@ int elf_load(const char* filename, struct process* proc) {
                 flags |= PAGE_USER;
             }
             
-            // Map the page
-            if (map_page(virt_addr, (uint64_t)phys_page, flags) != 0) {
+            // Map the page writable so the segment can be copied in; read-only
+            // segments are write-protected once loaded (CR0.WP is set)
+            if (map_page(virt_addr, (uint64_t)phys_page, flags | PAGE_WRITABLE) != 0) {
                 console_write("ERROR: Failed to map page\n");
-                kfree(phdrs);
+                elf_free_phdrs(phdrs, ph_size);
                 vfs_close(&file);
                 return 0;
             }
@@ -133,7 +165,7 @@ int elf_load(const char* filename, struct process* proc) {
         // Seek to segment data in file
         if (!vfs_seek(&file, phdr->p_offset, 0)) {
             console_write("ERROR: Failed to seek to segment data\n");
-            kfree(phdrs);
+            elf_free_phdrs(phdrs, ph_size);
             vfs_close(&file);
             return 0;
         }
@@ -145,7 +177,7 @@ int elf_load(const char* filename, struct process* proc) {
             uint8_t* buffer = (uint8_t*)kmalloc(phdr->p_filesz);
             if (!buffer) {
                 console_write("ERROR: Failed to allocate buffer for segment data\n");
-                kfree(phdrs);
+                elf_free_phdrs(phdrs, ph_size);
                 vfs_close(&file);
                 return 0;
             }
@@ -153,7 +185,7 @@ int elf_load(const char* filename, struct process* proc) {
             if (!vfs_read(&file, buffer, phdr->p_filesz, &bytes_read) || bytes_read != phdr->p_filesz) {
                 console_write("ERROR: Failed to read segment data\n");
                 kfree(buffer);
-                kfree(phdrs);
+                elf_free_phdrs(phdrs, ph_size);
                 vfs_close(&file);
                 return 0;
             }
@@ -166,16 +198,17 @@ int elf_load(const char* filename, struct process* proc) {
             kfree(buffer);
         }
         
-        // Zero out BSS section (if memsz > filesz)
-        if (phdr->p_memsz > phdr->p_filesz) {
-            uint64_t bss_start = phdr->p_vaddr + phdr->p_filesz;
-            uint64_t bss_size = phdr->p_memsz - phdr->p_filesz;
-            memset((void*)bss_start, 0, bss_size);
+        if (!(phdr->p_flags & PF_W)) {
+            uint64_t flags = PAGE_PRESENT;
+            if (start_page >= 0x100000000) { // User space address
+                flags |= PAGE_USER;
+            }
+            protect_range(start_page, num_pages * PAGE_SIZE, flags);
         }
     }
     
     // Clean up
-    kfree(phdrs);
+    elf_free_phdrs(phdrs, ph_size);
     vfs_close(&file);
     
     console_write("ELF executable loaded successfully\n");
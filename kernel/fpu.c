@@ -0,0 +1,302 @@
+// kernel/fpu.c
+#include "fpu.h"
+#include "cpu.h"
+#include "scheduler.h"
+#include "slab.h"
+#include "spinlock.h"
+#include "drivers/console.h"
+#include <stdint.h>
+#include <stddef.h>
+
+// Control register bits
+#define CR0_MP          (1ULL << 1)     // WAIT/FWAIT honours TS
+#define CR0_EM          (1ULL << 2)     // No FPU present (must be clear)
+#define CR0_TS          (1ULL << 3)     // Task switched: next FPU/SIMD use raises #NM
+#define CR0_NE          (1ULL << 5)     // Native x87 error reporting
+#define CR4_OSFXSR      (1ULL << 9)
+#define CR4_OSXMMEXCPT  (1ULL << 10)
+#define CR4_OSXSAVE     (1ULL << 18)
+
+// Supervisor state components for XSAVES (none are used)
+#define IA32_XSS_MSR 0xDA0
+
+// XSAVE header fields, following the 512-byte legacy region
+#define XSAVE_HEADER_OFFSET 512
+#define XCOMP_BV_COMPACTED  (1ULL << 63)
+
+// Whose state a CPU's FPU registers hold
+struct fpu_cpu {
+    struct task* loaded;            // Task whose state is live (NULL if none)
+    uint32_t kernel_depth;          // kernel_fpu_begin() nesting
+    uint64_t irq_flags;             // Restored by the outermost kernel_fpu_end()
+} __attribute__((aligned(64)));
+
+struct fpu_config fpu_config;
+
+static struct fpu_cpu fpu_cpus[MAX_CPUS];
+static struct kmem_cache* fpu_cache = NULL;
+
+static inline uint64_t read_cr0(void) {
+    uint64_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
+static inline void write_cr0(uint64_t cr0) {
+    asm volatile("mov %0, %%cr0" : : "r"(cr0));
+}
+
+static inline uint64_t read_cr4(void) {
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static inline void write_cr4(uint64_t cr4) {
+    asm volatile("mov %0, %%cr4" : : "r"(cr4));
+}
+
+static inline void clts(void) {
+    asm volatile("clts");
+}
+
+static inline void stts(void) {
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+static inline void xsetbv(uint32_t reg, uint64_t value) {
+    asm volatile("xsetbv" : : "c"(reg), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+// Save the live registers into area
+static void fpu_save(void* area) {
+    uint32_t lo = (uint32_t)fpu_config.xcr0;
+    uint32_t hi = (uint32_t)(fpu_config.xcr0 >> 32);
+
+    switch (fpu_config.mode) {
+    case FPU_SAVE_XSAVES:
+        asm volatile("xsaves64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+        break;
+    case FPU_SAVE_XSAVEOPT:
+        asm volatile("xsaveopt64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+        break;
+    case FPU_SAVE_XSAVE:
+        asm volatile("xsave64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+        break;
+    default:
+        asm volatile("fxsave64 (%0)" : : "r"(area) : "memory");
+        break;
+    }
+}
+
+// Load the registers from area
+static void fpu_restore(void* area) {
+    uint32_t lo = (uint32_t)fpu_config.xcr0;
+    uint32_t hi = (uint32_t)(fpu_config.xcr0 >> 32);
+
+    switch (fpu_config.mode) {
+    case FPU_SAVE_XSAVES:
+        asm volatile("xrstors64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+        break;
+    case FPU_SAVE_XSAVEOPT:
+    case FPU_SAVE_XSAVE:
+        asm volatile("xrstor64 (%0)" : : "r"(area), "a"(lo), "d"(hi) : "memory");
+        break;
+    default:
+        asm volatile("fxrstor64 (%0)" : : "r"(area) : "memory");
+        break;
+    }
+}
+
+// Fill a new save area with the power-up state. An empty XSAVE header
+// marks every component as in its initial configuration, so the first
+// restore only has to touch the legacy control words.
+static void fpu_state_init(void* area) {
+    uint8_t* bytes = (uint8_t*)area;
+    for (uint32_t i = 0; i < fpu_config.size; i++) {
+        bytes[i] = 0;
+    }
+
+    *(uint16_t*)(bytes + 0) = 0x037F;       // FCW: all x87 exceptions masked
+    *(uint32_t*)(bytes + 24) = 0x1F80;      // MXCSR: all SSE exceptions masked
+
+    if (fpu_config.mode == FPU_SAVE_XSAVES) {
+        *(uint64_t*)(bytes + XSAVE_HEADER_OFFSET + 8) = XCOMP_BV_COMPACTED | fpu_config.xcr0;
+    }
+}
+
+// Pick the save instructions and area size from CPUID and set up the BSP
+void fpu_init(void) {
+    console_write("Initializing FPU...\n");
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+
+    fpu_config.mode = FPU_SAVE_FXSAVE;
+    fpu_config.size = FPU_FXSAVE_SIZE;
+    fpu_config.xcr0 = 0;
+
+    if ((ecx >> 26) & 1) {
+        cpuid(0xD, 0, &eax, &ebx, &ecx, &edx);
+        uint64_t xcr0 = (((uint64_t)edx << 32) | eax) & XFEATURE_SUPPORTED;
+        if ((xcr0 & XFEATURE_AVX512) != XFEATURE_AVX512) {
+            xcr0 &= ~XFEATURE_AVX512;
+        }
+        fpu_config.xcr0 = xcr0 | XFEATURE_X87 | XFEATURE_SSE;
+
+        cpuid(0xD, 1, &eax, &ebx, &ecx, &edx);
+        if ((eax >> 3) & 1) {
+            fpu_config.mode = FPU_SAVE_XSAVES;
+        } else if (eax & 1) {
+            fpu_config.mode = FPU_SAVE_XSAVEOPT;
+        } else {
+            fpu_config.mode = FPU_SAVE_XSAVE;
+        }
+    }
+
+    fpu_init_cpu();
+
+    // Area sizes depend on the enabled components, so ask once XCR0 is set
+    if (fpu_config.mode == FPU_SAVE_XSAVES) {
+        cpuid(0xD, 1, &eax, &ebx, &ecx, &edx);
+        fpu_config.size = ebx;
+    } else if (fpu_config.mode != FPU_SAVE_FXSAVE) {
+        cpuid(0xD, 0, &eax, &ebx, &ecx, &edx);
+        fpu_config.size = ebx;
+    }
+
+    fpu_cache = kmem_cache_create("fpu_state", fpu_config.size, FPU_STATE_ALIGN, NULL);
+    if (fpu_cache == NULL) {
+        console_write("ERROR: Failed to create the FPU state cache\n");
+    }
+
+    static const char* const mode_names[] = { "FXSAVE", "XSAVE", "XSAVEOPT", "XSAVES" };
+    console_write("FPU initialized (");
+    console_write(mode_names[fpu_config.mode]);
+    console_write(", ");
+    console_write_dec(fpu_config.size);
+    console_write(" byte state).\n");
+}
+
+// Enable x87/SSE/AVX on the calling CPU and arm lazy switching
+void fpu_init_cpu(void) {
+    uint64_t cr4 = read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (fpu_config.mode != FPU_SAVE_FXSAVE) {
+        cr4 |= CR4_OSXSAVE;
+    }
+    write_cr4(cr4);
+
+    if (fpu_config.mode != FPU_SAVE_FXSAVE) {
+        xsetbv(0, fpu_config.xcr0);
+    }
+    if (fpu_config.mode == FPU_SAVE_XSAVES) {
+        wrmsr(IA32_XSS_MSR, 0);
+    }
+
+    write_cr0((read_cr0() & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+    asm volatile("fninit");
+
+    fpu_cpus[cpu_current_id()].loaded = NULL;
+    fpu_cpus[cpu_current_id()].kernel_depth = 0;
+
+    // Nobody owns the registers yet; the first user faults them in
+    stts();
+}
+
+// Device-not-available (#NM) handler: the running task touched the FPU
+// with CR0.TS set. Give it its registers back, skipping the restore if
+// they still hold its state from the last time it ran on this CPU.
+// Returns 0 when handled.
+int fpu_handle_nm(void) {
+    uint32_t cpu = cpu_current_id();
+    struct fpu_cpu* fc = &fpu_cpus[cpu];
+    struct task* task = scheduler_get_current_task();
+
+    clts();
+    if (task == NULL) {
+        fc->loaded = NULL;
+        return 0;
+    }
+    if (fc->loaded == task && task->fpu_cpu == cpu) {
+        return 0;
+    }
+
+    if (task->fpu == NULL) {
+        task->fpu = fpu_cache ? kmem_cache_alloc(fpu_cache) : NULL;
+        if (task->fpu == NULL) {
+            // Run on with whatever is in the registers; nothing is saved
+            console_write("ERROR: Out of memory for FPU state\n");
+            fc->loaded = NULL;
+            return 0;
+        }
+        fpu_state_init(task->fpu);
+    }
+
+    fpu_restore(task->fpu);
+    fc->loaded = task;
+    task->fpu_cpu = cpu;
+    return 0;
+}
+
+// Called as a task leaves the CPU (interrupts off). If it used the FPU
+// during this run its state is saved; XSAVEOPT/XSAVES then also skip
+// components still in their initial state or unchanged since the
+// restore. A task that never touched the FPU costs one CR0 read.
+void fpu_switch_out(struct task* task) {
+    if (read_cr0() & CR0_TS) {
+        return;
+    }
+
+    struct fpu_cpu* fc = &fpu_cpus[cpu_current_id()];
+    if (fc->loaded == task && task->fpu != NULL) {
+        fpu_save(task->fpu);
+    }
+    stts();
+}
+
+// Drop a task slot's FPU state before the slot is reused
+void fpu_task_release(struct task* task) {
+    if (task->fpu != NULL) {
+        kmem_cache_free(fpu_cache, task->fpu);
+        task->fpu = NULL;
+    }
+    task->fpu_cpu = FPU_CPU_NONE;
+}
+
+// Let kernel code use SSE/AVX registers until kernel_fpu_end(). The
+// running task's live state is saved first, and interrupts stay off for
+// the duration so nothing can switch away mid-use. Code between the two
+// calls must not sleep. Regions may nest.
+void kernel_fpu_begin(void) {
+    uint64_t flags = local_irq_save();
+    struct fpu_cpu* fc = &fpu_cpus[cpu_current_id()];
+
+    if (fc->kernel_depth++ > 0) {
+        return;
+    }
+    fc->irq_flags = flags;
+
+    if (read_cr0() & CR0_TS) {
+        clts();
+    } else if (fc->loaded != NULL && fc->loaded->fpu != NULL) {
+        fpu_save(fc->loaded->fpu);
+    }
+
+    // The registers are the kernel's now; the task reloads on next use
+    fc->loaded = NULL;
+}
+
+// End a kernel_fpu_begin() region
+void kernel_fpu_end(void) {
+    struct fpu_cpu* fc = &fpu_cpus[cpu_current_id()];
+    if (fc->kernel_depth == 0) {
+        console_write("ERROR: kernel_fpu_end without kernel_fpu_begin\n");
+        return;
+    }
+    if (--fc->kernel_depth > 0) {
+        return;
+    }
+
+    stts();
+    local_irq_restore(fc->irq_flags);
+}
@@ -0,0 +1,50 @@
+// kernel/fpu.h
+#ifndef FPU_H
+#define FPU_H
+
+#include <stdint.h>
+
+struct task;
+
+// State components the kernel enables in XCR0 when the CPU has them
+#define XFEATURE_X87        (1ULL << 0)
+#define XFEATURE_SSE        (1ULL << 1)
+#define XFEATURE_AVX        (1ULL << 2)
+#define XFEATURE_OPMASK     (1ULL << 5)
+#define XFEATURE_ZMM_HI256  (1ULL << 6)
+#define XFEATURE_HI16_ZMM   (1ULL << 7)
+#define XFEATURE_AVX512     (XFEATURE_OPMASK | XFEATURE_ZMM_HI256 | XFEATURE_HI16_ZMM)
+#define XFEATURE_SUPPORTED  (XFEATURE_X87 | XFEATURE_SSE | XFEATURE_AVX | XFEATURE_AVX512)
+
+// Size of the legacy FXSAVE image, used when XSAVE is missing
+#define FPU_FXSAVE_SIZE     512
+// XSAVE areas must be 64-byte aligned
+#define FPU_STATE_ALIGN     64
+
+// task.fpu_cpu when the task's state is loaded on no CPU
+#define FPU_CPU_NONE        0xFFFFFFFF
+
+// How the extended state is saved, chosen once at boot
+#define FPU_SAVE_FXSAVE     0
+#define FPU_SAVE_XSAVE      1
+#define FPU_SAVE_XSAVEOPT   2       // Skips components unchanged since the last restore
+#define FPU_SAVE_XSAVES     3       // Compacted format plus the init and modified optimizations
+
+struct fpu_config {
+    uint32_t mode;                  // FPU_SAVE_*
+    uint32_t size;                  // Bytes per save area (CPUID 0xD)
+    uint64_t xcr0;                  // Components enabled in XCR0
+};
+
+extern struct fpu_config fpu_config;
+
+// Function prototypes
+void fpu_init(void);
+void fpu_init_cpu(void);
+int fpu_handle_nm(void);
+void fpu_switch_out(struct task* task);
+void fpu_task_release(struct task* task);
+void kernel_fpu_begin(void);
+void kernel_fpu_end(void);
+
+#endif
@@ -3,11 +3,13 @@
 #include "../drivers/ata.h"
 #include "../drivers/console.h"
 #include "../memory.h"
+#include "../slab.h"
+#include "../vmalloc.h"
 #include <stdint.h>
 #include <string.h>
 
-// Global FAT operations structure
-static struct vfs_filesystem_ops fat_ops = {
+// Global FAT operations structure, for registering the driver with the VFS
+struct vfs_filesystem_ops fat_ops = {
     .mount = fat_mount,
     .unmount = fat_unmount,
     .open = fat_open,
@@ -21,6 +23,9 @@ static struct vfs_filesystem_ops fat_ops = {
     .stat = fat_stat
 };
 
+// Object cache for per-open-file FAT state
+static struct kmem_cache* fat_file_cache = NULL;
+
 // Helper function to convert cluster to sector
 static uint32_t cluster_to_sector(struct fat_filesystem* fat_fs, uint32_t cluster) {
     if (cluster < 2) {
@@ -66,7 +71,7 @@ static int lookup_file_in_dir(struct fat_filesystem* fat_fs, uint32_t dir_cluste
     fat_name[11] = '\0';
     
     const char* dot_pos = strchr(filename, '.');
-    int name_len = dot_pos ? (dot_pos - filename) : strlen(filename);
+    int name_len = dot_pos ? (int)(dot_pos - filename) : (int)strlen(filename);
     if (name_len > 8) name_len = 8;
     
     for (int i = 0; i < name_len; i++) {
@@ -94,7 +99,7 @@ static int lookup_file_in_dir(struct fat_filesystem* fat_fs, uint32_t dir_cluste
         }
         
         struct fat_dirent* dir_entry = (struct fat_dirent*)cluster_buffer;
-        for (int i = 0; i < (fat_fs->cluster_size / sizeof(struct fat_dirent)); i++) {
+        for (uint32_t i = 0; i < fat_fs->cluster_size / sizeof(struct fat_dirent); i++) {
             if (dir_entry[i].name[0] == 0x00) {
                 // End of directory
                 return 0;
@@ -122,6 +127,7 @@ static int lookup_file_in_dir(struct fat_filesystem* fat_fs, uint32_t dir_cluste
 
 // Mount FAT filesystem
 int fat_mount(struct vfs_filesystem* vfs_fs, void* device) {
+    (void)device; // Always the primary master for now
     console_write("Mounting FAT filesystem...\n");
     
     struct fat_filesystem* fat_fs = (struct fat_filesystem*)vfs_fs;
@@ -137,7 +143,7 @@ int fat_mount(struct vfs_filesystem* vfs_fs, void* device) {
     memcpy(&fat_fs->boot, boot_sector, sizeof(struct fat_boot_sector));
     
     // Determine FAT type based on sector count and cluster count
-    uint32_t root_dir_sectors = ((fat_fs->boot.fat16.root_entries * 32) + 
+    uint32_t root_dir_sectors = ((fat_fs->boot.root_entries * 32) + 
                                 (fat_fs->boot.bytes_per_sector - 1)) / 
                                 fat_fs->boot.bytes_per_sector;
     
@@ -185,8 +191,18 @@ int fat_mount(struct vfs_filesystem* vfs_fs, void* device) {
     // Print cluster count (in hex would require hex printing function)
     console_write("\n");
     
-    // Read FAT into memory
-    fat_fs->fat = (uint8_t*)kmalloc(fat_size * fat_fs->boot.bytes_per_sector);
+    // Create the open-file cache on first mount
+    if (fat_file_cache == NULL) {
+        fat_file_cache = kmem_cache_create("fat_file", sizeof(struct fat_file), 0, NULL);
+        if (fat_file_cache == NULL) {
+            console_write("Failed to create FAT file cache\n");
+            return 0;
+        }
+    }
+    
+    // Read FAT into memory; on FAT32 volumes it runs to megabytes, so it
+    // comes from the vmalloc range rather than the heap
+    fat_fs->fat = (uint8_t*)vmalloc(fat_size * fat_fs->boot.bytes_per_sector);
     if (!fat_fs->fat) {
         console_write("Failed to allocate memory for FAT\n");
         return 0;
@@ -196,7 +212,8 @@ int fat_mount(struct vfs_filesystem* vfs_fs, void* device) {
         if (!ata_read_sector(ATA_DEVICE_PRIMARY_MASTER, fat_fs->fat_start + i, 
                             fat_fs->fat + (i * fat_fs->boot.bytes_per_sector))) {
             console_write("Failed to read FAT sector\n");
-            kfree(fat_fs->fat);
+            vfree(fat_fs->fat);
+            fat_fs->fat = NULL;
             return 0;
         }
     }
@@ -210,7 +227,7 @@ int fat_unmount(struct vfs_filesystem* vfs_fs) {
     struct fat_filesystem* fat_fs = (struct fat_filesystem*)vfs_fs;
     
     if (fat_fs->fat) {
-        kfree(fat_fs->fat);
+        vfree(fat_fs->fat);
         fat_fs->fat = NULL;
     }
     
@@ -221,7 +238,6 @@ int fat_unmount(struct vfs_filesystem* vfs_fs) {
 // Open file in FAT filesystem
 int fat_open(struct vfs_file* vfs_file, const char* path, uint32_t flags) {
     struct fat_filesystem* fat_fs = (struct fat_filesystem*)vfs_file->filesystem;
-    struct fat_file* fat_file = (struct fat_file*)vfs_file->private_data;
     
     // For now, just find the root directory cluster
     uint32_t root_cluster = fat_fs->root_cluster;
@@ -251,6 +267,11 @@ int fat_open(struct vfs_file* vfs_file, const char* path, uint32_t flags) {
     vfs_file->attributes = dirent.attr;
     
     // Set up FAT-specific file structure
+    struct fat_file* fat_file = (struct fat_file*)kmem_cache_alloc(fat_file_cache);
+    if (!fat_file) {
+        return 0;
+    }
+    vfs_file->private_data = fat_file;
     fat_file->first_cluster = (dirent.fst_clus_hi << 16) | dirent.fst_clus_lo;
     fat_file->current_cluster = fat_file->first_cluster;
     fat_file->cluster_offset = 0;
@@ -260,7 +281,11 @@ int fat_open(struct vfs_file* vfs_file, const char* path, uint32_t flags) {
 
 // Close file in FAT filesystem
 int fat_close(struct vfs_file* vfs_file) {
-    // Nothing special to do for FAT
+    // Release the FAT-specific file state
+    if (vfs_file->private_data) {
+        kmem_cache_free(fat_file_cache, vfs_file->private_data);
+        vfs_file->private_data = NULL;
+    }
     return 1;
 }
 
@@ -319,23 +344,26 @@ int fat_read(struct vfs_file* vfs_file, void* buffer, uint32_t size, uint32_t* b
 // Write to file in FAT filesystem (placeholder)
 int fat_write(struct vfs_file* vfs_file, const void* buffer, uint32_t size, uint32_t* bytes_written) {
     // For now, just return error as we don't implement writing
+    (void)vfs_file;
+    (void)buffer;
+    (void)size;
     *bytes_written = 0;
     return 0;
 }
 
 // Seek in file
 int fat_seek(struct vfs_file* vfs_file, int32_t offset, int whence) {
-    uint32_t new_pos;
+    int64_t new_pos;
     
     switch (whence) {
         case 0: // SEEK_SET
             new_pos = offset;
             break;
         case 1: // SEEK_CUR
-            new_pos = vfs_file->position + offset;
+            new_pos = (int64_t)vfs_file->position + offset;
             break;
         case 2: // SEEK_END
-            new_pos = vfs_file->size + offset;
+            new_pos = (int64_t)vfs_file->size + offset;
             break;
         default:
             return 0; // Invalid whence
@@ -349,7 +377,7 @@ int fat_seek(struct vfs_file* vfs_file, int32_t offset, int whence) {
         new_pos = 0;
     }
     
-    vfs_file->position = new_pos;
+    vfs_file->position = (uint32_t)new_pos;
     return 1; // Success
 }
 
@@ -365,7 +393,7 @@ int fat_opendir(struct vfs_file* vfs_dir, const char* path) {
     
     // For now, just set up to read root directory
     // In a complete implementation, we'd find the actual directory
-    vfs_dir->private_data = (void*)fat_fs->root_cluster;
+    vfs_dir->private_data = (void*)(uintptr_t)fat_fs->root_cluster;
     
     strcpy(vfs_dir->path, path);
     vfs_dir->flags = VFS_MODE_READ;
@@ -378,11 +406,15 @@ int fat_opendir(struct vfs_file* vfs_dir, const char* path) {
 struct vfs_dirent* fat_readdir(struct vfs_file* vfs_dir, uint32_t index) {
     // For now, return NULL as we don't implement directory reading
     // This would require implementing directory traversal
+    (void)vfs_dir;
+    (void)index;
     return NULL;
 }
 
 // Get file stats
 int fat_stat(const char* path, struct vfs_dirent* entry) {
     // For now, return failure as we don't implement this
+    (void)path;
+    (void)entry;
     return 0;
 }
\ No newline at end of file
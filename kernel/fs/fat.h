@@ -138,4 +138,6 @@ int fat_opendir(struct vfs_file* vfs_dir, const char* path);
 struct vfs_dirent* fat_readdir(struct vfs_file* vfs_dir, uint32_t index);
 int fat_stat(const char* path, struct vfs_dirent* entry);
 
+extern struct vfs_filesystem_ops fat_ops;
+
 #endif // FAT_H
\ No newline at end of file
@@ -0,0 +1,46 @@
+// kernel/gdt.c
+#include "gdt.h"
+#include "cpu.h"
+#include <stdint.h>
+
+// Flat 64-bit descriptors (base and limit are ignored in long mode)
+#define GDT_DESC_KERNEL_CODE 0x00AF9A000000FFFFULL  // Present, DPL 0, code, L=1
+#define GDT_DESC_KERNEL_DATA 0x00CF92000000FFFFULL  // Present, DPL 0, data, writable
+#define GDT_DESC_USER_CODE   0x00AFFA000000FFFFULL  // Present, DPL 3, code, L=1
+#define GDT_DESC_USER_DATA   0x00CFF2000000FFFFULL  // Present, DPL 3, data, writable
+
+// One table per CPU so per-CPU descriptors (a TSS) can be added later
+static uint64_t gdts[MAX_CPUS][GDT_ENTRIES] __attribute__((aligned(16)));
+
+// Build and load the kernel GDT on the calling CPU and reload every
+// segment register from it
+void gdt_init_cpu(uint32_t cpu) {
+    if (cpu >= MAX_CPUS) {
+        return;
+    }
+
+    uint64_t* gdt = gdts[cpu];
+    gdt[0] = 0;
+    gdt[GDT_KERNEL_CODE / 8] = GDT_DESC_KERNEL_CODE;
+    gdt[GDT_KERNEL_DATA / 8] = GDT_DESC_KERNEL_DATA;
+    gdt[GDT_USER_CODE / 8] = GDT_DESC_USER_CODE;
+    gdt[GDT_USER_DATA / 8] = GDT_DESC_USER_DATA;
+
+    struct gdt_ptr ptr;
+    ptr.limit = sizeof(gdts[cpu]) - 1;
+    ptr.base = (uint64_t)gdt;
+
+    asm volatile("lgdt %0\n\t"
+                 "pushq %1\n\t"
+                 "leaq 1f(%%rip), %%rax\n\t"
+                 "pushq %%rax\n\t"
+                 "lretq\n"
+                 "1:\n\t"
+                 "movw %w2, %%ds\n\t"
+                 "movw %w2, %%es\n\t"
+                 "movw %w2, %%fs\n\t"
+                 "movw %w2, %%gs\n\t"
+                 "movw %w2, %%ss"
+                 : : "m"(ptr), "i"((uint64_t)GDT_KERNEL_CODE), "r"((uint64_t)GDT_KERNEL_DATA)
+                 : "rax", "memory");
+}
@@ -0,0 +1,24 @@
+// kernel/gdt.h
+#ifndef GDT_H
+#define GDT_H
+
+#include <stdint.h>
+
+// Segment selectors used throughout the kernel
+#define GDT_KERNEL_CODE 0x08
+#define GDT_KERNEL_DATA 0x10
+#define GDT_USER_CODE   0x18
+#define GDT_USER_DATA   0x20
+
+#define GDT_ENTRIES 5
+
+// GDT pointer structure for lgdt
+struct gdt_ptr {
+    uint16_t limit;
+    uint64_t base;
+} __attribute__((packed));
+
+// Function prototypes
+void gdt_init_cpu(uint32_t cpu);
+
+#endif
@@ -0,0 +1,83 @@
+// kernel/idr.c
+#include "idr.h"
+#include "memory.h"
+#include "pmm.h"
+#include "drivers/console.h"
+#include <stdint.h>
+#include <stddef.h>
+
+// Allocate the lowest free ID and map it to ptr. Returns the ID, or -1 if
+// every ID is taken or the lookup leaf could not be allocated.
+int idr_alloc(struct idr* idr, void* ptr) {
+    uint64_t flags = spin_lock_irqsave(&idr->lock);
+
+    int id = -1;
+    for (uint32_t s = 0; s < IDR_SUMMARY_WORDS; s++) {
+        uint64_t words = ~idr->full[s];
+        if (words == 0) {
+            continue;
+        }
+        uint32_t word = s * 64 + __builtin_ctzll(words);
+        id = word * 64 + __builtin_ctzll(~idr->used[word]);
+        break;
+    }
+    if (id < 0) {
+        spin_unlock_irqrestore(&idr->lock, flags);
+        return -1;
+    }
+
+    void** leaf = idr->leaves[id / IDR_LEAF_SIZE];
+    if (leaf == NULL) {
+        void* page = pmm_alloc_page_flags(PMM_ALLOC_ZERO);
+        if (page == NULL) {
+            spin_unlock_irqrestore(&idr->lock, flags);
+            console_write("ERROR: Out of memory for an ID table leaf\n");
+            return -1;
+        }
+        leaf = (void**)phys_to_virt((uint64_t)page);
+        __atomic_store_n(&idr->leaves[id / IDR_LEAF_SIZE], leaf, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&leaf[id % IDR_LEAF_SIZE], ptr, __ATOMIC_RELEASE);
+
+    uint32_t word = id / 64;
+    idr->used[word] |= 1ULL << (id % 64);
+    if (idr->used[word] == ~0ULL) {
+        idr->full[word / 64] |= 1ULL << (word % 64);
+    }
+    idr->count++;
+
+    spin_unlock_irqrestore(&idr->lock, flags);
+    return id;
+}
+
+// Release an ID; it may be handed out again straight away
+void idr_remove(struct idr* idr, uint32_t id) {
+    if (id >= IDR_MAX_IDS) {
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&idr->lock);
+
+    uint32_t word = id / 64;
+    if (idr->used[word] & (1ULL << (id % 64))) {
+        __atomic_store_n(&idr->leaves[id / IDR_LEAF_SIZE][id % IDR_LEAF_SIZE], NULL, __ATOMIC_RELEASE);
+        idr->used[word] &= ~(1ULL << (id % 64));
+        idr->full[word / 64] &= ~(1ULL << (word % 64));
+        idr->count--;
+    }
+
+    spin_unlock_irqrestore(&idr->lock, flags);
+}
+
+// Pointer mapped to an ID, or NULL if it is not allocated. Takes no lock;
+// keeping the object alive is up to the caller.
+void* idr_find(struct idr* idr, uint32_t id) {
+    if (id >= IDR_MAX_IDS) {
+        return NULL;
+    }
+    void** leaf = __atomic_load_n(&idr->leaves[id / IDR_LEAF_SIZE], __ATOMIC_ACQUIRE);
+    if (leaf == NULL) {
+        return NULL;
+    }
+    return __atomic_load_n(&leaf[id % IDR_LEAF_SIZE], __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,35 @@
+// kernel/idr.h
+#ifndef IDR_H
+#define IDR_H
+
+#include <stdint.h>
+#include "spinlock.h"
+
+// Integer ID allocator with ID-to-pointer lookup, used for task IDs and
+// PIDs. Allocation hands out the lowest free ID by walking a two-level
+// bitmap (a summary bit per full 64-ID word), so its cost is bounded by
+// IDR_SUMMARY_WORDS regardless of how many IDs are in use. Lookup indexes
+// a two-level table whose 512-entry leaves are allocated on first use
+// and never freed, so it takes no lock.
+#define IDR_MAX_IDS         32768
+#define IDR_LEAF_SIZE       512     // Pointers per leaf (one page)
+#define IDR_LEAVES          (IDR_MAX_IDS / IDR_LEAF_SIZE)
+#define IDR_WORDS           (IDR_MAX_IDS / 64)
+#define IDR_SUMMARY_WORDS   (IDR_WORDS / 64)
+
+struct idr {
+    spinlock_t lock;
+    uint32_t count;                         // IDs in use
+    uint64_t full[IDR_SUMMARY_WORDS];       // Bit per used[] word with no free ID
+    uint64_t used[IDR_WORDS];               // Bit per allocated ID
+    void** leaves[IDR_LEAVES];
+};
+
+#define IDR_INIT { SPINLOCK_INIT, 0, { 0 }, { 0 }, { NULL } }
+
+// Function prototypes
+int idr_alloc(struct idr* idr, void* ptr);
+void idr_remove(struct idr* idr, uint32_t id);
+void* idr_find(struct idr* idr, uint32_t id);
+
+#endif
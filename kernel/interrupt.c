@@ -4,6 +4,9 @@
 #include "drivers/port_io.h"  // Include port I/O functions
 #include "apic.h"
 #include "timer.h"
+#include "fpu.h"
+#include "memory.h"
+#include "tlb.h"
 #include <stdint.h>
 
 // IDT entries array
@@ -216,6 +219,30 @@ void setup_idt(void) {
 
 // ISR handler in C
 void isr_handler(struct registers regs) {
+    // NMIs carry cross-CPU TLB shootdowns
+    if (regs.int_no == 2 && tlb_handle_shootdown() == 0) {
+        return;
+    }
+    
+    // Device not available: first FPU/SIMD use since the last task switch
+    if (regs.int_no == 7 && fpu_handle_nm() == 0) {
+        return;
+    }
+    
+    // Page faults on demand-mapped memory are resolved and the access retried
+    if (regs.int_no == 14) {
+        uint64_t fault_addr;
+        asm volatile("mov %%cr2, %0" : "=r"(fault_addr));
+        if (vmm_handle_page_fault(fault_addr, regs.err_code) == 0) {
+            return;
+        }
+        console_write("Page fault at 0x");
+        console_write_hex(fault_addr);
+        console_write(" (RIP 0x");
+        console_write_hex(regs.rip);
+        console_write(")\n");
+    }
+    
     // Handle exceptions
     if (regs.int_no < 32) {
         console_write("Exception: ");
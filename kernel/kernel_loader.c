@@ -7,13 +7,23 @@
 #include "drivers/keyboard.h"
 #include "scheduler.h"
 #include "test.h"
+#include "bench.h"
+#include "cpu.h"
+#include "pmm.h"
+#include "dma.h"
+#include "fpu.h"
+#include "smp.h"
 
 // External symbols for BSS section
 extern unsigned int _bss_start;
 extern unsigned int _bss_end;
 
-// Test tasks
+// Test tasks: periodic sampling loops, each in the deadline class with
+// a millisecond of budget per period
 void task1(void) {
+    if (scheduler_set_deadline(1000, 100000, 100000) < 0) {
+        console_write("ERROR: task1 not admitted to the deadline class\n");
+    }
     for (;;) {
         console_write("1");
         scheduler_sleep(10);
@@ -21,6 +31,9 @@ void task1(void) {
 }
 
 void task2(void) {
+    if (scheduler_set_deadline(1000, 150000, 150000) < 0) {
+        console_write("ERROR: task2 not admitted to the deadline class\n");
+    }
     for (;;) {
         console_write("2");
         scheduler_sleep(15);
@@ -61,9 +74,18 @@ void kernel_main(uint64_t boot_info_addr, uint64_t magic) {
         // In a real implementation, we would use this address
     }
 
+    // Register the boot CPU before any per-CPU state is touched
+    cpu_init();
+
     // Initialize memory management
     memory_init();
     
+    // Reserve low memory for device buffers before it is handed out
+    dma_init();
+    
+    // Extended register state handling (needs the slab allocator)
+    fpu_init();
+    
     // Run memory management tests
     test_memory_management();
     
@@ -79,10 +101,19 @@ void kernel_main(uint64_t boot_info_addr, uint64_t magic) {
     // Initialize keyboard
     keyboard_init();
     
+    // Bring up the other CPUs
+    smp_init();
+    
+    // Run benchmarks while the boot CPU is the only runnable context
+    run_benchmarks();
+    
     // Add test tasks
     scheduler_add_task(task1);
     scheduler_add_task(task2);
     
+    // Keep the zeroed page pool filled whenever nothing else wants the CPU
+    scheduler_add_task_priority(pmm_zero_task, TASK_PRIORITY_IDLE);
+    
     // Run comprehensive tests
     run_tests();
 
@@ -107,6 +138,9 @@ void kernel_main(uint64_t boot_info_addr, uint64_t magic) {
 
     console_write("> ");
 
+    // From here on the boot context is just the idle loop
+    scheduler_set_priority(TASK_PRIORITY_IDLE);
+
     // Main loop
     for(;;) {
         // Check for keyboard input
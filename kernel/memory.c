@@ -1,5 +1,10 @@
 // kernel/memory.c
 #include "memory.h"
+#include "pmm.h"
+#include "spinlock.h"
+#include "cpu.h"
+#include "tlb.h"
+#include "vmalloc.h"
 #include "drivers/console.h"
 #include <stdint.h>
 
@@ -12,34 +17,15 @@ struct pmm_info pmm;
 // Virtual memory manager info
 struct vmm_info vmm;
 
-// Memory map entries array
-struct e820_entry memory_map_entries[MAX_MEMORY_MAP_ENTRIES];
+// Offset of the direct map (0 while physical memory is still reached
+// through the bootloader's identity map)
+uint64_t direct_map_offset = 0;
 
-// Simple bitmap for tracking allocated physical pages (for demonstration)
-// In a real implementation, this would be more sophisticated
-// static uint8_t page_bitmap[1024]; // Tracks 1024 pages (4MB) - Removed due to being unused
-static uint64_t next_free_page = 0x200000; // Start allocating from 2MB
+static void init_direct_map(void);
+static page_entry_t* alloc_page_table(void);
 
-// Bootstrap memory allocator for early page table allocation
-static uint8_t bootstrap_memory_pool[4096 * 16]; // 16 pages for bootstrap
-static uint32_t bootstrap_memory_used = 0;
-
-// Bootstrap memory allocation function
-void* bootstrap_alloc(uint32_t size) {
-    // Align size to 4 bytes
-    size = (size + 3) & ~3;
-    
-    // Check if we have enough space
-    if (bootstrap_memory_used + size > sizeof(bootstrap_memory_pool)) {
-        return NULL;
-    }
-    
-    // Allocate memory from bootstrap pool
-    void* ptr = &bootstrap_memory_pool[bootstrap_memory_used];
-    bootstrap_memory_used += size;
-    
-    return ptr;
-}
+// Memory map entries array
+struct e820_entry memory_map_entries[MAX_MEMORY_MAP_ENTRIES];
 
 // Function to print memory map
 void print_memory_map(void) {
@@ -118,16 +104,22 @@ void init_pmm(void) {
     // Process each memory map entry
     for (uint32_t i = 0; i < entry_count; i++) {
         // Only process RAM regions
-        if (mmap[i].type == E820_RAM && mmap[i].base_high == 0) {
+        if (mmap[i].type == E820_RAM) {
+            uint64_t base = ((uint64_t)mmap[i].base_high << 32) | mmap[i].base_low;
+            uint64_t length = ((uint64_t)mmap[i].length_high << 32) | mmap[i].length_low;
+            if (length == 0) {
+                continue;
+            }
+            
             // Store region info
-            pmm.regions[pmm.region_count].base = mmap[i].base_low;
-            pmm.regions[pmm.region_count].length = mmap[i].length_low;
+            pmm.regions[pmm.region_count].base = base;
+            pmm.regions[pmm.region_count].length = length;
             pmm.regions[pmm.region_count].type = mmap[i].type;
             
             // Update totals
-            pmm.total_memory += mmap[i].length_low;
-            if (mmap[i].base_low >= 0x100000) { // Only count memory above 1MB as free
-                pmm.free_memory += mmap[i].length_low;
+            pmm.total_memory += length;
+            if (base >= 0x100000) { // Only count memory above 1MB as free
+                pmm.free_memory += length;
             }
             
             pmm.region_count++;
@@ -146,29 +138,33 @@ void init_pmm(void) {
     console_write(" bytes\n");
     console_write("Memory regions: ");
     console_write("\n");
+    
+    // Hand the usable regions to the buddy allocator
+    pmm_buddy_init();
 }
 
 // Allocate a physical page
 void* alloc_physical_page(void) {
-    // Simple implementation - find next free page
-    // In a real implementation, this would use a proper bitmap or other tracking
-    
-    // Align to page boundary
-    next_free_page = (next_free_page + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-    
-    // For now, just return the next free page
-    // In a real implementation, we'd mark it as used in the bitmap
-    void* page = (void*)next_free_page;
-    next_free_page += PAGE_SIZE;
-    
-    return page;
+    return pmm_alloc_page();
 }
 
-// Free a physical page
+// Free a physical page; a page shared copy-on-write only loses one owner
 void free_physical_page(uint64_t physical_addr) {
-    // Simple implementation - just reset next_free_page if it's the last one allocated
-    // In a real implementation, we'd mark it as free in the bitmap
-    (void)physical_addr;
+    physical_addr &= ~(uint64_t)(PAGE_SIZE - 1);
+    if (pmm_page_unshare(physical_addr)) {
+        pmm_free_page(physical_addr);
+    }
+}
+
+// Per-CPU paging setup, run on every CPU once it is in long mode
+void vmm_init_cpu(void) {
+    // Make supervisor writes honour read-only pages so copy-on-write pages
+    // are not silently modified by the kernel
+    uint64_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" :: "r"(cr0 | CR0_WP) : "memory");
+    
+    tlb_init_cpu();
 }
 
 // Initialize virtual memory manager
@@ -176,9 +172,25 @@ void init_vmm(void) {
     console_write("Initializing VMM...\n");
     
     // Get the current PML4 table from CR3 (set up by bootloader)
-    uint64_t cr3_value;
-    asm volatile("mov %%cr3, %0" : "=r"(cr3_value));
-    vmm.pml4 = (page_entry_t*)(cr3_value & ~0xFFF);
+    vmm.kernel_pml4 = (page_entry_t*)phys_to_virt(vmm_current_cr3() & PAGE_FRAME_MASK);
+    
+    // Reach all physical memory through the kernel half from here on
+    init_direct_map();
+    
+    // Every address space copies the kernel's top-level entries once, so
+    // they must all exist up front for later kernel mappings to be shared
+    for (int i = PML4_USER_ENTRIES; i < 512; i++) {
+        if (!(vmm.kernel_pml4[i] & PAGE_PRESENT)) {
+            page_entry_t* pdpt = alloc_page_table();
+            if (!pdpt) {
+                console_write("ERROR: Failed to allocate kernel PDPT\n");
+                break;
+            }
+            vmm.kernel_pml4[i] = virt_to_phys(pdpt) | PAGE_PRESENT | PAGE_WRITABLE;
+        }
+    }
+    
+    vmm_init_cpu();
     
     // Set up initial heap parameters
     vmm.heap_start = 0xFFFF800000000000; // Start heap at higher half kernel space
@@ -188,207 +200,794 @@ void init_vmm(void) {
     console_write("VMM initialized.\n");
 }
 
-// TLB flush function
-static inline void flush_tlb_single(uint64_t addr) {
-    asm volatile("invlpg (%0)" ::"r" (addr) : "memory");
+// Paging structure levels (1 = PT ... 4 = PML4)
+#define PT_LEVEL_PT   1
+#define PT_LEVEL_PD   2
+#define PT_LEVEL_PDPT 3
+#define PT_LEVEL_PML4 4
+
+// Per-CPU cache of the tables reached by the last walk, so walks for
+// neighbouring addresses start at the PT (same 2MB) or PD (same 1GB)
+// instead of the PML4. Entries are dropped wholesale by bumping
+// walk_generation whenever a table is freed.
+struct walk_cache {
+    page_entry_t* pml4;             // Address space the entries belong to
+    uint64_t generation;
+    uint64_t pt_tag;                // virtual_addr >> 21 of the cached PT
+    page_entry_t* pt;
+    uint64_t pd_tag;                // virtual_addr >> 30 of the cached PD
+    page_entry_t* pd;
+};
+
+static struct walk_cache walk_caches[MAX_CPUS];
+static uint64_t walk_generation = 1;
+
+// Serializes every walk and update of the page tables, including the
+// present-entry counts and the walk caches. The kernel half is shared by all
+// address spaces, so two CPUs could otherwise install different tables into
+// the same empty entry or lose a count update. Taken with interrupts off:
+// the heap fault handler maps pages from any context.
+static spinlock_t pt_lock = SPINLOCK_INIT;
+
+// PML4 this CPU runs on, read from CR3: every CPU has its own, so no
+// shared variable can say which one is active
+static inline page_entry_t* active_pml4(void) {
+    return (page_entry_t*)phys_to_virt(vmm_current_cr3() & PAGE_FRAME_MASK);
+}
+
+// While set (pt_lock held), user-half walks go through this PML4 instead
+// of this CPU's, to fill in an address space that is not active here
+static page_entry_t* walk_user_root = NULL;
+
+// Top-level table a walk for virtual_addr starts from. Kernel addresses go
+// through the boot PML4: its kernel entries are the ones every address
+// space copies, so the result does not depend on which one this CPU runs.
+// User addresses belong to this CPU's address space.
+static inline page_entry_t* walk_root(uint64_t virtual_addr) {
+    if (virtual_addr >> 63) {
+        return vmm.kernel_pml4;
+    }
+    return walk_user_root ? walk_user_root : active_pml4();
 }
 
-static inline void flush_tlb(void) {
-    uint64_t cr3;
-    asm volatile("mov %%cr3, %0" : "=r" (cr3));
-    asm volatile("mov %0, %%cr3" :: "r" (cr3) : "memory");
+// Bytes mapped by one entry at a level
+static inline uint64_t level_span(int level) {
+    return 1ULL << (12 + 9 * (level - 1));
 }
 
-// Map a virtual page to a physical page
-int map_page(uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags) {
-    // Align addresses to page boundaries
-    virtual_addr &= ~(PAGE_SIZE - 1);
-    physical_addr &= ~(PAGE_SIZE - 1);
-    
-    // Get page table indices for 4-level paging
-    uint64_t pml4_index = PML4_INDEX(virtual_addr);
-    uint64_t pdpt_index = PDPT_INDEX(virtual_addr);
-    uint64_t pd_index = PD_INDEX(virtual_addr);
-    uint64_t pt_index = PT_INDEX(virtual_addr);
-    
-    // Check if page directory pointer table exists
-    page_entry_t* pdpt;
-    if (!(vmm.pml4[pml4_index] & PAGE_PRESENT)) {
-        // Allocate new PDPT using bootstrap allocator for early allocation
-        pdpt = (page_entry_t*)bootstrap_alloc(sizeof(page_entry_t) * 512);
-        if (!pdpt) {
-            return -1; // Failed to allocate PDPT
+// Index of virtual_addr in the table at a level
+static inline uint64_t level_index(uint64_t virtual_addr, int level) {
+    return (virtual_addr >> (12 + 9 * (level - 1))) & 0x1FF;
+}
+
+// Table that contains a given entry
+static inline page_entry_t* table_of_entry(page_entry_t* entry) {
+    return (page_entry_t*)((uint64_t)entry & ~(uint64_t)(PAGE_SIZE - 1));
+}
+
+// Frame descriptor of a page table allocated from the PMM (NULL for the
+// bootloader's tables, which are neither counted nor reclaimed)
+static struct page_frame* table_frame(page_entry_t* table) {
+    struct page_frame* frame = pmm_get_frame(virt_to_phys(table));
+    if (frame == NULL || (frame->flags & PAGE_FRAME_RESERVED)) {
+        return NULL;
+    }
+    return frame;
+}
+
+// Leaf flags for a mapping at virtual_addr. Kernel-half leaves are the
+// same in every address space, so they are made global: invlpg then drops
+// them under every PCID at once.
+static inline uint64_t leaf_flags(uint64_t virtual_addr, uint64_t flags) {
+    return (virtual_addr >> 63) ? flags | PAGE_GLOBAL : flags;
+}
+
+// Track the number of present entries in a table
+static inline void table_count_add(page_entry_t* table, int delta) {
+    struct page_frame* frame = table_frame(table);
+    if (frame) {
+        frame->count += delta;
+    }
+}
+
+// Allocate and zero a page table
+static page_entry_t* alloc_page_table(void) {
+    // Tables come from the pre-zeroed pool, so no entries need clearing here
+    void* page = pmm_alloc_page_flags(PMM_ALLOC_ZERO);
+    if (!page) {
+        return NULL;
+    }
+    page_entry_t* table = (page_entry_t*)phys_to_virt((uint64_t)page);
+    struct page_frame* frame = table_frame(table);
+    if (frame) {
+        frame->count = 0;
+    }
+    return table;
+}
+
+// Starting point for a walk: the deepest cached table covering virtual_addr
+static page_entry_t* walk_cache_start(uint64_t virtual_addr, int* level) {
+    struct walk_cache* cache = &walk_caches[cpu_current_id()];
+    page_entry_t* root = walk_root(virtual_addr);
+
+    if (cache->pml4 == root && cache->generation == walk_generation) {
+        if (cache->pt && cache->pt_tag == (virtual_addr >> 21)) {
+            *level = PT_LEVEL_PT;
+            return cache->pt;
         }
-        
-        // Zero out PDPT
-        for (int i = 0; i < 512; i++) {
-            pdpt[i] = 0;
+        if (cache->pd && cache->pd_tag == (virtual_addr >> 30)) {
+            *level = PT_LEVEL_PD;
+            return cache->pd;
         }
-        
-        // Add PDPT to PML4
-        vmm.pml4[pml4_index] = ((uint64_t)pdpt) | PAGE_PRESENT | PAGE_WRITABLE;
-        
-        // Flush TLB after modifying PML4
-        flush_tlb();
-    } else {
-        // Get existing PDPT
-        pdpt = (page_entry_t*)(vmm.pml4[pml4_index] & ~0xFFF);
     }
-    
-    // Check if page directory exists
-    page_entry_t* pd;
-    if (!(pdpt[pdpt_index] & PAGE_PRESENT)) {
-        // Allocate new page directory using bootstrap allocator
-        pd = (page_entry_t*)bootstrap_alloc(sizeof(page_entry_t) * 512);
-        if (!pd) {
-            return -1; // Failed to allocate page directory
+
+    *level = PT_LEVEL_PML4;
+    return root;
+}
+
+// Remember a PD or PT reached by a walk
+static void walk_cache_fill(uint64_t virtual_addr, int level, page_entry_t* table) {
+    struct walk_cache* cache = &walk_caches[cpu_current_id()];
+    page_entry_t* root = walk_root(virtual_addr);
+
+    if (cache->pml4 != root || cache->generation != walk_generation) {
+        cache->pml4 = root;
+        cache->generation = walk_generation;
+        cache->pt = NULL;
+        cache->pd = NULL;
+    }
+
+    if (level == PT_LEVEL_PT) {
+        cache->pt = table;
+        cache->pt_tag = virtual_addr >> 21;
+    } else if (level == PT_LEVEL_PD) {
+        cache->pd = table;
+        cache->pd_tag = virtual_addr >> 30;
+    }
+}
+
+// Replace a 1GB or 2MB leaf entry with a table of next-level entries that
+// map the same memory with the same flags
+static int split_large_page(struct tlb_gather* tlb, page_entry_t* entry, int level, uint64_t virtual_addr) {
+    page_entry_t* table = alloc_page_table();
+    if (!table) {
+        return -1;
+    }
+
+    uint64_t base = *entry & PAGE_LARGE_FRAME_MASK;
+    uint64_t flags = *entry & ~PAGE_LARGE_FRAME_MASK;
+    uint64_t child_span = level_span(level - 1);
+
+    // 2MB children keep the PS bit; 4KB PTEs must not have it, and bit 12
+    // (the large-page PAT bit) is an address bit in a PTE
+    if (level - 1 == PT_LEVEL_PT) {
+        flags &= ~(PAGE_HUGE | PAGE_LARGE_PAT);
+    }
+    for (int i = 0; i < 512; i++) {
+        table[i] = (base + i * child_span) | flags;
+    }
+    table_count_add(table, 512);
+
+    *entry = virt_to_phys(table) | PAGE_PRESENT | PAGE_WRITABLE | (flags & PAGE_USER);
+    tlb_gather_add(tlb, virtual_addr & ~(level_span(level) - 1));
+    return 0;
+}
+
+// Walk to the entry that maps virtual_addr: a present leaf (4KB PTE or large
+// page) or the first non-present entry. *level receives its level.
+static page_entry_t* vmm_lookup(uint64_t virtual_addr, int* level) {
+    int l;
+    page_entry_t* table = walk_cache_start(virtual_addr, &l);
+
+    for (; ; l--) {
+        page_entry_t* entry = &table[level_index(virtual_addr, l)];
+        if (l == PT_LEVEL_PT || !(*entry & PAGE_PRESENT) ||
+            (l <= PT_LEVEL_PDPT && (*entry & PAGE_HUGE))) {
+            *level = l;
+            return entry;
         }
-        
-        // Zero out page directory
-        for (int i = 0; i < 512; i++) {
-            pd[i] = 0;
+        table = (page_entry_t*)phys_to_virt(*entry & PAGE_FRAME_MASK);
+        walk_cache_fill(virtual_addr, l - 1, table);
+    }
+}
+
+// Walk to the entry for virtual_addr at target_level, creating missing tables
+// and splitting any large page in the way. Linking a new table into a
+// non-present entry needs no TLB invalidation: non-present entries are never
+// cached.
+static page_entry_t* vmm_walk_create(struct tlb_gather* tlb, uint64_t virtual_addr, int target_level, uint64_t flags) {
+    int l;
+    page_entry_t* table = walk_cache_start(virtual_addr, &l);
+
+    // A cached table below the target level is no use here
+    if (l < target_level) {
+        l = PT_LEVEL_PML4;
+        table = walk_root(virtual_addr);
+    }
+
+    for (; l > target_level; l--) {
+        page_entry_t* entry = &table[level_index(virtual_addr, l)];
+
+        if (!(*entry & PAGE_PRESENT)) {
+            page_entry_t* next = alloc_page_table();
+            if (!next) {
+                return NULL;
+            }
+            *entry = virt_to_phys(next) | PAGE_PRESENT | PAGE_WRITABLE | (flags & PAGE_USER);
+            table_count_add(table, 1);
+        } else if (l <= PT_LEVEL_PDPT && (*entry & PAGE_HUGE)) {
+            if (split_large_page(tlb, entry, l, virtual_addr) != 0) {
+                return NULL;
+            }
+        } else if ((flags & PAGE_USER) && !(*entry & PAGE_USER)) {
+            *entry |= PAGE_USER;
+            tlb_gather_add(tlb, virtual_addr);
         }
-        
-        // Add page directory to PDPT
-        pdpt[pdpt_index] = ((uint64_t)pd) | PAGE_PRESENT | PAGE_WRITABLE;
-        
-        // Flush TLB after modifying PDPT
-        flush_tlb();
-    } else {
-        // Get existing page directory
-        pd = (page_entry_t*)(pdpt[pdpt_index] & ~0xFFF);
+
+        table = (page_entry_t*)phys_to_virt(*entry & PAGE_FRAME_MASK);
+        walk_cache_fill(virtual_addr, l - 1, table);
     }
-    
-    // Check if page table exists
-    page_entry_t* pt;
-    if (!(pd[pd_index] & PAGE_PRESENT)) {
-        // Allocate new page table using bootstrap allocator
-        pt = (page_entry_t*)bootstrap_alloc(sizeof(page_entry_t) * 512);
-        if (!pt) {
-            return -1; // Failed to allocate page table
+
+    return &table[level_index(virtual_addr, target_level)];
+}
+
+// Clear a present entry and give back any page tables that became empty.
+// Emptied tables are freed through the gather, after the TLB flush, since
+// the paging-structure caches may still point at them until then.
+static void vmm_clear_entry(struct tlb_gather* tlb, page_entry_t* entry, uint64_t virtual_addr) {
+    *entry = 0;
+    tlb_gather_add(tlb, virtual_addr);
+
+    page_entry_t* table = table_of_entry(entry);
+    table_count_add(table, -1);
+
+    struct page_frame* frame = table_frame(table);
+    if (frame == NULL || frame->count != 0) {
+        return;
+    }
+
+    // Record the path from the PML4 so parents can be updated
+    page_entry_t* path[PT_LEVEL_PML4 + 1];
+    page_entry_t* walk = walk_root(virtual_addr);
+    for (int l = PT_LEVEL_PML4; l > PT_LEVEL_PT; l--) {
+        path[l] = &walk[level_index(virtual_addr, l)];
+        if (!(*path[l] & PAGE_PRESENT) || (*path[l] & PAGE_HUGE)) {
+            return;
         }
-        
-        // Zero out page table
-        for (int i = 0; i < 512; i++) {
-            pt[i] = 0;
+        walk = (page_entry_t*)phys_to_virt(*path[l] & PAGE_FRAME_MASK);
+    }
+
+    // PDPTs in the kernel half are shared between address spaces; keep them
+    int top = (virtual_addr >> 63) ? PT_LEVEL_PD : PT_LEVEL_PDPT;
+
+    for (int l = PT_LEVEL_PT; l <= top; l++) {
+        uint64_t child_phys = *path[l + 1] & PAGE_FRAME_MASK;
+        struct page_frame* child_frame = table_frame((page_entry_t*)phys_to_virt(child_phys));
+        if (child_frame == NULL || child_frame->count != 0) {
+            break;
         }
-        
-        // Add page table to page directory
-        pd[pd_index] = ((uint64_t)pt) | PAGE_PRESENT | PAGE_WRITABLE;
-        
-        // Flush TLB after modifying page directory
-        flush_tlb();
-    } else {
-        // Get existing page table
-        pt = (page_entry_t*)(pd[pd_index] & ~0xFFF);
+
+        *path[l + 1] = 0;
+        table_count_add(table_of_entry(path[l + 1]), -1);
+        tlb_gather_free_table(tlb, child_phys);
+        walk_generation++;
     }
+}
+
+// Map a virtual page to a physical page (pt_lock held)
+static int vmm_map_page(struct tlb_gather* tlb, uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags) {
+    // Align addresses to page boundaries
+    virtual_addr &= ~(PAGE_SIZE - 1);
+    physical_addr &= ~(PAGE_SIZE - 1);
     
-    // Map page
-    pt[pt_index] = physical_addr | flags | PAGE_PRESENT;
+    page_entry_t* pte = vmm_walk_create(tlb, virtual_addr, PT_LEVEL_PT, flags);
+    if (!pte) {
+        return -1; // Failed to allocate a page table
+    }
     
-    // Flush TLB for the mapped page
-    flush_tlb_single(virtual_addr);
+    // Only replacing a live translation needs an invalidation
+    if (*pte & PAGE_PRESENT) {
+        tlb_gather_add(tlb, virtual_addr);
+    } else {
+        table_count_add(table_of_entry(pte), 1);
+    }
+    *pte = physical_addr | leaf_flags(virtual_addr, flags) | PAGE_PRESENT;
     
     return 0; // Success
 }
 
-// Unmap a virtual page
-int unmap_page(uint64_t virtual_addr) {
+// Unmap a virtual page (pt_lock held)
+static int vmm_unmap_page(struct tlb_gather* tlb, uint64_t virtual_addr) {
     // Align address to page boundary
     virtual_addr &= ~(PAGE_SIZE - 1);
     
-    // Get page table indices for 4-level paging
-    uint64_t pml4_index = PML4_INDEX(virtual_addr);
-    uint64_t pdpt_index = PDPT_INDEX(virtual_addr);
-    uint64_t pd_index = PD_INDEX(virtual_addr);
-    uint64_t pt_index = PT_INDEX(virtual_addr);
-    
-    // Check if PML4 entry exists
-    if (!(vmm.pml4[pml4_index] & PAGE_PRESENT)) {
+    int level;
+    page_entry_t* entry = vmm_lookup(virtual_addr, &level);
+    if (!(*entry & PAGE_PRESENT)) {
         return -1; // Page not mapped
     }
     
-    // Get PDPT
-    page_entry_t* pdpt = (page_entry_t*)(vmm.pml4[pml4_index] & ~0xFFF);
-    
-    // Check if PDPT entry exists
-    if (!(pdpt[pdpt_index] & PAGE_PRESENT)) {
-        return -1; // Page not mapped
+    // Break up a large page so only this 4KB page goes away
+    if (level != PT_LEVEL_PT) {
+        entry = vmm_walk_create(tlb, virtual_addr, PT_LEVEL_PT, 0);
+        if (!entry) {
+            return -1;
+        }
     }
     
-    // Get page directory
-    page_entry_t* pd = (page_entry_t*)(pdpt[pdpt_index] & ~0xFFF);
+    vmm_clear_entry(tlb, entry, virtual_addr);
     
-    // Check if page directory entry exists
-    if (!(pd[pd_index] & PAGE_PRESENT)) {
-        return -1; // Page not mapped
-    }
-    
-    // Get page table
-    page_entry_t* pt = (page_entry_t*)(pd[pd_index] & ~0xFFF);
+    return 0; // Success
+}
+
+// Set page flags (pt_lock held)
+static int vmm_set_page_flags(struct tlb_gather* tlb, uint64_t virtual_addr, uint64_t flags) {
+    // Align address to page boundary
+    virtual_addr &= ~(PAGE_SIZE - 1);
     
-    // Check if page table entry exists
-    if (!(pt[pt_index] & PAGE_PRESENT)) {
+    int level;
+    page_entry_t* entry = vmm_lookup(virtual_addr, &level);
+    if (!(*entry & PAGE_PRESENT)) {
         return -1; // Page not mapped
     }
     
-    // Unmap page
-    pt[pt_index] = 0;
+    // Permissions change for a single 4KB page: split any large page first
+    if (level != PT_LEVEL_PT) {
+        entry = vmm_walk_create(tlb, virtual_addr, PT_LEVEL_PT, flags);
+        if (!entry) {
+            return -1;
+        }
+    }
     
-    // Flush TLB for the unmapped page
-    flush_tlb_single(virtual_addr);
+    // Update flags while preserving physical address
+    uint64_t phys_addr = *entry & PAGE_FRAME_MASK;
+    *entry = phys_addr | leaf_flags(virtual_addr, flags) | PAGE_PRESENT;
+    tlb_gather_add(tlb, virtual_addr);
     
     return 0; // Success
 }
 
-// Set page flags
-int set_page_flags(uint64_t virtual_addr, uint64_t flags) {
-    // Align address to page boundary
-    virtual_addr &= ~(PAGE_SIZE - 1);
-    
-    // Get page table indices for 4-level paging
-    uint64_t pml4_index = PML4_INDEX(virtual_addr);
-    uint64_t pdpt_index = PDPT_INDEX(virtual_addr);
-    uint64_t pd_index = PD_INDEX(virtual_addr);
-    uint64_t pt_index = PT_INDEX(virtual_addr);
+// Map a physically contiguous range (pt_lock held), using 1GB and 2MB
+// pages where the alignment of both addresses and the remaining size allow it
+static int vmm_map_range(struct tlb_gather* tlb, uint64_t virtual_addr, uint64_t physical_addr,
+                         uint64_t size, uint64_t flags) {
+    if ((virtual_addr | physical_addr | size) & (PAGE_SIZE - 1)) {
+        return -1;
+    }
     
-    // Check if PML4 entry exists
-    if (!(vmm.pml4[pml4_index] & PAGE_PRESENT)) {
-        return -1; // Page not mapped
+    while (size > 0) {
+        int level = PT_LEVEL_PT;
+        if (cpu_features.pages_1g && size >= PAGE_SIZE_1G &&
+            !((virtual_addr | physical_addr) & (PAGE_SIZE_1G - 1))) {
+            level = PT_LEVEL_PDPT;
+        } else if (size >= PAGE_SIZE_2M &&
+                   !((virtual_addr | physical_addr) & (PAGE_SIZE_2M - 1))) {
+            level = PT_LEVEL_PD;
+        }
+        
+        // Never throw away an existing lower-level table to install a large page
+        page_entry_t* entry = NULL;
+        while (level > PT_LEVEL_PT) {
+            entry = vmm_walk_create(tlb, virtual_addr, level, flags);
+            if (!entry) {
+                return -1;
+            }
+            if (!(*entry & PAGE_PRESENT) || (*entry & PAGE_HUGE)) {
+                break;
+            }
+            level--;
+        }
+        
+        if (level == PT_LEVEL_PT) {
+            if (vmm_map_page(tlb, virtual_addr, physical_addr, flags) != 0) {
+                return -1;
+            }
+        } else {
+            if (*entry & PAGE_PRESENT) {
+                tlb_gather_add(tlb, virtual_addr);
+            } else {
+                table_count_add(table_of_entry(entry), 1);
+            }
+            *entry = physical_addr | leaf_flags(virtual_addr, flags) | PAGE_PRESENT | PAGE_HUGE;
+        }
+        
+        uint64_t span = level_span(level);
+        virtual_addr += span;
+        physical_addr += span;
+        size -= span;
     }
     
-    // Get PDPT
-    page_entry_t* pdpt = (page_entry_t*)(vmm.pml4[pml4_index] & ~0xFFF);
+    return 0;
+}
+
+// Walk a range and apply either an unmap (clear) or a protection change to
+// every leaf, splitting large pages that are only partly covered (pt_lock held)
+static int vmm_update_range(struct tlb_gather* tlb, uint64_t virtual_addr, uint64_t size,
+                            int clear, uint64_t flags) {
+    if ((virtual_addr | size) & (PAGE_SIZE - 1)) {
+        return -1;
+    }
     
-    // Check if PDPT entry exists
-    if (!(pdpt[pdpt_index] & PAGE_PRESENT)) {
-        return -1; // Page not mapped
+    uint64_t end = virtual_addr + size;
+    while (virtual_addr < end) {
+        int level;
+        page_entry_t* entry = vmm_lookup(virtual_addr, &level);
+        uint64_t span = level_span(level);
+        uint64_t base = virtual_addr & ~(span - 1);
+        
+        if (!(*entry & PAGE_PRESENT)) {
+            // Nothing mapped in this whole entry's span
+            virtual_addr = base + span;
+            continue;
+        }
+        
+        if (level != PT_LEVEL_PT && (base != virtual_addr || end - virtual_addr < span)) {
+            if (split_large_page(tlb, entry, level, virtual_addr) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        
+        if (clear) {
+            vmm_clear_entry(tlb, entry, virtual_addr);
+        } else {
+            uint64_t mask = (level == PT_LEVEL_PT) ? PAGE_FRAME_MASK : PAGE_LARGE_FRAME_MASK;
+            *entry = (*entry & mask) | leaf_flags(virtual_addr, flags) | PAGE_PRESENT |
+                     (level == PT_LEVEL_PT ? 0 : PAGE_HUGE);
+            tlb_gather_add(tlb, virtual_addr);
+        }
+        virtual_addr += span;
     }
     
-    // Get page directory
-    page_entry_t* pd = (page_entry_t*)(pdpt[pdpt_index] & ~0xFFF);
+    return 0;
+}
+
+// Map a virtual page to a physical page as part of a batch
+int map_page_batched(struct tlb_gather* tlb, uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags) {
+    uint64_t irq_flags = spin_lock_irqsave(&pt_lock);
+    int result = vmm_map_page(tlb, virtual_addr, physical_addr, flags);
+    spin_unlock_irqrestore(&pt_lock, irq_flags);
+    return result;
+}
+
+// Map a page into the address space rooted at cr3 as part of a batch,
+// without loading it into CR3. For kernel addresses this is map_page_batched().
+int map_page_in_batched(struct tlb_gather* tlb, uint64_t cr3, uint64_t virtual_addr,
+                        uint64_t physical_addr, uint64_t flags) {
+    uint64_t irq_flags = spin_lock_irqsave(&pt_lock);
+    walk_user_root = (page_entry_t*)phys_to_virt(cr3 & PAGE_FRAME_MASK);
+    int result = vmm_map_page(tlb, virtual_addr, physical_addr, flags);
+    walk_user_root = NULL;
+    spin_unlock_irqrestore(&pt_lock, irq_flags);
+    return result;
+}
+
+// Unmap a virtual page as part of a batch
+int unmap_page_batched(struct tlb_gather* tlb, uint64_t virtual_addr) {
+    uint64_t irq_flags = spin_lock_irqsave(&pt_lock);
+    int result = vmm_unmap_page(tlb, virtual_addr);
+    spin_unlock_irqrestore(&pt_lock, irq_flags);
+    return result;
+}
+
+// Set page flags as part of a batch
+int set_page_flags_batched(struct tlb_gather* tlb, uint64_t virtual_addr, uint64_t flags) {
+    uint64_t irq_flags = spin_lock_irqsave(&pt_lock);
+    int result = vmm_set_page_flags(tlb, virtual_addr, flags);
+    spin_unlock_irqrestore(&pt_lock, irq_flags);
+    return result;
+}
+
+// Map a physically contiguous range as part of a batch
+int map_range_batched(struct tlb_gather* tlb, uint64_t virtual_addr, uint64_t physical_addr,
+                      uint64_t size, uint64_t flags) {
+    uint64_t irq_flags = spin_lock_irqsave(&pt_lock);
+    int result = vmm_map_range(tlb, virtual_addr, physical_addr, size, flags);
+    spin_unlock_irqrestore(&pt_lock, irq_flags);
+    return result;
+}
+
+// Unmap a range as part of a batch
+int unmap_range_batched(struct tlb_gather* tlb, uint64_t virtual_addr, uint64_t size) {
+    uint64_t irq_flags = spin_lock_irqsave(&pt_lock);
+    int result = vmm_update_range(tlb, virtual_addr, size, 1, 0);
+    spin_unlock_irqrestore(&pt_lock, irq_flags);
+    return result;
+}
+
+// Change permissions on a range as part of a batch
+int protect_range_batched(struct tlb_gather* tlb, uint64_t virtual_addr, uint64_t size, uint64_t flags) {
+    uint64_t irq_flags = spin_lock_irqsave(&pt_lock);
+    int result = vmm_update_range(tlb, virtual_addr, size, 0, flags);
+    spin_unlock_irqrestore(&pt_lock, irq_flags);
+    return result;
+}
+
+// Map a virtual page to a physical page
+int map_page(uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags) {
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb);
+    int result = map_page_batched(&tlb, virtual_addr, physical_addr, flags);
+    tlb_gather_commit(&tlb);
+    return result;
+}
+
+// Unmap a virtual page
+int unmap_page(uint64_t virtual_addr) {
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb);
+    int result = unmap_page_batched(&tlb, virtual_addr);
+    tlb_gather_commit(&tlb);
+    return result;
+}
+
+// Set page flags
+int set_page_flags(uint64_t virtual_addr, uint64_t flags) {
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb);
+    int result = set_page_flags_batched(&tlb, virtual_addr, flags);
+    tlb_gather_commit(&tlb);
+    return result;
+}
+
+// Map a physically contiguous range with the largest pages that fit
+int map_range(uint64_t virtual_addr, uint64_t physical_addr, uint64_t size, uint64_t flags) {
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb);
+    int result = map_range_batched(&tlb, virtual_addr, physical_addr, size, flags);
+    tlb_gather_commit(&tlb);
+    return result;
+}
+
+// Unmap a range, splitting large pages that straddle its ends
+int unmap_range(uint64_t virtual_addr, uint64_t size) {
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb);
+    int result = unmap_range_batched(&tlb, virtual_addr, size);
+    tlb_gather_commit(&tlb);
+    return result;
+}
+
+// Change permissions on a range, splitting large pages that straddle its ends
+int protect_range(uint64_t virtual_addr, uint64_t size, uint64_t flags) {
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb);
+    int result = protect_range_batched(&tlb, virtual_addr, size, flags);
+    tlb_gather_commit(&tlb);
+    return result;
+}
+
+// Map every E820 RAM region at DIRECT_MAP_BASE with the largest pages
+// available. Holes between regions (LAPIC, IOAPIC, PCI BARs and other
+// MMIO) are left unmapped, so they are never aliased by a write-back
+// mapping next to the uncached one their driver uses. The tables are
+// built through the identity map; once they are in place, page-table and
+// frame accesses switch over.
+static void init_direct_map(void) {
+    for (uint32_t i = 0; i < pmm.region_count; i++) {
+        // Only whole pages inside the region, as the page allocator uses
+        uint64_t start = (pmm.regions[i].base + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+        uint64_t end = (pmm.regions[i].base + pmm.regions[i].length) & ~(uint64_t)(PAGE_SIZE - 1);
+        if (end > DIRECT_MAP_SIZE) {
+            end = DIRECT_MAP_SIZE;
+        }
+        if (start >= end) {
+            continue;
+        }
+
+        if (map_range(DIRECT_MAP_BASE + start, start, end - start,
+                      PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL) != 0) {
+            console_write("ERROR: Failed to build the direct map!\n");
+            return;
+        }
+    }
+
+    uint64_t pml4_phys = virt_to_phys(vmm.kernel_pml4);
+    direct_map_offset = DIRECT_MAP_BASE;
+    vmm.kernel_pml4 = (page_entry_t*)phys_to_virt(pml4_phys);
+    pmm_use_direct_map();
+}
+
+// Translate a mapped virtual address to its physical address (pt_lock held)
+static uint64_t vmm_translate(uint64_t virtual_addr) {
+    int level;
+    page_entry_t* entry = vmm_lookup(virtual_addr, &level);
+    if (!(*entry & PAGE_PRESENT)) {
+        return 0;
+    }
     
-    // Check if page directory entry exists
-    if (!(pd[pd_index] & PAGE_PRESENT)) {
-        return -1; // Page not mapped
+    uint64_t span = level_span(level);
+    uint64_t mask = (level == PT_LEVEL_PT) ? PAGE_FRAME_MASK : PAGE_LARGE_FRAME_MASK;
+    return (*entry & mask) + (virtual_addr & (span - 1));
+}
+
+// Translate a mapped virtual address to its physical address (0 if unmapped)
+uint64_t get_physical_address(uint64_t virtual_addr) {
+    uint64_t flags = spin_lock_irqsave(&pt_lock);
+    uint64_t result = vmm_translate(virtual_addr);
+    spin_unlock_irqrestore(&pt_lock, flags);
+    return result;
+}
+
+// Unmap a range of pages and give their frames back to the physical allocator
+// once the TLB no longer references them
+void unmap_and_free_pages(uint64_t virtual_addr, uint64_t size) {
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb);
+    uint64_t flags = spin_lock_irqsave(&pt_lock);
+    for (uint64_t addr = virtual_addr; addr < virtual_addr + size; addr += PAGE_SIZE) {
+        uint64_t phys = vmm_translate(addr);
+        if (phys != 0 && vmm_unmap_page(&tlb, addr) == 0) {
+            tlb_gather_free_page(&tlb, phys);
+        }
+    }
+    spin_unlock_irqrestore(&pt_lock, flags);
+    tlb_gather_commit(&tlb);
+}
+
+// Duplicate the user-owned part of a table. Tables reached through
+// PAGE_USER entries are copied; other entries (kernel mappings such as the
+// boot identity map) are shared as they are. With share_pages set (fork),
+// user leaves are shared between both trees, with writable ones
+// write-protected and marked copy-on-write; otherwise they are left out.
+static int vmm_copy_table(struct tlb_gather* tlb, page_entry_t* src, page_entry_t* dst,
+                          int level, uint64_t va_base, int entries, int share_pages) {
+    for (int i = 0; i < entries; i++) {
+        uint64_t va = va_base + i * level_span(level);
+        
+        if (!(src[i] & PAGE_PRESENT)) {
+            continue;
+        }
+        if (!(src[i] & PAGE_USER)) {
+            dst[i] = src[i];
+            table_count_add(dst, 1);
+            continue;
+        }
+        
+        // Sharing is tracked per 4KB frame, so large user pages are split
+        if (level != PT_LEVEL_PT && (src[i] & PAGE_HUGE)) {
+            if (!share_pages) {
+                continue;
+            }
+            if (split_large_page(tlb, &src[i], level, va) != 0) {
+                return -1;
+            }
+        }
+        
+        if (level == PT_LEVEL_PT) {
+            if (!share_pages) {
+                continue;
+            }
+            if (src[i] & PAGE_WRITABLE) {
+                src[i] = (src[i] & ~(uint64_t)PAGE_WRITABLE) | PAGE_COW;
+                tlb_gather_add(tlb, va);
+            }
+            pmm_page_share(src[i] & PAGE_FRAME_MASK);
+            dst[i] = src[i];
+            table_count_add(dst, 1);
+            continue;
+        }
+        
+        page_entry_t* child = alloc_page_table();
+        if (!child) {
+            return -1;
+        }
+        dst[i] = virt_to_phys(child) | (src[i] & ~PAGE_FRAME_MASK);
+        table_count_add(dst, 1);
+        
+        page_entry_t* src_child = (page_entry_t*)phys_to_virt(src[i] & PAGE_FRAME_MASK);
+        if (vmm_copy_table(tlb, src_child, child, level - 1, va, 512, share_pages) != 0) {
+            return -1;
+        }
     }
     
-    // Get page table
-    page_entry_t* pt = (page_entry_t*)(pd[pd_index] & ~0xFFF);
+    return 0;
+}
+
+// Release the user-owned part of a table: leaves drop their reference and
+// copied tables are freed. Shared kernel entries are left alone.
+static void vmm_free_table(page_entry_t* table, int level, int entries) {
+    for (int i = 0; i < entries; i++) {
+        page_entry_t entry = table[i];
+        if (!(entry & PAGE_PRESENT) || !(entry & PAGE_USER)) {
+            continue;
+        }
+        
+        if (level == PT_LEVEL_PT) {
+            free_physical_page(entry & PAGE_FRAME_MASK);
+            continue;
+        }
+        
+        // Large pages are never handed to user space as owned memory
+        if (entry & PAGE_HUGE) {
+            continue;
+        }
+        
+        page_entry_t* child = (page_entry_t*)phys_to_virt(entry & PAGE_FRAME_MASK);
+        vmm_free_table(child, level - 1, 512);
+        if (table_frame(child)) {
+            pmm_free_page(entry & PAGE_FRAME_MASK);
+        }
+    }
+}
+
+// Build an address space from src_cr3: the kernel half is shared and the
+// user half copied as described for vmm_copy_table(). The new CR3 value
+// carries a PCID of its own when PCIDs are enabled.
+static uint64_t vmm_clone_address_space(uint64_t src_cr3, int share_pages) {
+    page_entry_t* src = (page_entry_t*)phys_to_virt(src_cr3 & PAGE_FRAME_MASK);
+    page_entry_t* dst = alloc_page_table();
+    if (!dst) {
+        return 0;
+    }
     
-    // Check if page table entry exists
-    if (!(pt[pt_index] & PAGE_PRESENT)) {
-        return -1; // Page not mapped
+    for (int i = PML4_USER_ENTRIES; i < 512; i++) {
+        dst[i] = src[i];
     }
     
-    // Update flags while preserving physical address
-    uint64_t phys_addr = pt[pt_index] & ~0xFFF;
-    pt[pt_index] = phys_addr | flags | PAGE_PRESENT;
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb);
+    uint64_t flags = spin_lock_irqsave(&pt_lock);
+    int result = vmm_copy_table(&tlb, src, dst, PT_LEVEL_PML4, 0, PML4_USER_ENTRIES, share_pages);
+    spin_unlock_irqrestore(&pt_lock, flags);
+    tlb_gather_commit(&tlb);
+    
+    uint64_t cr3 = virt_to_phys(dst) | tlb_pcid_alloc();
+    if (result != 0) {
+        console_write("ERROR: Out of memory while building address space\n");
+        vmm_destroy_address_space(cr3);
+        return 0;
+    }
+    return cr3;
+}
+
+// New address space with no user mappings. Returns its CR3 value, or 0.
+uint64_t vmm_create_address_space(void) {
+    return vmm_clone_address_space(virt_to_phys(vmm.kernel_pml4), 0);
+}
+
+// Build the address space of a forked process: the user half is shared
+// copy-on-write, so the cost is proportional to the page tables rather than
+// to resident memory. Returns the new CR3 value, or 0 on failure.
+uint64_t vmm_fork_address_space(uint64_t src_cr3) {
+    return vmm_clone_address_space(src_cr3, 1);
+}
+
+// Free an address space created by vmm_fork_address_space(). No other CPU
+// may still run on it; the process code only destroys the address space
+// of a process that is off every CPU.
+void vmm_destroy_address_space(uint64_t cr3) {
+    page_entry_t* pml4 = (page_entry_t*)phys_to_virt(cr3 & PAGE_FRAME_MASK);
+    if (pml4 == vmm.kernel_pml4) {
+        return;
+    }
     
-    // Flush TLB for the modified page
-    flush_tlb_single(virtual_addr);
+    // Never pull the tables out from under this CPU
+    if (pml4 == active_pml4()) {
+        vmm_switch_address_space(virt_to_phys(vmm.kernel_pml4));
+    }
     
-    return 0; // Success
+    uint64_t flags = spin_lock_irqsave(&pt_lock);
+    vmm_free_table(pml4, PT_LEVEL_PML4, PML4_USER_ENTRIES);
+    walk_generation++;
+    spin_unlock_irqrestore(&pt_lock, flags);
+    pmm_free_page(cr3 & PAGE_FRAME_MASK);
+    tlb_pcid_free(cr3 & CR3_PCID_MASK);
+}
+
+// Make the address space rooted at cr3 the active one on this CPU. With
+// PCIDs the entries it left in this CPU's TLB are kept when they are still
+// valid.
+void vmm_switch_address_space(uint64_t cr3) {
+    uint64_t value = tlb_cr3_for_switch(cr3);
+    asm volatile("mov %0, %%cr3" :: "r"(value) : "memory");
+}
+
+// CR3 of the active address space, including its PCID
+uint64_t vmm_current_cr3(void) {
+    uint64_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    return cr3;
 }
 
 // Test routine to verify VMM and heap allocator functionality
@@ -428,6 +1027,49 @@ void test_memory_management(void) {
         console_write("kmalloc(128) failed\n");
     }
     
+    // Heap allocations must be 16-byte aligned
+    void* small = kmalloc(1);
+    void* large = kmalloc(5000);
+    if (small != NULL && large != NULL &&
+        ((uint64_t)small & 15) == 0 && ((uint64_t)large & 15) == 0) {
+        console_write("Heap alignment test passed\n");
+    } else {
+        console_write("Heap alignment test failed\n");
+    }
+    kfree(small);
+    kfree(large);
+    
+    // Heap pages are only backed once touched and go back to the PMM on free
+    uint64_t heap_free_before = pmm_get_free_pages();
+    uint8_t* lazy = (uint8_t*)kmalloc(256 * 1024);
+    if (lazy != NULL) {
+        int ok = heap_free_before - pmm_get_free_pages() < 8;
+        for (int i = 0; i < 256 * 1024; i += PAGE_SIZE) {
+            lazy[i] = (uint8_t)i;
+        }
+        ok = ok && heap_free_before - pmm_get_free_pages() >= 64;
+        kfree(lazy);
+        ok = ok && heap_free_before - pmm_get_free_pages() < 8;
+        console_write(ok ? "Heap demand paging test passed\n" : "Heap demand paging test failed\n");
+    } else {
+        console_write("Heap demand paging test failed\n");
+    }
+    
+    // Big allocations are backed by large pages up front and still give
+    // their frames back when freed
+    heap_free_before = pmm_get_free_pages();
+    uint8_t* big = (uint8_t*)kmalloc(4 * 1024 * 1024);
+    if (big != NULL) {
+        uint64_t aligned = ((uint64_t)big + PAGE_SIZE_2M - 1) & ~(uint64_t)(PAGE_SIZE_2M - 1);
+        int ok = get_physical_address(aligned) != 0;
+        big[0] = 1;
+        kfree(big);
+        ok = ok && heap_free_before - pmm_get_free_pages() < 8;
+        console_write(ok ? "Heap large page test passed\n" : "Heap large page test failed\n");
+    } else {
+        console_write("Heap large page test failed\n");
+    }
+
     // Test another allocation
     void* ptr2 = kmalloc(256);
     if (ptr2 != NULL) {
@@ -438,12 +1080,110 @@ void test_memory_management(void) {
         console_write("kmalloc(256) failed\n");
     }
     
+    // Test physical page allocation and freeing
+    uint64_t free_before = pmm_get_free_pages();
+    void* page = alloc_physical_page();
+    void* block = pmm_alloc_pages(3);
+    if (page != NULL && block != NULL && ((uint64_t)block & (8 * PAGE_SIZE - 1)) == 0) {
+        free_physical_page((uint64_t)page);
+        pmm_free_pages((uint64_t)block, 3);
+        if (pmm_get_free_pages() == free_before) {
+            console_write("Physical page allocator test passed\n");
+        } else {
+            console_write("Physical page allocator test failed: free count mismatch\n");
+        }
+    } else {
+        console_write("Physical page allocator test failed\n");
+    }
+
+    // Test the pre-zeroed page pool
+    free_before = pmm_get_free_pages();
+    pmm_zero_pool_refill(PMM_ZERO_BATCH);
+    void* zeroed = pmm_alloc_page_flags(PMM_ALLOC_ZERO);
+    if (zeroed != NULL && pmm_get_free_pages() == free_before - 1) {
+        uint64_t* words = (uint64_t*)phys_to_virt((uint64_t)zeroed);
+        int ok = 1;
+        for (uint32_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+            ok = ok && words[i] == 0;
+        }
+        free_physical_page((uint64_t)zeroed);
+        console_write(ok ? "Zeroed page pool test passed\n" : "Zeroed page pool test failed: page not clear\n");
+    } else {
+        console_write("Zeroed page pool test failed\n");
+    }
+
+    // Test large-page mappings and splitting on a partial permission change
+    uint64_t test_va = 0xFFFF900000000000;
+    void* block2m = pmm_alloc_pages(9);
+    if (block2m != NULL && map_range(test_va, (uint64_t)block2m, PAGE_SIZE_2M, PAGE_PRESENT | PAGE_WRITABLE) == 0) {
+        int ok = get_physical_address(test_va + 0x12345) == (uint64_t)block2m + 0x12345;
+        ok = ok && protect_range(test_va + PAGE_SIZE, PAGE_SIZE, PAGE_PRESENT) == 0;
+        ok = ok && get_physical_address(test_va + 0x12345) == (uint64_t)block2m + 0x12345;
+        ok = ok && unmap_range(test_va, PAGE_SIZE_2M) == 0;
+        ok = ok && get_physical_address(test_va) == 0;
+        console_write(ok ? "Large page mapping test passed\n" : "Large page mapping test failed\n");
+    } else {
+        console_write("Large page mapping test failed\n");
+    }
+    if (block2m != NULL) {
+        pmm_free_pages((uint64_t)block2m, 9);
+    }
+
+    // Every frame must be reachable through the direct map
+    page = alloc_physical_page();
+    if (page != NULL) {
+        uint64_t* direct = (uint64_t*)phys_to_virt((uint64_t)page);
+        direct[0] = 0x1234ABCD;
+        int ok = (uint64_t)direct >= DIRECT_MAP_BASE && virt_to_phys(direct) == (uint64_t)page;
+        ok = ok && get_physical_address((uint64_t)direct) == (uint64_t)page && direct[0] == 0x1234ABCD;
+        console_write(ok ? "Direct map test passed\n" : "Direct map test failed\n");
+        free_physical_page((uint64_t)page);
+    } else {
+        console_write("Direct map test failed\n");
+    }
+
+    // Fork shares user pages; the first write gives the writer its own copy
+    uint64_t user_va = 0x0000700000000000;
+    free_before = pmm_get_free_pages();
+    page = alloc_physical_page();
+    if (page != NULL && map_page(user_va, (uint64_t)page, PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER) == 0) {
+        *(volatile uint64_t*)user_va = 1;
+        uint64_t child_cr3 = vmm_fork_address_space(vmm_current_cr3());
+        int ok = child_cr3 != 0 && pmm_page_sharers((uint64_t)page) == 1;
+        *(volatile uint64_t*)user_va = 2;
+        ok = ok && get_physical_address(user_va) != (uint64_t)page;
+        ok = ok && *(uint64_t*)phys_to_virt((uint64_t)page) == 1;
+        if (child_cr3 != 0) {
+            vmm_destroy_address_space(child_cr3);
+        }
+        unmap_and_free_pages(user_va, PAGE_SIZE);
+        ok = ok && pmm_get_free_pages() == free_before;
+        console_write(ok ? "Copy-on-write fork test passed\n" : "Copy-on-write fork test failed\n");
+    } else {
+        console_write("Copy-on-write fork test failed\n");
+    }
+
+    // Page tables emptied by an unmap must go back to the page allocator
+    free_before = pmm_get_free_pages();
+    page = alloc_physical_page();
+    if (page != NULL && map_page(test_va, (uint64_t)page, PAGE_PRESENT | PAGE_WRITABLE) == 0) {
+        unmap_page(test_va);
+        free_physical_page((uint64_t)page);
+        if (pmm_get_free_pages() == free_before) {
+            console_write("Page table reclaim test passed\n");
+        } else {
+            console_write("Page table reclaim test failed: tables leaked\n");
+        }
+    } else {
+        console_write("Page table reclaim test failed\n");
+    }
+
     console_write("Memory management test completed.\n");
 }
 
 // Function to load PML4 table into CR3
 void load_page_directory(void) {
-    asm volatile("mov %0, %%cr3" :: "r" (vmm.pml4) : "memory");
+    asm volatile("mov %0, %%cr3" :: "r" (virt_to_phys(vmm.kernel_pml4)) : "memory");
 }
 
 // Main memory initialization function
@@ -462,150 +1202,399 @@ void memory_init(void) {
     // Load the page directory
     load_page_directory();
     
+    // Large virtually contiguous allocations
+    vmalloc_init();
+    
     console_write("Memory management initialized.\n");
 }
 
-// Simple heap block header for tracking allocations
+// Kernel heap: boundary-tag blocks kept in segregated free lists.
+// Every block starts with a 16-byte header holding its own size and the size
+// of the block before it, so neighbours are found in O(1) for coalescing.
+// Small blocks live in exact 16-byte size-class bins; large blocks use
+// two-level (power of two, then quarter) bins. A bitmap of non-empty bins
+// turns the search for a fitting block into a find-first-set.
 struct heap_block {
-    size_t size;
-    struct heap_block* next;
-    int free;
+    uint64_t prev_size;             // Size of the previous block (0 for the first)
+    uint64_t size;                  // Size of this block including header | flags
+    struct heap_block* next_free;   // Free list links, only valid while free
+    struct heap_block* prev_free;
 };
 
-// Heap metadata
-static struct heap_block* heap_first_block = NULL;
+#define HEAP_ALIGN          16
+#define HEAP_HEADER_SIZE    16
+#define HEAP_MIN_BLOCK      32      // Header plus room for the free list links
+#define HEAP_BLOCK_FREE     0x1
+#define HEAP_SIZE_MASK      (~(uint64_t)(HEAP_ALIGN - 1))
 
-// Simple kmalloc implementation
-void* kmalloc(size_t size) {
-    // Align size to 4 bytes
-    size = (size + 3) & ~3;
+#define HEAP_SMALL_LIMIT    1024    // Blocks below this use exact-size bins
+#define HEAP_SMALL_BINS     (HEAP_SMALL_LIMIT / HEAP_ALIGN)
+#define HEAP_SMALL_SHIFT    10      // log2(HEAP_SMALL_LIMIT)
+#define HEAP_SUB_BINS_LOG2  2       // Each power of two is split into 4 bins
+#define HEAP_SUB_BINS       (1 << HEAP_SUB_BINS_LOG2)
+#define HEAP_LARGE_BINS     (32 * HEAP_SUB_BINS)
+#define HEAP_BIN_COUNT      (HEAP_SMALL_BINS + HEAP_LARGE_BINS)
+#define HEAP_BITMAP_WORDS   ((HEAP_BIN_COUNT + 63) / 64)
+
+#define HEAP_INITIAL_SIZE   (4 * 1024 * 1024)
+#define HEAP_GROW_MIN       (64 * 1024)
+#define HEAP_LARGE_ORDER    9       // Buddy order of a 2MB block
+
+static struct heap_block* heap_bins[HEAP_BIN_COUNT];
+static uint64_t heap_bitmap[HEAP_BITMAP_WORDS];
+static int heap_initialized = 0;
+static spinlock_t heap_lock = SPINLOCK_INIT;
+static spinlock_t heap_fault_lock = SPINLOCK_INIT;
+
+static inline uint64_t heap_block_size(struct heap_block* block) {
+    return block->size & HEAP_SIZE_MASK;
+}
+
+static inline struct heap_block* heap_next_block(struct heap_block* block) {
+    return (struct heap_block*)((uint8_t*)block + heap_block_size(block));
+}
+
+// Bin holding blocks of exactly this size (small) or this size range (large)
+static uint32_t heap_bin_index(uint64_t size) {
+    if (size < HEAP_SMALL_LIMIT) {
+        return size / HEAP_ALIGN;
+    }
+    uint32_t fl = 63 - __builtin_clzll(size);
+    uint32_t sl = (size >> (fl - HEAP_SUB_BINS_LOG2)) & (HEAP_SUB_BINS - 1);
+    uint32_t bin = HEAP_SMALL_BINS + (fl - HEAP_SMALL_SHIFT) * HEAP_SUB_BINS + sl;
+    return bin < HEAP_BIN_COUNT ? bin : HEAP_BIN_COUNT - 1;
+}
+
+// First bin whose every block is at least this size
+static uint32_t heap_search_bin(uint64_t size) {
+    if (size >= HEAP_SMALL_LIMIT) {
+        uint32_t fl = 63 - __builtin_clzll(size);
+        size += (1ULL << (fl - HEAP_SUB_BINS_LOG2)) - 1;
+    }
+    return heap_bin_index(size);
+}
+
+static void heap_bin_insert(struct heap_block* block) {
+    uint32_t bin = heap_bin_index(heap_block_size(block));
+    block->prev_free = NULL;
+    block->next_free = heap_bins[bin];
+    if (heap_bins[bin]) {
+        heap_bins[bin]->prev_free = block;
+    }
+    heap_bins[bin] = block;
+    heap_bitmap[bin / 64] |= 1ULL << (bin % 64);
+}
+
+static void heap_bin_remove(struct heap_block* block) {
+    uint32_t bin = heap_bin_index(heap_block_size(block));
+    if (block->prev_free) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        heap_bins[bin] = block->next_free;
+    }
+    if (block->next_free) {
+        block->next_free->prev_free = block->prev_free;
+    }
+    if (heap_bins[bin] == NULL) {
+        heap_bitmap[bin / 64] &= ~(1ULL << (bin % 64));
+    }
+}
+
+// Lowest non-empty bin at or above `bin`, or HEAP_BIN_COUNT if none
+static uint32_t heap_find_bin(uint32_t bin) {
+    uint32_t word = bin / 64;
+    uint64_t bits = heap_bitmap[word] & (~0ULL << (bin % 64));
+
+    while (bits == 0) {
+        if (++word >= HEAP_BITMAP_WORDS) {
+            return HEAP_BIN_COUNT;
+        }
+        bits = heap_bitmap[word];
+    }
+    return word * 64 + __builtin_ctzll(bits);
+}
+
+// Give back the physical pages under a free block that lie within
+// [start, end). The block's own header stays mapped, as does the header of
+// the block after it.
+static void heap_trim_block(struct heap_block* block, uint64_t start, uint64_t end) {
+    uint64_t first = (uint64_t)block + HEAP_MIN_BLOCK;
+    uint64_t last = (uint64_t)heap_next_block(block);
+    
+    if (start < first) {
+        start = first;
+    }
+    if (end > last) {
+        end = last;
+    }
+    start = (start + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    end &= ~(uint64_t)(PAGE_SIZE - 1);
     
-    // If heap is not initialized, initialize it
-    if (heap_first_block == NULL) {
-        // Reserve virtual memory for heap
-        uint64_t heap_size = 4 * 1024 * 1024; // 4MB heap
-        
-        // Map physical pages for heap
-        for (uint64_t addr = vmm.heap_start; addr < vmm.heap_start + heap_size; addr += PAGE_SIZE) {
-            void* phys_page = alloc_physical_page();
-            if (phys_page == NULL) {
-                console_write("ERROR: Failed to allocate physical page for heap\n");
-                return NULL;
-            }
-            
-            if (map_page(addr, (uint64_t)phys_page, PAGE_PRESENT | PAGE_WRITABLE) != 0) {
-                console_write("ERROR: Failed to map page for heap\n");
-                return NULL;
-            }
+    if (start < end) {
+        unmap_and_free_pages(start, end - start);
+    }
+}
+
+// Mark a block free, merge it with free neighbours and bin the result
+static void heap_release_block(struct heap_block* block) {
+    uint64_t size = heap_block_size(block);
+    uint64_t freed_start = (uint64_t)block & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t freed_end = (uint64_t)block + size + HEAP_HEADER_SIZE;
+
+    // Merge with the following block
+    struct heap_block* next = heap_next_block(block);
+    if (next->size & HEAP_BLOCK_FREE) {
+        heap_bin_remove(next);
+        size += heap_block_size(next);
+    }
+
+    // Merge with the preceding block
+    if (block->prev_size != 0) {
+        struct heap_block* prev = (struct heap_block*)((uint8_t*)block - block->prev_size);
+        if (prev->size & HEAP_BLOCK_FREE) {
+            heap_bin_remove(prev);
+            size += heap_block_size(prev);
+            block = prev;
+        }
+    }
+
+    block->size = size | HEAP_BLOCK_FREE;
+    heap_next_block(block)->prev_size = size;
+    heap_bin_insert(block);
+    
+    // Neighbours were trimmed when they were freed; only the pages this
+    // block (and the headers it absorbed) occupied can have become free
+    heap_trim_block(block, freed_start, freed_end);
+}
+
+// Back a touched heap page with a fresh frame. Called from the page-fault
+// handler, possibly while heap_lock is held, so it must not take it.
+static int heap_handle_fault(uint64_t fault_addr) {
+    uint64_t page_addr = fault_addr & ~(uint64_t)(PAGE_SIZE - 1);
+    int result = 0;
+    
+    uint64_t flags = spin_lock_irqsave(&heap_fault_lock);
+    
+    // Another CPU may have faulted the same page in first
+    if (get_physical_address(page_addr) == 0) {
+        void* phys_page = alloc_physical_page();
+        if (phys_page == NULL) {
+            console_write("ERROR: Out of memory backing kernel heap\n");
+            result = -1;
+        } else if (map_page(page_addr, (uint64_t)phys_page, PAGE_PRESENT | PAGE_WRITABLE) != 0) {
+            free_physical_page((uint64_t)phys_page);
+            result = -1;
+        }
+    }
+    
+    spin_unlock_irqrestore(&heap_fault_lock, flags);
+    return result;
+}
+
+// Give the faulting address space its own copy of a copy-on-write page, or
+// just make the page writable again when nobody else shares it any more
+static int vmm_handle_cow_fault(uint64_t fault_addr) {
+    uint64_t page_addr = fault_addr & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t irq_flags = spin_lock_irqsave(&pt_lock);
+    
+    int level;
+    page_entry_t* entry = vmm_lookup(page_addr, &level);
+    if (level != PT_LEVEL_PT || (*entry & (PAGE_PRESENT | PAGE_COW)) != (PAGE_PRESENT | PAGE_COW)) {
+        spin_unlock_irqrestore(&pt_lock, irq_flags);
+        return -1;
+    }
+    
+    uint64_t old_phys = *entry & PAGE_FRAME_MASK;
+    uint64_t flags = (*entry & ~PAGE_FRAME_MASK & ~(uint64_t)PAGE_COW) | PAGE_WRITABLE;
+    
+    if (pmm_page_sharers(old_phys) == 0) {
+        *entry = old_phys | flags;
+    } else {
+        void* new_page = alloc_physical_page();
+        if (new_page == NULL) {
+            spin_unlock_irqrestore(&pt_lock, irq_flags);
+            console_write("ERROR: Out of memory on copy-on-write\n");
+            return -1;
         }
         
-        // Initialize first block
-        heap_first_block = (struct heap_block*)vmm.heap_start;
-        heap_first_block->size = heap_size - sizeof(struct heap_block);
-        heap_first_block->next = NULL;
-        heap_first_block->free = 1;
+        uint64_t* dst = (uint64_t*)phys_to_virt((uint64_t)new_page);
+        uint64_t* src = (uint64_t*)phys_to_virt(old_phys);
+        for (int i = 0; i < PAGE_SIZE / 8; i++) {
+            dst[i] = src[i];
+        }
         
-        // Update heap end
-        vmm.heap_end = vmm.heap_start + heap_size;
+        *entry = (uint64_t)new_page | flags;
     }
     
-    // Find a free block
-    struct heap_block* current = heap_first_block;
-    struct heap_block* best_fit = NULL;
+    uint64_t new_phys = *entry & PAGE_FRAME_MASK;
+    spin_unlock_irqrestore(&pt_lock, irq_flags);
     
-    while (current) {
-        if (current->free && current->size >= size) {
-            if (best_fit == NULL || current->size < best_fit->size) {
-                best_fit = current;
-            }
-        }
-        current = current->next;
+    // The old frame may only lose this owner once no TLB maps it here
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb);
+    tlb_gather_add(&tlb, page_addr);
+    if (new_phys != old_phys) {
+        tlb_gather_free_page(&tlb, old_phys);
+    }
+    tlb_gather_commit(&tlb);
+    return 0;
+}
+
+// Resolve a page fault if it belongs to memory that is mapped on demand.
+// Returns 0 when the faulting access can be retried.
+int vmm_handle_page_fault(uint64_t fault_addr, uint64_t err_code) {
+    // Writes to user pages shared copy-on-write by fork (from either mode)
+    if ((err_code & (PF_PRESENT | PF_WRITE)) == (PF_PRESENT | PF_WRITE) &&
+        fault_addr < USER_SPACE_END) {
+        return vmm_handle_cow_fault(fault_addr);
     }
     
-    // If no suitable block found, extend heap
-    if (best_fit == NULL) {
-        // Calculate how many pages we need
-        size_t needed_size = sizeof(struct heap_block) + size;
-        size_t pages_needed = (needed_size + PAGE_SIZE - 1) / PAGE_SIZE;
-        
-        // Map new pages
-        for (size_t i = 0; i < pages_needed; i++) {
-            void* phys_page = alloc_physical_page();
-            if (phys_page == NULL) {
-                console_write("ERROR: Failed to allocate physical page for heap extension\n");
-                return NULL;
-            }
-            
-            uint64_t virt_addr = vmm.heap_end + i * PAGE_SIZE;
-            if (map_page(virt_addr, (uint64_t)phys_page, PAGE_PRESENT | PAGE_WRITABLE) != 0) {
-                console_write("ERROR: Failed to map page for heap extension\n");
-                return NULL;
-            }
+    // Kernel accesses to not-yet-backed pages of the heap
+    if (!(err_code & (PF_PRESENT | PF_USER | PF_RESERVED)) &&
+        fault_addr >= vmm.heap_start && fault_addr < vmm.heap_end) {
+        return heap_handle_fault(fault_addr);
+    }
+    
+    return -1;
+}
+
+// Back every 2MB-aligned stretch of [start, end) that has nothing mapped
+// yet with a large page, so a big allocation takes one TLB entry per 2MB
+// instead of 512 faults and 4KB entries. The frames are split into single
+// pages, so freeing the memory later trims it page by page like the rest
+// of the heap. Stretches that cannot get a large page are faulted in.
+static void heap_map_large(uint64_t start, uint64_t end) {
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb);
+    
+    start = (start + PAGE_SIZE_2M - 1) & ~(uint64_t)(PAGE_SIZE_2M - 1);
+    for (uint64_t addr = start; addr + PAGE_SIZE_2M <= end; addr += PAGE_SIZE_2M) {
+        void* block = pmm_alloc_pages(HEAP_LARGE_ORDER);
+        if (block == NULL) {
+            break;
         }
         
-        // Create new block
-        best_fit = (struct heap_block*)vmm.heap_end;
-        best_fit->size = pages_needed * PAGE_SIZE - sizeof(struct heap_block);
-        best_fit->next = NULL;
-        best_fit->free = 1;
+        uint64_t flags = spin_lock_irqsave(&pt_lock);
+        int level;
+        page_entry_t* entry = vmm_lookup(addr, &level);
+        int mapped = level >= PT_LEVEL_PD && !(*entry & PAGE_PRESENT) &&
+                     vmm_map_range(&tlb, addr, (uint64_t)block, PAGE_SIZE_2M,
+                                   PAGE_PRESENT | PAGE_WRITABLE) == 0;
+        spin_unlock_irqrestore(&pt_lock, flags);
         
-        // Link to previous block
-        current = heap_first_block;
-        while (current->next) {
-            current = current->next;
+        if (mapped) {
+            pmm_split_pages((uint64_t)block, HEAP_LARGE_ORDER);
+        } else {
+            pmm_free_pages((uint64_t)block, HEAP_LARGE_ORDER);
         }
-        current->next = best_fit;
-        
-        // Update heap end
-        vmm.heap_end += pages_needed * PAGE_SIZE;
     }
     
-    // If the block is exactly the right size or only slightly larger, use it as is
-    if (best_fit->size <= size + sizeof(struct heap_block) + 16) {
-        // Use the whole block
-        best_fit->free = 0;
-        return (void*)(best_fit + 1);
+    tlb_gather_commit(&tlb);
+}
+
+// Extend the heap's virtual range and turn it into a free block. No memory
+// is mapped here: pages are faulted in by heap_handle_fault() when first
+// touched, or mapped with large pages by kmalloc() for big allocations.
+static int heap_grow(uint64_t min_size) {
+    uint64_t grow = (min_size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    if (grow < HEAP_GROW_MIN) {
+        grow = HEAP_GROW_MIN;
+    }
+    if (vmm.heap_end + grow > vmm.heap_max) {
+        console_write("ERROR: Kernel heap exhausted\n");
+        return -1;
+    }
+    
+    // Claim the range first so touching the new headers faults them in
+    uint64_t old_end = vmm.heap_end;
+    vmm.heap_end += grow;
+    
+    struct heap_block* block;
+    if (!heap_initialized) {
+        // First block plus a zero-sized in-use epilogue at the very end
+        block = (struct heap_block*)vmm.heap_start;
+        block->prev_size = 0;
+        block->size = grow - HEAP_HEADER_SIZE;
+        heap_initialized = 1;
     } else {
-        // Split the block
-        struct heap_block* new_block = (struct heap_block*)((char*)(best_fit + 1) + size);
-        new_block->size = best_fit->size - size - sizeof(struct heap_block);
-        new_block->next = best_fit->next;
-        new_block->free = 1;
-        
-        best_fit->size = size;
-        best_fit->next = new_block;
-        best_fit->free = 0;
-        
-        return (void*)(best_fit + 1);
+        // The old epilogue becomes the header of the new block
+        block = (struct heap_block*)(old_end - HEAP_HEADER_SIZE);
+        block->size = grow;
     }
+    
+    struct heap_block* epilogue = heap_next_block(block);
+    epilogue->prev_size = heap_block_size(block);
+    epilogue->size = 0;
+    
+    heap_release_block(block);
+    return 0;
 }
 
-// Simple kfree implementation
-void kfree(void* ptr) {
-    if (ptr == NULL) {
-        return;
+// Allocate size bytes from the kernel heap (16-byte aligned)
+void* kmalloc(size_t size) {
+    // Block size: header plus payload, rounded to the heap alignment
+    uint64_t block_size = (size + HEAP_HEADER_SIZE + HEAP_ALIGN - 1) & HEAP_SIZE_MASK;
+    if (block_size < HEAP_MIN_BLOCK) {
+        block_size = HEAP_MIN_BLOCK;
     }
     
-    // Get the block header
-    struct heap_block* block = ((struct heap_block*)ptr) - 1;
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
     
-    // Mark as free
-    block->free = 1;
+    if (!heap_initialized && heap_grow(HEAP_INITIAL_SIZE) != 0) {
+        spin_unlock_irqrestore(&heap_lock, flags);
+        return NULL;
+    }
     
-    // Coalesce with next block if it's free
-    if (block->next && block->next->free) {
-        block->size += sizeof(struct heap_block) + block->next->size;
-        block->next = block->next->next;
+    uint32_t bin = heap_find_bin(heap_search_bin(block_size));
+    if (bin == HEAP_BIN_COUNT) {
+        if (heap_grow(block_size) != 0) {
+            spin_unlock_irqrestore(&heap_lock, flags);
+            return NULL;
+        }
+        bin = heap_find_bin(heap_search_bin(block_size));
+        if (bin == HEAP_BIN_COUNT) {
+            spin_unlock_irqrestore(&heap_lock, flags);
+            return NULL;
+        }
     }
     
-    // Coalesce with previous block if it's free
-    struct heap_block* current = heap_first_block;
-    while (current && current->next != block) {
-        current = current->next;
+    struct heap_block* block = heap_bins[bin];
+    heap_bin_remove(block);
+    
+    // Split off the tail if it is big enough to be a block of its own
+    uint64_t total = heap_block_size(block);
+    if (total - block_size >= HEAP_MIN_BLOCK) {
+        struct heap_block* rest = (struct heap_block*)((uint8_t*)block + block_size);
+        rest->prev_size = block_size;
+        rest->size = (total - block_size) | HEAP_BLOCK_FREE;
+        heap_next_block(rest)->prev_size = total - block_size;
+        heap_bin_insert(rest);
+        total = block_size;
     }
+    block->size = total;
     
-    if (current && current->free) {
-        current->size += sizeof(struct heap_block) + block->size;
-        current->next = block->next;
+    if (total >= PAGE_SIZE_2M) {
+        heap_map_large((uint64_t)block + HEAP_HEADER_SIZE, (uint64_t)block + total);
     }
-}
\ No newline at end of file
+    
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return (uint8_t*)block + HEAP_HEADER_SIZE;
+}
+
+// Return a kmalloc() allocation to the heap
+void kfree(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    
+    struct heap_block* block = (struct heap_block*)((uint8_t*)ptr - HEAP_HEADER_SIZE);
+    
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    if (block->size & HEAP_BLOCK_FREE) {
+        spin_unlock_irqrestore(&heap_lock, flags);
+        console_write("ERROR: Double free in kfree\n");
+        return;
+    }
+    heap_release_block(block);
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
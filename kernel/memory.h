@@ -38,8 +38,8 @@ struct boot_info {
 
 // Memory region structure for tracking
 struct memory_region {
-    uint32_t base;
-    uint32_t length;
+    uint64_t base;
+    uint64_t length;
     uint32_t type;
 };
 
@@ -47,8 +47,8 @@ struct memory_region {
 struct pmm_info {
     struct memory_region regions[MAX_MEMORY_MAP_ENTRIES];
     uint32_t region_count;
-    uint32_t total_memory;
-    uint32_t free_memory;
+    uint64_t total_memory;
+    uint64_t free_memory;
 };
 
 // Page table entry flags
@@ -59,7 +59,38 @@ struct pmm_info {
 #define PAGE_CACHE_DISABLE  0x10
 #define PAGE_ACCESSED   0x20
 #define PAGE_DIRTY      0x40
+#define PAGE_HUGE       0x80    // PS bit: 2MB PDE or 1GB PDPTE
 #define PAGE_GLOBAL     0x100
+#define PAGE_COW        0x200   // Software bit: write-protected for copy-on-write
+#define PAGE_LARGE_PAT  0x1000  // PAT bit in a large-page entry
+
+// CR0 bit that makes supervisor writes fault on read-only pages
+#define CR0_WP          (1ULL << 16)
+
+// End of the user half of the address space
+#define USER_SPACE_END  0x0000800000000000ULL
+
+// PML4 slots covering the user half; the rest are shared by every process
+#define PML4_USER_ENTRIES 256
+
+// Page-fault error code bits
+#define PF_PRESENT      0x01    // Protection violation (page was present)
+#define PF_WRITE        0x02    // Faulting access was a write
+#define PF_USER         0x04    // Fault happened in user mode
+#define PF_RESERVED     0x08    // Reserved bit set in a paging entry
+#define PF_INSTR        0x10    // Instruction fetch
+
+// Large page sizes
+#define PAGE_SIZE_2M    0x200000ULL
+#define PAGE_SIZE_1G    0x40000000ULL
+
+// Physical address bits of a 4KB PTE / a large-page entry (bit 12 is PAT there)
+#define PAGE_FRAME_MASK       0x000FFFFFFFFFF000ULL
+#define PAGE_LARGE_FRAME_MASK 0x000FFFFFFFFFE000ULL
+
+// Direct map: physical address p is always mapped at DIRECT_MAP_BASE + p
+#define DIRECT_MAP_BASE 0xFFFF888000000000ULL
+#define DIRECT_MAP_SIZE (64ULL << 40)   // Highest physical address covered (64TB)
 
 // Virtual address components for 64-bit paging (4-level)
 // Only using 48 bits of virtual address as per x86-64 specification
@@ -74,7 +105,7 @@ typedef uint64_t page_entry_t;
 
 // Virtual Memory Manager structure
 struct vmm_info {
-    page_entry_t* pml4;          // Current PML4 table
+    page_entry_t* kernel_pml4;   // PML4 the kernel booted with
     uint64_t heap_start;         // Start of kernel heap
     uint64_t heap_end;           // End of kernel heap
     uint64_t heap_max;           // Maximum heap address
@@ -93,8 +124,32 @@ void load_page_directory(void);
 int map_page(uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags);
 int unmap_page(uint64_t virtual_addr);
 int set_page_flags(uint64_t virtual_addr, uint64_t flags);
+uint64_t get_physical_address(uint64_t virtual_addr);
+int map_range(uint64_t virtual_addr, uint64_t physical_addr, uint64_t size, uint64_t flags);
+int unmap_range(uint64_t virtual_addr, uint64_t size);
+int protect_range(uint64_t virtual_addr, uint64_t size, uint64_t flags);
+
+// Batched variants: TLB invalidation is deferred to tlb_gather_commit()
+struct tlb_gather;
+int map_page_batched(struct tlb_gather* tlb, uint64_t virtual_addr, uint64_t physical_addr, uint64_t flags);
+int map_page_in_batched(struct tlb_gather* tlb, uint64_t cr3, uint64_t virtual_addr,
+                        uint64_t physical_addr, uint64_t flags);
+int unmap_page_batched(struct tlb_gather* tlb, uint64_t virtual_addr);
+int set_page_flags_batched(struct tlb_gather* tlb, uint64_t virtual_addr, uint64_t flags);
+int map_range_batched(struct tlb_gather* tlb, uint64_t virtual_addr, uint64_t physical_addr,
+                      uint64_t size, uint64_t flags);
+int unmap_range_batched(struct tlb_gather* tlb, uint64_t virtual_addr, uint64_t size);
+int protect_range_batched(struct tlb_gather* tlb, uint64_t virtual_addr, uint64_t size, uint64_t flags);
+void unmap_and_free_pages(uint64_t virtual_addr, uint64_t size);
 void* alloc_physical_page(void);
 void free_physical_page(uint64_t physical_addr);
+int vmm_handle_page_fault(uint64_t fault_addr, uint64_t err_code);
+void vmm_init_cpu(void);
+uint64_t vmm_create_address_space(void);
+uint64_t vmm_fork_address_space(uint64_t src_cr3);
+void vmm_destroy_address_space(uint64_t cr3);
+void vmm_switch_address_space(uint64_t cr3);
+uint64_t vmm_current_cr3(void);
 
 // Test function
 void test_memory_management(void);
@@ -102,5 +157,24 @@ void test_memory_management(void);
 // External boot info
 extern struct boot_info* boot_params;
 extern struct vmm_info vmm;
+extern uint64_t direct_map_offset;
+
+// Kernel pointer for a physical address
+static inline void* phys_to_virt(uint64_t physical_addr) {
+    return (void*)(physical_addr + direct_map_offset);
+}
+
+// Physical address behind a kernel pointer; direct-map addresses are
+// translated arithmetically, anything else (heap, stacks) by a table walk
+static inline uint64_t virt_to_phys(const void* virtual_addr) {
+    uint64_t addr = (uint64_t)virtual_addr;
+    if (direct_map_offset == 0) {
+        return addr;
+    }
+    if (addr >= DIRECT_MAP_BASE && addr - DIRECT_MAP_BASE < DIRECT_MAP_SIZE) {
+        return addr - DIRECT_MAP_BASE;
+    }
+    return get_physical_address(addr);
+}
 
 #endif
\ No newline at end of file
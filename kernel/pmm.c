@@ -0,0 +1,706 @@
+// kernel/pmm.c
+#include "pmm.h"
+#include "memory.h"
+#include "spinlock.h"
+#include "cpu.h"
+#include "scheduler.h"
+#include "drivers/console.h"
+#include <stdint.h>
+
+// End of the kernel image (from boot.ld)
+extern unsigned int _bss_end;
+
+extern struct pmm_info pmm;
+
+static struct buddy_allocator buddy;
+static uint64_t frames_phys;        // Physical address of buddy.frames
+static uint64_t frames_size;        // Bytes used by buddy.frames
+static uint64_t managed_low;        // Lowest physical address handed out
+static spinlock_t buddy_lock = SPINLOCK_INIT;
+
+// Per-CPU caches of order-0 pages
+static struct page_magazine magazines[MAX_CPUS];
+
+// Pages already cleared by the zeroing task
+static struct zero_pool zero_pool;
+static spinlock_t zero_pool_lock = SPINLOCK_INIT;
+
+static uint32_t zero_pool_drain(void);
+
+// Remove a block from the free list of its order
+static void free_list_remove(uint32_t pfn, uint32_t order) {
+    struct page_frame* frame = &buddy.frames[pfn];
+
+    if (frame->prev != PAGE_FRAME_NONE) {
+        buddy.frames[frame->prev].next = frame->next;
+    } else {
+        buddy.areas[order].head = frame->next;
+    }
+    if (frame->next != PAGE_FRAME_NONE) {
+        buddy.frames[frame->next].prev = frame->prev;
+    }
+
+    frame->next = PAGE_FRAME_NONE;
+    frame->prev = PAGE_FRAME_NONE;
+    frame->flags &= ~PAGE_FRAME_FREE;
+
+    buddy.areas[order].count--;
+    if (buddy.areas[order].count == 0) {
+        buddy.nonempty_orders &= ~(1U << order);
+    }
+}
+
+// Push a block onto the free list of its order
+static void free_list_push(uint32_t pfn, uint32_t order) {
+    struct page_frame* frame = &buddy.frames[pfn];
+
+    frame->order = order;
+    frame->flags = PAGE_FRAME_FREE;
+    frame->prev = PAGE_FRAME_NONE;
+    frame->next = buddy.areas[order].head;
+    if (frame->next != PAGE_FRAME_NONE) {
+        buddy.frames[frame->next].prev = pfn;
+    }
+
+    buddy.areas[order].head = pfn;
+    buddy.areas[order].count++;
+    buddy.nonempty_orders |= 1U << order;
+}
+
+// Return a block to the allocator, merging with free buddies (lock held)
+static void buddy_free_block(uint32_t pfn, uint32_t order) {
+    buddy.free_pages += 1ULL << order;
+
+    while (order < PMM_MAX_ORDER - 1) {
+        uint32_t buddy_pfn = pfn ^ (1U << order);
+        if (buddy_pfn >= buddy.max_pfn) {
+            break;
+        }
+
+        struct page_frame* buddy_frame = &buddy.frames[buddy_pfn];
+        if (!(buddy_frame->flags & PAGE_FRAME_FREE) || buddy_frame->order != order) {
+            break;
+        }
+
+        // Buddy is free and the same size: absorb it
+        free_list_remove(buddy_pfn, order);
+        pfn &= ~(1U << order);
+        order++;
+    }
+
+    free_list_push(pfn, order);
+}
+
+// Hand a range of frames to the allocator using the largest aligned blocks
+static void buddy_free_range(uint64_t start_pfn, uint64_t end_pfn) {
+    while (start_pfn < end_pfn) {
+        uint32_t order = PMM_MAX_ORDER - 1;
+        while (order > 0 &&
+               ((start_pfn & ((1ULL << order) - 1)) != 0 ||
+                start_pfn + (1ULL << order) > end_pfn)) {
+            order--;
+        }
+
+        buddy_free_block((uint32_t)start_pfn, order);
+        buddy.total_pages += 1ULL << order;
+        start_pfn += 1ULL << order;
+    }
+}
+
+// Release the parts of every RAM region inside [min_addr, max_addr) to the
+// allocator, leaving out the low reserved area and the frame array
+static void buddy_release_regions(uint64_t min_addr, uint64_t max_addr) {
+    uint64_t frames_start_pfn = frames_phys / PAGE_SIZE;
+    uint64_t frames_end_pfn = (frames_phys + frames_size) / PAGE_SIZE;
+
+    if (min_addr < managed_low) {
+        min_addr = managed_low;
+    }
+
+    for (uint32_t i = 0; i < pmm.region_count; i++) {
+        uint64_t start = pmm.regions[i].base;
+        uint64_t end = start + pmm.regions[i].length;
+        if (start < min_addr) {
+            start = min_addr;
+        }
+        if (end > max_addr) {
+            end = max_addr;
+        }
+
+        // Only whole pages inside the region are usable
+        uint64_t start_pfn = (start + PAGE_SIZE - 1) / PAGE_SIZE;
+        uint64_t end_pfn = end / PAGE_SIZE;
+        if (start_pfn >= end_pfn) {
+            continue;
+        }
+
+        uint64_t flags = spin_lock_irqsave(&buddy_lock);
+
+        // Skip over the frame descriptor array if it lives in this region
+        if (frames_start_pfn < end_pfn && frames_end_pfn > start_pfn) {
+            if (start_pfn < frames_start_pfn) {
+                buddy_free_range(start_pfn, frames_start_pfn);
+            }
+            if (frames_end_pfn < end_pfn) {
+                buddy_free_range(frames_end_pfn, end_pfn);
+            }
+        } else {
+            buddy_free_range(start_pfn, end_pfn);
+        }
+
+        spin_unlock_irqrestore(&buddy_lock, flags);
+    }
+
+    pmm.free_memory = buddy.free_pages * PAGE_SIZE;
+}
+
+// Smallest order whose block covers size bytes
+uint32_t pmm_order_for_size(size_t size) {
+    uint32_t order = 0;
+    while (order < PMM_MAX_ORDER && ((size_t)PAGE_SIZE << order) < size) {
+        order++;
+    }
+    return order;
+}
+
+// Build the buddy allocator from the RAM regions collected by init_pmm()
+void pmm_buddy_init(void) {
+    console_write("Initializing buddy page allocator...\n");
+
+    // Find the highest usable physical frame
+    uint64_t max_addr = 0;
+    for (uint32_t i = 0; i < pmm.region_count; i++) {
+        uint64_t end = pmm.regions[i].base + pmm.regions[i].length;
+        if (end > max_addr) {
+            max_addr = end;
+        }
+    }
+    if (max_addr > PMM_MAX_PHYS_ADDR) {
+        console_write("WARNING: Ignoring physical memory above 16TB\n");
+        max_addr = PMM_MAX_PHYS_ADDR;
+    }
+
+    buddy.max_pfn = max_addr / PAGE_SIZE;
+    if (buddy.max_pfn == 0) {
+        console_write("ERROR: No RAM regions for page allocator!\n");
+        return;
+    }
+
+    // Nothing below the kernel image and the low reserved area is managed
+    managed_low = ((uint64_t)&_bss_end + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    if (managed_low < PMM_RESERVED_LOW) {
+        managed_low = PMM_RESERVED_LOW;
+    }
+
+    // Carve the frame descriptor array out of the first region that fits;
+    // it must be reachable through the boot identity map
+    frames_size = (uint64_t)buddy.max_pfn * sizeof(struct page_frame);
+    frames_size = (frames_size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t frames_base = 0;
+
+    for (uint32_t i = 0; i < pmm.region_count; i++) {
+        uint64_t start = pmm.regions[i].base;
+        uint64_t end = start + pmm.regions[i].length;
+        if (start < managed_low) {
+            start = managed_low;
+        }
+        if (end > PMM_BOOT_MAPPED_LIMIT) {
+            end = PMM_BOOT_MAPPED_LIMIT;
+        }
+        start = (start + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+        if (start + frames_size <= end) {
+            frames_base = start;
+            break;
+        }
+    }
+
+    if (frames_base == 0) {
+        console_write("ERROR: No room for page frame array!\n");
+        return;
+    }
+
+    frames_phys = frames_base;
+    buddy.frames = (struct page_frame*)phys_to_virt(frames_base);
+
+    // Everything starts out reserved; usable RAM is released below
+    for (uint64_t pfn = 0; pfn < buddy.max_pfn; pfn++) {
+        buddy.frames[pfn].next = PAGE_FRAME_NONE;
+        buddy.frames[pfn].prev = PAGE_FRAME_NONE;
+        buddy.frames[pfn].order = 0;
+        buddy.frames[pfn].flags = PAGE_FRAME_RESERVED;
+        buddy.frames[pfn].count = 0;
+    }
+
+    for (uint32_t order = 0; order < PMM_MAX_ORDER; order++) {
+        buddy.areas[order].head = PAGE_FRAME_NONE;
+        buddy.areas[order].count = 0;
+    }
+    buddy.nonempty_orders = 0;
+    buddy.total_pages = 0;
+    buddy.free_pages = 0;
+
+    // Until the direct map exists only identity-mapped frames can be used,
+    // since page tables and the frame array are reached through that map
+    buddy_release_regions(0, PMM_BOOT_MAPPED_LIMIT);
+
+    console_write("Buddy page allocator initialized.\n");
+}
+
+// Take a free block of block_order and split it down to order, returning
+// the upper halves to the free lists (lock held)
+static void buddy_take_block(uint32_t pfn, uint32_t block_order, uint32_t order) {
+    free_list_remove(pfn, block_order);
+
+    while (block_order > order) {
+        block_order--;
+        free_list_push(pfn + (1U << block_order), block_order);
+    }
+
+    buddy.frames[pfn].order = order;
+    buddy.frames[pfn].flags = PAGE_FRAME_ALLOCATED;
+    buddy.free_pages -= 1ULL << order;
+}
+
+// Allocate 2^order physically contiguous pages
+void* pmm_alloc_pages(uint32_t order) {
+    if (order >= PMM_MAX_ORDER || buddy.frames == NULL) {
+        return NULL;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&buddy_lock);
+
+    // Smallest non-empty order that can satisfy the request
+    uint32_t candidates = buddy.nonempty_orders & ~((1U << order) - 1);
+    if (candidates == 0) {
+        spin_unlock_irqrestore(&buddy_lock, flags);
+        // Pages parked in the zeroed pool are still free memory
+        if (zero_pool_drain() > 0) {
+            return pmm_alloc_pages(order);
+        }
+        return NULL;
+    }
+
+    uint32_t current_order = __builtin_ctz(candidates);
+    uint32_t pfn = buddy.areas[current_order].head;
+    buddy_take_block(pfn, current_order, order);
+
+    spin_unlock_irqrestore(&buddy_lock, flags);
+
+    return (void*)((uint64_t)pfn * PAGE_SIZE);
+}
+
+// Allocate 2^order physically contiguous pages that end at or below limit.
+// Walks the free lists, so it is meant for occasional constrained callers
+// such as DMA buffers rather than the page fault path.
+void* pmm_alloc_pages_below(uint32_t order, uint64_t limit) {
+    if (order >= PMM_MAX_ORDER || buddy.frames == NULL) {
+        return NULL;
+    }
+
+    uint64_t limit_pfn = limit / PAGE_SIZE;
+    uint64_t flags = spin_lock_irqsave(&buddy_lock);
+
+    // Any block of a larger order that lies below the limit can be split,
+    // and its lowest part is below the limit too
+    for (uint32_t current_order = order; current_order < PMM_MAX_ORDER; current_order++) {
+        uint32_t pfn = buddy.areas[current_order].head;
+        while (pfn != PAGE_FRAME_NONE) {
+            if ((uint64_t)pfn + (1ULL << order) <= limit_pfn) {
+                buddy_take_block(pfn, current_order, order);
+                spin_unlock_irqrestore(&buddy_lock, flags);
+                return (void*)((uint64_t)pfn * PAGE_SIZE);
+            }
+            pfn = buddy.frames[pfn].next;
+        }
+    }
+
+    spin_unlock_irqrestore(&buddy_lock, flags);
+    if (zero_pool_drain() > 0) {
+        return pmm_alloc_pages_below(order, limit);
+    }
+    return NULL;
+}
+
+// Free 2^order pages previously returned by pmm_alloc_pages()
+void pmm_free_pages(uint64_t physical_addr, uint32_t order) {
+    if (physical_addr & (PAGE_SIZE - 1)) {
+        console_write("ERROR: Freeing unaligned physical page!\n");
+        return;
+    }
+
+    uint64_t pfn = physical_addr / PAGE_SIZE;
+    if (pfn >= buddy.max_pfn || order >= PMM_MAX_ORDER) {
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&buddy_lock);
+
+    struct page_frame* frame = &buddy.frames[pfn];
+    if (!(frame->flags & PAGE_FRAME_ALLOCATED) || (frame->flags & PAGE_FRAME_CACHED) ||
+        frame->order != order) {
+        spin_unlock_irqrestore(&buddy_lock, flags);
+        console_write("ERROR: Invalid or double free of physical page!\n");
+        return;
+    }
+
+    frame->flags = 0;
+    frame->count = 0;
+    buddy_free_block((uint32_t)pfn, order);
+
+    spin_unlock_irqrestore(&buddy_lock, flags);
+}
+
+// Turn an allocated block of 2^order pages into as many single pages, each
+// of which can then be freed on its own
+void pmm_split_pages(uint64_t physical_addr, uint32_t order) {
+    uint64_t pfn = physical_addr / PAGE_SIZE;
+    if ((physical_addr & (PAGE_SIZE - 1)) || order >= PMM_MAX_ORDER ||
+        pfn + (1ULL << order) > buddy.max_pfn) {
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&buddy_lock);
+    for (uint64_t i = 0; i < (1ULL << order); i++) {
+        buddy.frames[pfn + i].order = 0;
+        buddy.frames[pfn + i].flags = PAGE_FRAME_ALLOCATED;
+        buddy.frames[pfn + i].count = 0;
+    }
+    spin_unlock_irqrestore(&buddy_lock, flags);
+}
+
+// Pull up to count order-0 pages out of the buddy allocator under one lock hold
+static uint32_t buddy_alloc_batch(uint64_t* pages, uint32_t count) {
+    uint32_t got = 0;
+    uint64_t flags = spin_lock_irqsave(&buddy_lock);
+
+    while (got < count && buddy.nonempty_orders != 0) {
+        uint32_t order = __builtin_ctz(buddy.nonempty_orders);
+        uint32_t pfn = buddy.areas[order].head;
+        free_list_remove(pfn, order);
+
+        while (order > 0) {
+            order--;
+            free_list_push(pfn + (1U << order), order);
+        }
+
+        buddy.frames[pfn].order = 0;
+        buddy.frames[pfn].flags = PAGE_FRAME_ALLOCATED;
+        buddy.free_pages--;
+        pages[got++] = (uint64_t)pfn * PAGE_SIZE;
+    }
+
+    spin_unlock_irqrestore(&buddy_lock, flags);
+    return got;
+}
+
+// Return count order-0 pages to the buddy allocator under one lock hold
+static void buddy_free_batch(const uint64_t* pages, uint32_t count) {
+    uint64_t flags = spin_lock_irqsave(&buddy_lock);
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t pfn = pages[i] / PAGE_SIZE;
+        buddy.frames[pfn].flags = 0;
+        buddy_free_block(pfn, 0);
+    }
+
+    spin_unlock_irqrestore(&buddy_lock, flags);
+}
+
+// Take one page out of the zeroed pool (0 if it is empty)
+static uint64_t zero_pool_take(void) {
+    uint64_t page = 0;
+    uint64_t irq = spin_lock_irqsave(&zero_pool_lock);
+    if (zero_pool.count > 0) {
+        page = zero_pool.pages[--zero_pool.count];
+        buddy.frames[page / PAGE_SIZE].flags = PAGE_FRAME_ALLOCATED;
+    }
+    spin_unlock_irqrestore(&zero_pool_lock, irq);
+    return page;
+}
+
+// Give every page in the zeroed pool back to the buddy allocator, for
+// when memory runs short. Returns the number of pages released.
+static uint32_t zero_pool_drain(void) {
+    uint64_t pages[PCP_BATCH];
+    uint32_t total = 0;
+
+    for (;;) {
+        uint32_t count = 0;
+        uint64_t irq = spin_lock_irqsave(&zero_pool_lock);
+        while (count < PCP_BATCH && zero_pool.count > 0) {
+            pages[count++] = zero_pool.pages[--zero_pool.count];
+        }
+        spin_unlock_irqrestore(&zero_pool_lock, irq);
+
+        if (count == 0) {
+            return total;
+        }
+        buddy_free_batch(pages, count);
+        total += count;
+    }
+}
+
+// Allocate a single page, served from this CPU's magazine when possible.
+// Falls back to the zeroed pool once the buddy allocator is empty.
+void* pmm_alloc_page(void) {
+    if (buddy.frames == NULL) {
+        return NULL;
+    }
+
+    uint64_t flags = local_irq_save();
+    struct page_magazine* mag = &magazines[cpu_current_id()];
+
+    if (mag->count == 0) {
+        mag->count = buddy_alloc_batch(mag->pages, PCP_BATCH);
+        if (mag->count == 0) {
+            local_irq_restore(flags);
+            return (void*)zero_pool_take();
+        }
+    }
+
+    uint64_t page = mag->pages[--mag->count];
+    buddy.frames[page / PAGE_SIZE].flags = PAGE_FRAME_ALLOCATED;
+
+    local_irq_restore(flags);
+    return (void*)page;
+}
+
+// Clear a page with non-temporal stores so the zeroes bypass the cache;
+// the caller fences before publishing the page
+static void zero_page_nt(uint64_t physical_addr) {
+    uint64_t* p = (uint64_t*)phys_to_virt(physical_addr);
+    uint64_t* end = p + PAGE_SIZE / sizeof(uint64_t);
+
+    for (; p < end; p += 8) {
+        asm volatile("movnti %1, 0(%0)\n\t"
+                     "movnti %1, 8(%0)\n\t"
+                     "movnti %1, 16(%0)\n\t"
+                     "movnti %1, 24(%0)\n\t"
+                     "movnti %1, 32(%0)\n\t"
+                     "movnti %1, 40(%0)\n\t"
+                     "movnti %1, 48(%0)\n\t"
+                     "movnti %1, 56(%0)"
+                     : : "r"(p), "r"(0ULL) : "memory");
+    }
+}
+
+// Allocate a single page. With PMM_ALLOC_ZERO the page comes from the
+// pre-zeroed pool, falling back to clearing it here when the pool is empty.
+void* pmm_alloc_page_flags(uint32_t flags) {
+    if (!(flags & PMM_ALLOC_ZERO)) {
+        return pmm_alloc_page();
+    }
+
+    uint64_t page = zero_pool_take();
+    if (page != 0) {
+        return (void*)page;
+    }
+
+    void* fresh = pmm_alloc_page();
+    if (fresh != NULL) {
+        // The caller is about to write the page, so clear it through the cache
+        uint64_t* p = (uint64_t*)phys_to_virt((uint64_t)fresh);
+        for (uint32_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+            p[i] = 0;
+        }
+    }
+    return fresh;
+}
+
+// Zero up to max_pages free pages and add them to the pool.
+// Returns the number of pages added (0 once the pool is full).
+uint32_t pmm_zero_pool_refill(uint32_t max_pages) {
+    if (buddy.frames == NULL) {
+        return 0;
+    }
+
+    uint32_t added = 0;
+    while (added < max_pages) {
+        uint32_t want = max_pages - added;
+        if (want > PMM_ZERO_BATCH) {
+            want = PMM_ZERO_BATCH;
+        }
+
+        uint32_t room = PMM_ZERO_POOL_SIZE - __atomic_load_n(&zero_pool.count, __ATOMIC_RELAXED);
+        if (room == 0) {
+            break;
+        }
+        if (want > room) {
+            want = room;
+        }
+
+        // Take pages straight from the buddy allocator so the cache-warm
+        // magazine pages stay available for ordinary allocations
+        uint64_t pages[PMM_ZERO_BATCH];
+        uint32_t got = buddy_alloc_batch(pages, want);
+        if (got == 0) {
+            break;
+        }
+
+        for (uint32_t i = 0; i < got; i++) {
+            zero_page_nt(pages[i]);
+        }
+        asm volatile("sfence" : : : "memory");
+
+        uint32_t pushed = 0;
+        uint64_t irq = spin_lock_irqsave(&zero_pool_lock);
+        while (pushed < got && zero_pool.count < PMM_ZERO_POOL_SIZE) {
+            buddy.frames[pages[pushed] / PAGE_SIZE].flags = PAGE_FRAME_ALLOCATED | PAGE_FRAME_ZEROED;
+            zero_pool.pages[zero_pool.count++] = pages[pushed++];
+        }
+        spin_unlock_irqrestore(&zero_pool_lock, irq);
+
+        // Lost a race with another refill; give the surplus back
+        if (pushed < got) {
+            buddy_free_batch(pages + pushed, got - pushed);
+        }
+
+        added += pushed;
+        if (pushed < got) {
+            break;
+        }
+    }
+
+    return added;
+}
+
+// Number of pages currently waiting in the zeroed pool
+uint32_t pmm_zero_pool_count(void) {
+    return __atomic_load_n(&zero_pool.count, __ATOMIC_RELAXED);
+}
+
+// Idle-priority task that keeps the zeroed pool topped up
+void pmm_zero_task(void) {
+    while (1) {
+        if (pmm_zero_pool_refill(PMM_ZERO_BATCH) == 0) {
+            // Pool is full (or memory ran out); wait for an interrupt
+            asm volatile("hlt");
+        }
+        scheduler_yield();
+    }
+}
+
+// Free a single page into this CPU's magazine, draining a batch when full
+void pmm_free_page(uint64_t physical_addr) {
+    uint64_t pfn = physical_addr / PAGE_SIZE;
+    if ((physical_addr & (PAGE_SIZE - 1)) || pfn >= buddy.max_pfn) {
+        console_write("ERROR: Freeing invalid physical page!\n");
+        return;
+    }
+
+    struct page_frame* frame = &buddy.frames[pfn];
+    uint64_t flags = local_irq_save();
+
+    // Check the frame and mark it cached in one atomic step, so two CPUs
+    // freeing the same page cannot both get past the check
+    uint8_t state = __atomic_load_n(&frame->flags, __ATOMIC_RELAXED);
+    do {
+        if (!(state & PAGE_FRAME_ALLOCATED) ||
+            (state & (PAGE_FRAME_CACHED | PAGE_FRAME_ZEROED)) || frame->order != 0) {
+            local_irq_restore(flags);
+            console_write("ERROR: Invalid or double free of physical page!\n");
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&frame->flags, &state,
+                                          PAGE_FRAME_ALLOCATED | PAGE_FRAME_CACHED, 0,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    frame->count = 0;
+
+    struct page_magazine* mag = &magazines[cpu_current_id()];
+
+    if (mag->count == PCP_MAGAZINE_SIZE) {
+        // Give back the oldest pages; the newest are the cache-warm ones
+        buddy_free_batch(mag->pages, PCP_BATCH);
+        for (uint32_t i = PCP_BATCH; i < PCP_MAGAZINE_SIZE; i++) {
+            mag->pages[i - PCP_BATCH] = mag->pages[i];
+        }
+        mag->count -= PCP_BATCH;
+    }
+
+    mag->pages[mag->count++] = physical_addr;
+
+    local_irq_restore(flags);
+}
+
+// Return every page cached by a CPU to the buddy allocator
+void pmm_drain_cpu_cache(uint32_t cpu) {
+    if (cpu >= MAX_CPUS) {
+        return;
+    }
+
+    uint64_t flags = local_irq_save();
+    struct page_magazine* mag = &magazines[cpu];
+    buddy_free_batch(mag->pages, mag->count);
+    mag->count = 0;
+    local_irq_restore(flags);
+}
+
+// Number of free pages, including those cached in per-CPU magazines
+// and the zeroed pool
+uint64_t pmm_get_free_pages(void) {
+    uint64_t free_pages = buddy.free_pages + zero_pool.count;
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        free_pages += magazines[i].count;
+    }
+    return free_pages;
+}
+
+// Descriptor for a physical frame, or NULL if it is outside the frame array
+struct page_frame* pmm_get_frame(uint64_t physical_addr) {
+    uint64_t pfn = physical_addr / PAGE_SIZE;
+    if (buddy.frames == NULL || pfn >= buddy.max_pfn) {
+        return NULL;
+    }
+    return &buddy.frames[pfn];
+}
+
+// Take an extra reference to a page that is being shared copy-on-write
+void pmm_page_share(uint64_t physical_addr) {
+    struct page_frame* frame = pmm_get_frame(physical_addr);
+    if (frame) {
+        __atomic_fetch_add(&frame->count, 1, __ATOMIC_ACQ_REL);
+    }
+}
+
+// Number of other owners sharing a page (0 when the caller is the only one)
+uint32_t pmm_page_sharers(uint64_t physical_addr) {
+    struct page_frame* frame = pmm_get_frame(physical_addr);
+    return frame ? __atomic_load_n(&frame->count, __ATOMIC_ACQUIRE) : 0;
+}
+
+// Drop one reference to a page. Returns 1 when it was the last one and the
+// caller should free the frame.
+int pmm_page_unshare(uint64_t physical_addr) {
+    struct page_frame* frame = pmm_get_frame(physical_addr);
+    if (frame == NULL) {
+        return 1;
+    }
+
+    uint16_t count = __atomic_load_n(&frame->count, __ATOMIC_ACQUIRE);
+    while (count != 0) {
+        if (__atomic_compare_exchange_n(&frame->count, &count, count - 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// One past the highest physical frame number
+uint64_t pmm_get_max_pfn(void) {
+    return buddy.max_pfn;
+}
+
+// Reach the frame array through the direct map once it has been built,
+// and hand out the memory above the boot identity map from then on
+void pmm_use_direct_map(void) {
+    if (buddy.frames != NULL) {
+        buddy.frames = (struct page_frame*)phys_to_virt(frames_phys);
+        buddy_release_regions(PMM_BOOT_MAPPED_LIMIT, (uint64_t)buddy.max_pfn * PAGE_SIZE);
+    }
+}
+
+// Number of pages managed by the allocator
+uint64_t pmm_get_total_pages(void) {
+    return buddy.total_pages;
+}
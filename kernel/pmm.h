@@ -0,0 +1,102 @@
+// kernel/pmm.h
+#ifndef PMM_H
+#define PMM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Buddy allocator orders: order n is a block of 2^n contiguous pages
+#define PMM_MAX_ORDER 11            // Orders 0..10 (4KB .. 4MB blocks)
+
+// Everything below this physical address is left to the kernel image,
+// bootloader page tables and legacy BIOS areas
+#define PMM_RESERVED_LOW 0x200000
+
+// The boot page tables only identity-map the low 4GB. Frames above this are
+// handed to the allocator once the direct map makes them reachable.
+#define PMM_BOOT_MAPPED_LIMIT 0x100000000ULL
+
+// Highest physical address the allocator will manage: frame numbers are
+// 32-bit (just under 16TB), which also keeps every frame inside the direct map
+#define PMM_MAX_PHYS_ADDR ((uint64_t)PAGE_FRAME_NONE * PAGE_SIZE)
+
+// Page frame flags
+#define PAGE_FRAME_FREE     0x01    // Head of a block on a free list
+#define PAGE_FRAME_RESERVED 0x02    // Not managed by the allocator
+#define PAGE_FRAME_ALLOCATED 0x04   // Head of an allocated block
+#define PAGE_FRAME_CACHED   0x08    // Sitting in a per-CPU page magazine
+#define PAGE_FRAME_ZEROED   0x10    // Sitting in the pre-zeroed page pool
+
+#define PAGE_FRAME_NONE 0xFFFFFFFF  // Null frame index for free lists
+
+// Per-frame descriptor (12 bytes; free lists are linked by frame index)
+struct page_frame {
+    uint32_t next;
+    uint32_t prev;
+    uint8_t order;
+    uint8_t flags;
+    uint16_t count;                 // Live entries while the frame is a page table,
+                                    // extra copy-on-write owners otherwise
+};
+
+// Free list for a single order
+struct free_area {
+    uint32_t head;
+    uint32_t count;
+};
+
+// Buddy allocator state
+struct buddy_allocator {
+    struct page_frame* frames;      // Descriptor for every frame below max_pfn
+    uint32_t max_pfn;               // One past the highest managed frame
+    struct free_area areas[PMM_MAX_ORDER];
+    uint32_t nonempty_orders;       // Bit n set when areas[n] has a block
+    uint64_t total_pages;           // Pages handed to the allocator at init
+    uint64_t free_pages;            // Pages currently free
+};
+
+// Per-CPU page magazines in front of the buddy allocator
+#define PCP_MAGAZINE_SIZE 64        // Pages a CPU may hold
+#define PCP_BATCH 16                // Pages moved per refill/drain
+
+struct page_magazine {
+    uint32_t count;
+    uint64_t pages[PCP_MAGAZINE_SIZE];
+} __attribute__((aligned(64)));
+
+// Pool of pages cleared ahead of time by the idle zeroing task
+#define PMM_ZERO_POOL_SIZE 256      // Pages kept zeroed (1MB)
+#define PMM_ZERO_BATCH 8            // Pages zeroed per refill step
+
+struct zero_pool {
+    uint32_t count;
+    uint64_t pages[PMM_ZERO_POOL_SIZE];
+};
+
+// Allocation flags
+#define PMM_ALLOC_ZERO 0x01         // Page must be returned filled with zeroes
+
+// Function prototypes
+void pmm_buddy_init(void);
+void* pmm_alloc_pages(uint32_t order);
+void* pmm_alloc_pages_below(uint32_t order, uint64_t limit);
+void pmm_free_pages(uint64_t physical_addr, uint32_t order);
+void pmm_split_pages(uint64_t physical_addr, uint32_t order);
+uint64_t pmm_get_free_pages(void);
+uint64_t pmm_get_total_pages(void);
+uint32_t pmm_order_for_size(size_t size);
+void* pmm_alloc_page(void);
+void* pmm_alloc_page_flags(uint32_t flags);
+uint32_t pmm_zero_pool_refill(uint32_t max_pages);
+uint32_t pmm_zero_pool_count(void);
+void pmm_zero_task(void);
+void pmm_free_page(uint64_t physical_addr);
+void pmm_drain_cpu_cache(uint32_t cpu);
+struct page_frame* pmm_get_frame(uint64_t physical_addr);
+uint64_t pmm_get_max_pfn(void);
+void pmm_page_share(uint64_t physical_addr);
+uint32_t pmm_page_sharers(uint64_t physical_addr);
+int pmm_page_unshare(uint64_t physical_addr);
+void pmm_use_direct_map(void);
+
+#endif
@@ -2,139 +2,252 @@
 #include "drivers/console.h"
 #include "memory.h"
 #include "user_mode.h"
+#include "tlb.h"
+#include "pmm.h"
+#include "idr.h"
+#include "slab.h"
+#include "vmalloc.h"
+#include "syscall.h"
+#include "cpu.h"
+#include "spinlock.h"
 #include <stdint.h>
 
-// Global process array
-static struct process processes[MAX_PROCESSES];
-static uint32_t process_count = 0;
+// Process control blocks come from a slab cache and are found by PID
+// through pids. PID 0 is the kernel's own context.
+static struct kmem_cache* process_cache = NULL;
+static struct idr pids = IDR_INIT;
+static struct process boot_process;
 
-static pid_t current_pid = 0;
+// Process each CPU is running; NULL stands for the kernel's own context
+static struct process* current_processes[MAX_CPUS];
+
+// Processes that exited on their own CPU. Their kernel stack and address
+// space are only freed by the next process_alloc(), once that CPU is
+// known to have switched away from both.
+static struct process* dead_processes = NULL;
+static spinlock_t dead_lock = SPINLOCK_INIT;
+
+extern void syscall_return(struct registers* frame);
+
+// The top of every kernel stack holds the user registers: syscall_entry
+// saves them there, and a new process enters user mode from there
+static struct registers* process_user_frame(struct process* process) {
+    return (struct registers*)process->kernel_stack - 1;
+}
+
+// First code a process runs on its kernel stack: enter user mode with the
+// registers in process->context, as if returning from a system call
+static void process_start(void* arg) {
+    struct process* process = (struct process*)arg;
+    struct registers* frame = process_user_frame(process);
+    *frame = process->context;
+    syscall_return(frame);
+}
+
+// Build the kernel stack frame whose first switch runs process_start,
+// below the space reserved for the user frame
+static uint64_t process_init_kernel_stack(struct process* process) {
+    return context_init_stack((uint64_t)process_user_frame(process), process_start, process);
+}
+
+// Reserve PID 0 for the kernel's own context on first use
+static void process_setup(void) {
+    if (idr_find(&pids, 0) != NULL) {
+        return;
+    }
+    boot_process.pid = 0;
+    boot_process.state = PROCESS_TERMINATED;
+    if (idr_alloc(&pids, &boot_process) != 0) {
+        console_write("ERROR: PID 0 is not free for the kernel context\n");
+    }
+}
+
+// Give back a process control block and its PID
+static void process_free(struct process* process) {
+    idr_remove(&pids, process->pid);
+    kmem_cache_free(process_cache, process);
+}
+
+// Free an exited process's kernel stack and address space, then the
+// process itself
+static void process_destroy(struct process* process) {
+    if (process->kernel_stack != 0) {
+        vfree((void*)(process->kernel_stack - PROCESS_KERNEL_STACK_SIZE));
+    }
+    if (process->cr3 != 0) {
+        vmm_destroy_address_space(process->cr3);
+    } else {
+        unmap_and_free_pages(process->user_stack - PROCESS_USER_STACK_SIZE, PROCESS_USER_STACK_SIZE);
+    }
+    process_free(process);
+}
+
+// Free the processes on dead_processes; interrupts must be on, as
+// releasing stacks and address spaces may wait for other CPUs
+static void process_reap(void) {
+    uint64_t flags = spin_lock_irqsave(&dead_lock);
+    struct process* dead = dead_processes;
+    dead_processes = NULL;
+    spin_unlock_irqrestore(&dead_lock, flags);
+    
+    while (dead != NULL) {
+        struct process* next = dead->next_dead;
+        process_destroy(dead);
+        dead = next;
+    }
+}
+
+// Allocate a process control block with a fresh PID (NULL on failure)
+static struct process* process_alloc(void) {
+    process_setup();
+    process_reap();
+    
+    if (process_cache == NULL) {
+        process_cache = kmem_cache_create("process", sizeof(struct process), 0, NULL);
+        if (process_cache == NULL) {
+            return NULL;
+        }
+    }
+    
+    struct process* process = (struct process*)kmem_cache_alloc(process_cache);
+    if (process == NULL) {
+        return NULL;
+    }
+    int pid = idr_alloc(&pids, process);
+    if (pid < 0) {
+        kmem_cache_free(process_cache, process);
+        return NULL;
+    }
+    process->pid = pid;
+    process->kernel_stack = 0;
+    process->syscall_frame = NULL;
+    process->next_dead = NULL;
+    return process;
+}
+
+// Allocate a process's kernel stack; returns its top, or 0 on failure
+static uint64_t process_alloc_kernel_stack(void) {
+    void* stack = vmalloc(PROCESS_KERNEL_STACK_SIZE);
+    if (stack == NULL) {
+        return 0;
+    }
+    return (uint64_t)stack + PROCESS_KERNEL_STACK_SIZE;
+}
 
 // Initialize process management
 void process_init(void) {
     console_write("Initializing process management...\n");
     
-    // Initialize process array
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        processes[i].pid = 0;
-        processes[i].state = PROCESS_TERMINATED;
-    }
-    
-    process_count = 0;
-    current_pid = 0;
+    process_setup();
+    current_processes[cpu_current_id()] = NULL;
     
     console_write("Process management initialized.\n");
 }
 
 // Get current process
 struct process* process_get_current(void) {
-    return &processes[current_pid];
+    struct process* process = current_processes[cpu_current_id()];
+    return process ? process : &boot_process;
 }
 
 // Get process by PID
 struct process* process_get_by_pid(pid_t pid) {
-    if (pid >= MAX_PROCESSES) {
+    struct process* process = (struct process*)idr_find(&pids, pid);
+    if (process == NULL || process->state == PROCESS_TERMINATED) {
         return NULL;
     }
-    if (processes[pid].state == PROCESS_TERMINATED) {
-        return NULL;
-    }
-    return &processes[pid];
+    return process;
 }
 
 // Create a new process
 pid_t process_create(void (*entry_point)(void), const char* name) {
-    if (process_count >= MAX_PROCESSES) {
-        console_write("ERROR: Maximum number of processes reached!\n");
+    struct process* parent = process_get_current();
+    struct process* process = process_alloc();
+    if (process == NULL) {
+        console_write("ERROR: Out of memory or PIDs for a new process!\n");
         return 0;
     }
+    pid_t pid = process->pid;
     
-    // Find a free process slot
-    pid_t pid = 0;
-    for (int i = 1; i < MAX_PROCESSES; i++) {
-        if (processes[i].state == PROCESS_TERMINATED) {
-            pid = i;
-            break;
-        }
-    }
+    // Initialize process
+    process->state = PROCESS_READY;
+    process->entry_point = (uint64_t)entry_point;
+    process->parent_pid = parent->pid;
+    process->child_count = 0;
     
-    if (pid == 0) {
-        console_write("ERROR: No free process slots!\n");
+    // Own address space: shared kernel half, empty user half
+    process->cr3 = vmm_create_address_space();
+    if (process->cr3 == 0) {
+        console_write("ERROR: Failed to create address space!\n");
+        process_free(process);
         return 0;
     }
     
-    // Initialize process
-    processes[pid].pid = pid;
-    processes[pid].state = PROCESS_READY;
-    processes[pid].entry_point = (uint64_t)entry_point;
-    processes[pid].parent_pid = current_pid;
-    processes[pid].child_count = 0;
-    
     // Set process name
     int i;
     for (i = 0; i < 31 && name[i] != '\0'; i++) {
-        processes[pid].name[i] = name[i];
+        process->name[i] = name[i];
     }
-    processes[pid].name[i] = '\0';
-    
-    // Allocate kernel stack (8KB)
-    uint64_t kernel_stack_size = 8192;
-    processes[pid].kernel_stack = 0xFFFF800000000000 + (pid + 1) * 0x100000; // Allocate stack space
+    process->name[i] = '\0';
     
-    // Map kernel stack pages
-    for (uint64_t addr = processes[pid].kernel_stack - kernel_stack_size; 
-         addr < processes[pid].kernel_stack; addr += PAGE_SIZE) {
-        void* phys_page = alloc_physical_page();
-        if (phys_page != NULL) {
-            map_page(addr, (uint64_t)phys_page, 0x07); // Present, writable, kernel
-        }
+    // Kernel stack, from the shared kernel half so it is visible in every
+    // address space
+    process->kernel_stack = process_alloc_kernel_stack();
+    if (process->kernel_stack == 0) {
+        console_write("ERROR: Failed to allocate a kernel stack!\n");
+        vmm_destroy_address_space(process->cr3);
+        process_free(process);
+        return 0;
     }
     
-    // Allocate user stack (8KB)
-    uint64_t user_stack_size = 8192;
-    processes[pid].user_stack = 0x100000000 + pid * 0x100000; // User stack allocation
+    // User stack
+    process->user_stack = PROCESS_USER_STACK_TOP;
     
-    // Map user stack pages
-    for (uint64_t addr = processes[pid].user_stack - user_stack_size; 
-         addr < processes[pid].user_stack; addr += PAGE_SIZE) {
-        void* phys_page = alloc_physical_page();
+    // Map user stack pages into the process's own user half, which is not
+    // loaded on any CPU yet
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb);
+    for (uint64_t addr = process->user_stack - PROCESS_USER_STACK_SIZE; 
+         addr < process->user_stack; addr += PAGE_SIZE) {
+        void* phys_page = pmm_alloc_page_flags(PMM_ALLOC_ZERO);
         if (phys_page != NULL) {
-            map_page(addr, (uint64_t)phys_page, 0x07 | PAGE_USER); // Present, writable, user
+            map_page_in_batched(&tlb, process->cr3, addr, (uint64_t)phys_page,
+                                0x07 | PAGE_USER); // Present, writable, user
         }
     }
+    tlb_gather_commit(&tlb);
     
     // Set up initial context
     // Zero out registers
-    processes[pid].context.rax = 0;
-    processes[pid].context.rbx = 0;
-    processes[pid].context.rcx = 0;
-    processes[pid].context.rdx = 0;
-    processes[pid].context.rsi = 0;
-    processes[pid].context.rdi = 0;
-    processes[pid].context.rbp = 0;
-    processes[pid].context.r8 = 0;
-    processes[pid].context.r9 = 0;
-    processes[pid].context.r10 = 0;
-    processes[pid].context.r11 = 0;
-    processes[pid].context.r12 = 0;
-    processes[pid].context.r13 = 0;
-    processes[pid].context.r14 = 0;
-    processes[pid].context.r15 = 0;
+    process->context.rax = 0;
+    process->context.rbx = 0;
+    process->context.rcx = 0;
+    process->context.rdx = 0;
+    process->context.rsi = 0;
+    process->context.rdi = 0;
+    process->context.rbp = 0;
+    process->context.r8 = 0;
+    process->context.r9 = 0;
+    process->context.r10 = 0;
+    process->context.r11 = 0;
+    process->context.r12 = 0;
+    process->context.r13 = 0;
+    process->context.r14 = 0;
+    process->context.r15 = 0;
     
     // Set up initial register values for user mode entry
-    processes[pid].context.rip = (uint64_t)entry_point;
-    processes[pid].context.cs = USER_CODE_SEGMENT | RPL_USER;  // User code segment with RPL
-    processes[pid].context.rflags = 0x202;  // Interrupts enabled
-    processes[pid].context.rsp = processes[pid].user_stack;  // User stack pointer
-    processes[pid].context.ss = USER_DATA_SEGMENT | RPL_USER;  // User data segment with RPL
+    process->context.rip = (uint64_t)entry_point;
+    process->context.cs = USER_CODE_SEGMENT | RPL_USER;  // User code segment with RPL
+    process->context.rflags = 0x202;  // Interrupts enabled
+    process->context.rsp = process->user_stack;  // User stack pointer
+    process->context.ss = USER_DATA_SEGMENT | RPL_USER;  // User data segment with RPL
     
-    
-    // Increment process count
-    process_count++;
+    // The first switch to the process runs process_start on its kernel stack
+    process->kernel_rsp = process_init_kernel_stack(process);
     
     // Update parent's child count
-    if (current_pid != 0) {
-        processes[current_pid].child_count++;
+    if (parent != &boot_process) {
+        parent->child_count++;
     }
     
     console_write("Process created. PID: ");
@@ -146,30 +259,143 @@ pid_t process_create(void (*entry_point)(void), const char* name) {
     return pid;
 }
 
-// Exit a process
+// Fork the current process from inside a system call. The child gets its
+// own address space in which the parent's user pages are shared
+// copy-on-write, and returns to user mode from the same system call with
+// the parent's registers and a return value of 0.
+pid_t process_fork(void) {
+    struct process* parent = process_get_current();
+    if (parent->syscall_frame == NULL) {
+        console_write("ERROR: fork outside of a system call\n");
+        return 0;
+    }
+    
+    // The boot context (PID 0) runs in the kernel's page tables
+    uint64_t parent_cr3 = parent->cr3;
+    if (parent_cr3 == 0) {
+        parent_cr3 = vmm_current_cr3();
+    }
+    
+    struct process* child = process_alloc();
+    if (child == NULL) {
+        console_write("ERROR: Out of memory or PIDs for a new process!\n");
+        return 0;
+    }
+    pid_t pid = child->pid;
+    
+    uint64_t child_cr3 = vmm_fork_address_space(parent_cr3);
+    if (child_cr3 == 0) {
+        process_free(child);
+        return 0;
+    }
+    
+    *child = *parent;
+    child->pid = pid;
+    child->state = PROCESS_READY;
+    child->cr3 = child_cr3;
+    child->parent_pid = parent->pid;
+    child->child_count = 0;
+    child->context = *parent->syscall_frame;
+    child->context.rax = 0;
+    child->syscall_frame = NULL;
+    child->next_dead = NULL;
+    
+    // The kernel half is shared, so the child's kernel stack is visible
+    // from its address space too
+    child->kernel_stack = process_alloc_kernel_stack();
+    if (child->kernel_stack == 0) {
+        console_write("ERROR: Failed to allocate a kernel stack!\n");
+        vmm_destroy_address_space(child_cr3);
+        process_free(child);
+        return 0;
+    }
+    child->kernel_rsp = process_init_kernel_stack(child);
+    
+    parent->child_count++;
+    
+    return pid;
+}
+
+// Exit a process. A process running on this CPU (the caller of exit())
+// cannot free the kernel stack and address space it is still using: its
+// task ends here instead, and the scheduler passes the process to
+// process_release() once the CPU has switched away.
 void process_exit(pid_t pid) {
-    if (pid >= MAX_PROCESSES || processes[pid].state == PROCESS_TERMINATED) {
+    struct process* process = process_get_by_pid(pid);
+    if (process == NULL || process == &boot_process) {
         return;
     }
     
-    // Mark process as terminated
-    processes[pid].state = PROCESS_TERMINATED;
+    uint32_t self = cpu_current_id();
+    for (uint32_t cpu = 0; cpu < MAX_CPUS; cpu++) {
+        if (cpu != self && current_processes[cpu] == process) {
+            console_write("ERROR: Cannot end a process running on another CPU\n");
+            return;
+        }
+    }
     
-    // Decrement process count
-    process_count--;
+    // Terminated processes are no longer found by PID; the PID itself is
+    // given back with the process
+    process->state = PROCESS_TERMINATED;
     
     console_write("Process exited. PID: ");
     // Print PID (would need implementation)
     console_write("\n");
+    
+    if (current_processes[self] == process) {
+        scheduler_exit();
+    }
+    process_destroy(process);
 }
 
-// Switch between processes
+// Queue an exited process whose task is now off its CPU, so nothing runs
+// on its kernel stack or address space any more. Called by the scheduler
+// with interrupts off; the memory is freed later by process_reap().
+void process_release(struct process* process) {
+    if (process->state != PROCESS_TERMINATED) {
+        return;
+    }
+    uint64_t flags = spin_lock_irqsave(&dead_lock);
+    process->next_dead = dead_processes;
+    dead_processes = process;
+    spin_unlock_irqrestore(&dead_lock, flags);
+}
+
+// Make process the one this CPU runs (NULL: the kernel's own context).
+// The scheduler calls this, interrupts off, whenever it switches tasks.
+void process_activate(struct process* process) {
+    if (process == &boot_process) {
+        process = NULL;
+    }
+    current_processes[cpu_current_id()] = process;
+    if (process == NULL) {
+        process = &boot_process;
+    }
+    
+    // Enter the process's address space (0 means the kernel's own),
+    // unless this CPU already runs on it
+    uint64_t cr3 = process->cr3 ? process->cr3 : virt_to_phys(vmm.kernel_pml4);
+    if ((vmm_current_cr3() & PAGE_FRAME_MASK) != (cr3 & PAGE_FRAME_MASK)) {
+        vmm_switch_address_space(cr3);
+    }
+    
+    // System calls from the process save its registers on its own stack
+    if (process->kernel_stack != 0) {
+        syscall_set_kernel_stack(process->kernel_stack);
+    }
+}
+
+// Switch the running task from one process to another. The task keeps
+// the new process, so the scheduler restores its address space whenever
+// the task runs again.
 void process_switch(struct process* old_process, struct process* new_process) {
-    // Save current process state
-    current_pid = new_process->pid;
+    uint64_t flags = local_irq_save();
+    scheduler_get_current_task()->process = new_process;
+    process_activate(new_process);
     
     // Perform context switch
-    context_switch((struct task*)&old_process->context, (struct task*)&new_process->context);
+    context_switch(&old_process->kernel_rsp, new_process->kernel_rsp);
+    local_irq_restore(flags);
 }
 
 // Yield to next process
@@ -181,8 +407,5 @@ void process_yield(void) {
 
 // Sleep for specified ticks
 void process_sleep(uint32_t ticks) {
-    // For now, just call scheduler_sleep
-    // In a more complete implementation, this would interact with the scheduler
-    // scheduler_sleep(ticks);
-    (void)ticks; // Suppress unused parameter warning
+    scheduler_sleep(ticks);
 }
\ No newline at end of file
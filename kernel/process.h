@@ -14,8 +14,11 @@
 // Process ID type
 typedef uint32_t pid_t;
 
-// Maximum number of processes
-#define MAX_PROCESSES 64
+// Stack sizes. Every process has its own address space, so all user
+// stacks sit at the same address.
+#define PROCESS_KERNEL_STACK_SIZE 8192
+#define PROCESS_USER_STACK_SIZE   8192
+#define PROCESS_USER_STACK_TOP    0x100000000ULL
 
 // Process control block structure
 struct process {
@@ -23,8 +26,10 @@ struct process {
     uint32_t state;                 // Process state
     uint64_t cr3;                   // Page directory base address
     uint64_t user_stack;            // User stack pointer
-    uint64_t kernel_stack;          // Kernel stack pointer
-    struct registers context;       // Saved context for context switching
+    uint64_t kernel_stack;          // Top of the vmalloc'd kernel stack
+    uint64_t kernel_rsp;            // Saved kernel stack pointer while switched out
+    struct registers context;       // User-mode registers the process starts with
+    struct registers* syscall_frame; // Caller's registers while in a system call
     uint64_t entry_point;           // Entry point of the process
     uint64_t heap_start;            // Start of heap
     uint64_t heap_end;              // End of heap
@@ -32,14 +37,18 @@ struct process {
     char name[32];                  // Process name
     uint32_t parent_pid;            // Parent process ID
     uint32_t child_count;           // Number of child processes
+    struct process* next_dead;      // Link on the list of exited processes
 };
 
 // Function prototypes
 void process_init(void);
 pid_t process_create(void (*entry_point)(void), const char* name);
+pid_t process_fork(void);
 void process_exit(pid_t pid);
+void process_release(struct process* process);
 struct process* process_get_current(void);
 struct process* process_get_by_pid(pid_t pid);
+void process_activate(struct process* process);
 void process_switch(struct process* old_process, struct process* new_process);
 void process_yield(void);
 void process_sleep(uint32_t ticks);
@@ -0,0 +1,237 @@
+// kernel/rbtree.c
+#include "rbtree.h"
+#include <stdint.h>
+#include <stddef.h>
+
+static inline int rb_is_red(const struct rb_node* node) {
+    return node != NULL && node->color == RB_RED;
+}
+
+// Point whatever referenced old (its parent or the root) at new
+static void rb_replace_child(struct rb_node* old, struct rb_node* new, struct rb_node* parent,
+                             struct rb_root* root) {
+    if (parent == NULL) {
+        root->node = new;
+    } else if (parent->left == old) {
+        parent->left = new;
+    } else {
+        parent->right = new;
+    }
+}
+
+static void rb_rotate_left(struct rb_node* node, struct rb_root* root) {
+    struct rb_node* right = node->right;
+    struct rb_node* parent = node->parent;
+
+    node->right = right->left;
+    if (right->left) {
+        right->left->parent = node;
+    }
+    right->left = node;
+    right->parent = parent;
+    rb_replace_child(node, right, parent, root);
+    node->parent = right;
+}
+
+static void rb_rotate_right(struct rb_node* node, struct rb_root* root) {
+    struct rb_node* left = node->left;
+    struct rb_node* parent = node->parent;
+
+    node->left = left->right;
+    if (left->right) {
+        left->right->parent = node;
+    }
+    left->right = node;
+    left->parent = parent;
+    rb_replace_child(node, left, parent, root);
+    node->parent = left;
+}
+
+// Restore the red-black properties after rb_link_node() added a red leaf
+void rb_insert_color(struct rb_node* node, struct rb_root* root) {
+    struct rb_node* parent;
+
+    while ((parent = node->parent) != NULL && parent->color == RB_RED) {
+        // A red parent is never the root, so the grandparent exists
+        struct rb_node* gparent = parent->parent;
+
+        if (parent == gparent->left) {
+            struct rb_node* uncle = gparent->right;
+            if (rb_is_red(uncle)) {
+                // Push the grandparent's blackness down and continue above
+                uncle->color = RB_BLACK;
+                parent->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->right) {
+                rb_rotate_left(parent, root);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rb_rotate_right(gparent, root);
+        } else {
+            struct rb_node* uncle = gparent->left;
+            if (rb_is_red(uncle)) {
+                uncle->color = RB_BLACK;
+                parent->color = RB_BLACK;
+                gparent->color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->left) {
+                rb_rotate_right(parent, root);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->color = RB_BLACK;
+            gparent->color = RB_RED;
+            rb_rotate_left(gparent, root);
+        }
+    }
+
+    root->node->color = RB_BLACK;
+}
+
+// Rebalance after removing a black node; child (possibly NULL) took its
+// place under parent and is one black node short
+static void rb_erase_color(struct rb_node* child, struct rb_node* parent, struct rb_root* root) {
+    while (child != root->node && !rb_is_red(child)) {
+        if (child == parent->left) {
+            struct rb_node* sibling = parent->right;
+            if (rb_is_red(sibling)) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rb_rotate_left(parent, root);
+                sibling = parent->right;
+            }
+            if (!rb_is_red(sibling->left) && !rb_is_red(sibling->right)) {
+                sibling->color = RB_RED;
+                child = parent;
+                parent = child->parent;
+                continue;
+            }
+            if (!rb_is_red(sibling->right)) {
+                sibling->left->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rb_rotate_right(sibling, root);
+                sibling = parent->right;
+            }
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->right->color = RB_BLACK;
+            rb_rotate_left(parent, root);
+            child = root->node;
+        } else {
+            struct rb_node* sibling = parent->left;
+            if (rb_is_red(sibling)) {
+                sibling->color = RB_BLACK;
+                parent->color = RB_RED;
+                rb_rotate_right(parent, root);
+                sibling = parent->left;
+            }
+            if (!rb_is_red(sibling->left) && !rb_is_red(sibling->right)) {
+                sibling->color = RB_RED;
+                child = parent;
+                parent = child->parent;
+                continue;
+            }
+            if (!rb_is_red(sibling->left)) {
+                sibling->right->color = RB_BLACK;
+                sibling->color = RB_RED;
+                rb_rotate_left(sibling, root);
+                sibling = parent->left;
+            }
+            sibling->color = parent->color;
+            parent->color = RB_BLACK;
+            sibling->left->color = RB_BLACK;
+            rb_rotate_right(parent, root);
+            child = root->node;
+        }
+    }
+
+    if (child) {
+        child->color = RB_BLACK;
+    }
+}
+
+// Unlink a node and rebalance
+void rb_erase(struct rb_node* node, struct rb_root* root) {
+    struct rb_node* child;
+    struct rb_node* parent;
+    uint32_t color;
+
+    if (node->left && node->right) {
+        // Two children: the in-order successor takes the node's place
+        struct rb_node* next = node->right;
+        while (next->left) {
+            next = next->left;
+        }
+
+        child = next->right;
+        parent = next->parent;
+        color = next->color;
+
+        if (parent == node) {
+            parent = next;
+        } else {
+            if (child) {
+                child->parent = parent;
+            }
+            parent->left = child;
+            next->right = node->right;
+            node->right->parent = next;
+        }
+
+        next->parent = node->parent;
+        next->left = node->left;
+        next->color = node->color;
+        node->left->parent = next;
+        rb_replace_child(node, next, node->parent, root);
+    } else {
+        child = node->left ? node->left : node->right;
+        parent = node->parent;
+        color = node->color;
+
+        if (child) {
+            child->parent = parent;
+        }
+        rb_replace_child(node, child, parent, root);
+    }
+
+    if (color == RB_BLACK) {
+        rb_erase_color(child, parent, root);
+    }
+}
+
+// Leftmost (smallest) node, or NULL for an empty tree
+struct rb_node* rb_first(const struct rb_root* root) {
+    struct rb_node* node = root->node;
+    if (node == NULL) {
+        return NULL;
+    }
+    while (node->left) {
+        node = node->left;
+    }
+    return node;
+}
+
+// In-order successor, or NULL after the last node
+struct rb_node* rb_next(const struct rb_node* node) {
+    if (node->right) {
+        node = node->right;
+        while (node->left) {
+            node = node->left;
+        }
+        return (struct rb_node*)node;
+    }
+
+    struct rb_node* parent;
+    while ((parent = node->parent) != NULL && node == parent->right) {
+        node = parent;
+    }
+    return parent;
+}
@@ -0,0 +1,59 @@
+// kernel/rbtree.h
+#ifndef RBTREE_H
+#define RBTREE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Intrusive red-black tree. Nodes are embedded in the objects they order;
+// the caller walks down to find the insertion point (so it owns the
+// comparison), links the node there and then rebalances:
+//
+//     struct rb_node** link = &root->node;
+//     struct rb_node* parent = NULL;
+//     while (*link) {
+//         parent = *link;
+//         link = key < rb_entry(parent, T, member)->key ? &parent->left : &parent->right;
+//     }
+//     rb_link_node(&obj->member, parent, link);
+//     rb_insert_color(&obj->member, root);
+
+#define RB_RED   0
+#define RB_BLACK 1
+
+struct rb_node {
+    struct rb_node* parent;
+    struct rb_node* left;
+    struct rb_node* right;
+    uint32_t color;
+};
+
+struct rb_root {
+    struct rb_node* node;
+};
+
+#define RB_ROOT_INIT { NULL }
+
+// Object containing an embedded node
+#define rb_entry(ptr, type, member) \
+    ((type*)((char*)(ptr) - offsetof(type, member)))
+
+static inline void rb_link_node(struct rb_node* node, struct rb_node* parent, struct rb_node** link) {
+    node->parent = parent;
+    node->left = NULL;
+    node->right = NULL;
+    node->color = RB_RED;
+    *link = node;
+}
+
+static inline int rb_empty(const struct rb_root* root) {
+    return root->node == NULL;
+}
+
+// Function prototypes
+void rb_insert_color(struct rb_node* node, struct rb_root* root);
+void rb_erase(struct rb_node* node, struct rb_root* root);
+struct rb_node* rb_first(const struct rb_root* root);
+struct rb_node* rb_next(const struct rb_node* node);
+
+#endif
@@ -1,93 +1,897 @@
 // kernel/scheduler.c
 #include "scheduler.h"
 #include "drivers/console.h"
-#include "memory.h"
+#include "cpu.h"
+#include "fpu.h"
+#include "idr.h"
+#include "process.h"
+#include "rbtree.h"
+#include "slab.h"
+#include "spinlock.h"
+#include "timer.h"
+#include "vmalloc.h"
 #include <stdint.h>
 
-// Task array
-static struct task tasks[MAX_TASKS];
-static uint32_t task_count = 0;
-static uint32_t current_task = 0;
+// Task control blocks come from a slab cache and are found by ID through
+// task_ids. Exited tasks go on dead_tasks once they are off their CPU and
+// are reused, stack included, by later spawns.
+static struct kmem_cache* task_cache = NULL;
+static struct idr task_ids = IDR_INIT;
+static struct task boot_task;           // The BSP's boot context, task 0
+static struct task* dead_tasks = NULL;
+static uint32_t dead_count = 0;
+static spinlock_t tasks_lock = SPINLOCK_INIT;
+
+// Weight of each priority level in the fair class: every level gets 25%
+// more CPU than the one below it, TASK_PRIORITY_NORMAL is SCHED_WEIGHT_NORMAL.
+// Idle-priority tasks are not weighted; they only run when nothing else can.
+static const uint32_t priority_weights[TASK_PRIORITY_LEVELS] = {
+        0,    36,    45,    56,    70,    88,   110,   137,
+      172,   215,   268,   336,   419,   524,   655,   819,
+     1024,  1280,  1600,  2000,  2500,  3125,  3906,  4883,
+     6104,  7629,  9537, 11921, 14901, 18626, 23283, 29104,
+};
+
+// Ready tasks of one CPU. Deadline tasks sit in a red-black tree ordered
+// by absolute deadline and always run first. Fair tasks sit in a second
+// tree ordered by virtual runtime, so the one that has had the least of
+// its share runs next; idle-priority tasks wait in a FIFO behind them.
+// The running task is kept out of all three. Each queue has its own lock
+// and cache line, so CPUs only contend when one steals from or wakes a
+// task on another.
+struct run_queue {
+    spinlock_t lock;
+    struct rb_root dl;              // Queued deadline tasks by absolute deadline
+    struct task* dl_first;          // Leftmost task in `dl`
+    uint64_t dl_bw;                 // Bandwidth admitted to this CPU's deadline tasks
+    uint64_t dl_misses;             // Deadline misses of tasks on this CPU
+    struct rb_root fair;            // Queued fair tasks by vruntime
+    struct task* fair_first;        // Leftmost task in `fair`
+    uint64_t fair_weight;           // Sum of the queued fair tasks' weights
+    uint64_t min_vruntime;          // Monotonic floor of the queue's vruntimes
+    struct task* idle_head;         // Idle-priority FIFO
+    struct task* idle_tail;
+    volatile uint32_t nr_ready;     // Queued deadline and fair tasks
+    struct task* current;           // Task running on this CPU
+    struct task* idle;              // Runs when nothing else can; never queued
+    struct task* prev;              // Task switched away from, until it is off the CPU
+    uint64_t slice_end;             // Tick the running task's time slice ends
+    volatile int need_resched;      // A woken task should preempt current
+    uint64_t switches;
+} __attribute__((aligned(64)));
+
+static struct run_queue run_queues[MAX_CPUS];
+
+static inline struct run_queue* this_rq(void) {
+    return &run_queues[cpu_current_id()];
+}
+
+static inline int task_is_deadline(const struct task* task) {
+    return (task->flags & TASK_FLAG_DEADLINE) != 0;
+}
+
+static inline int task_is_fair(const struct task* task) {
+    return !task_is_deadline(task) && task->priority > TASK_PRIORITY_IDLE;
+}
+
+// Wrap-safe comparison of vruntimes and TSC timestamps
+static inline int vruntime_before(uint64_t a, uint64_t b) {
+    return (int64_t)(a - b) < 0;
+}
+
+// Order key of a queued task within its tree
+static inline uint64_t task_queue_key(const struct task* task) {
+    return task_is_deadline(task) ? task->dl.abs_deadline : task->vruntime;
+}
+
+// Virtual runtime to one tick of CPU time at normal weight, in TSC cycles
+static inline uint64_t vruntime_per_tick(void) {
+    return timer_tsc_per_tick();
+}
+
+// Raise min_vruntime to the smallest vruntime still competing on this
+// CPU, never lowering it (lock held)
+static void run_queue_update_min(struct run_queue* rq) {
+    struct task* curr = rq->current;
+    uint64_t vruntime = rq->min_vruntime;
+    int have = 0;
+
+    if (curr != NULL && task_is_fair(curr) && curr->state == TASK_RUNNING) {
+        vruntime = curr->vruntime;
+        have = 1;
+    }
+    if (rq->fair_first != NULL) {
+        if (!have || vruntime_before(rq->fair_first->vruntime, vruntime)) {
+            vruntime = rq->fair_first->vruntime;
+        }
+        have = 1;
+    }
+    if (have && vruntime_before(rq->min_vruntime, vruntime)) {
+        rq->min_vruntime = vruntime;
+    }
+}
+
+// Charge the running task for the CPU time since it was last accounted,
+// scaled by its weight (lock held)
+static void run_queue_update_curr(struct run_queue* rq) {
+    struct task* curr = rq->current;
+    if (curr == NULL) {
+        return;
+    }
+
+    uint64_t now = rdtsc();
+    uint64_t delta = now - curr->exec_start;
+    curr->exec_start = now;
+    curr->sum_exec += delta;
+
+    if (task_is_deadline(curr)) {
+        curr->dl.remaining -= (int64_t)delta;
+    } else if (task_is_fair(curr)) {
+        curr->vruntime += delta * SCHED_WEIGHT_NORMAL / priority_weights[curr->priority];
+        run_queue_update_min(rq);
+    }
+}
+
+// Queue a ready task (lock held)
+static void run_queue_push(struct run_queue* rq, struct task* task) {
+    task->next_ready = NULL;
+
+    if (!task_is_fair(task) && !task_is_deadline(task)) {
+        if (rq->idle_tail) {
+            rq->idle_tail->next_ready = task;
+        } else {
+            rq->idle_head = task;
+        }
+        rq->idle_tail = task;
+        return;
+    }
+
+    int deadline = task_is_deadline(task);
+    struct rb_root* root = deadline ? &rq->dl : &rq->fair;
+    uint64_t key = task_queue_key(task);
+    struct rb_node** link = &root->node;
+    struct rb_node* parent = NULL;
+    int leftmost = 1;
+    while (*link) {
+        parent = *link;
+        // Equal keys go right, so tasks with equal keys run in FIFO order
+        if (vruntime_before(key, task_queue_key(rb_entry(parent, struct task, run_node)))) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = 0;
+        }
+    }
+    rb_link_node(&task->run_node, parent, link);
+    rb_insert_color(&task->run_node, root);
+
+    if (deadline) {
+        if (leftmost) {
+            rq->dl_first = task;
+        }
+    } else {
+        if (leftmost) {
+            rq->fair_first = task;
+        }
+        rq->fair_weight += priority_weights[task->priority];
+    }
+    rq->nr_ready++;
+}
+
+// Take a queued deadline or fair task out of its tree (lock held)
+static void run_queue_remove(struct run_queue* rq, struct task* task) {
+    struct task** first = task_is_deadline(task) ? &rq->dl_first : &rq->fair_first;
+    if (*first == task) {
+        struct rb_node* next = rb_next(&task->run_node);
+        *first = next ? rb_entry(next, struct task, run_node) : NULL;
+    }
+    if (task_is_deadline(task)) {
+        rb_erase(&task->run_node, &rq->dl);
+    } else {
+        rb_erase(&task->run_node, &rq->fair);
+        rq->fair_weight -= priority_weights[task->priority];
+    }
+    rq->nr_ready--;
+}
+
+// Remove the task that should run next: the deadline task with the
+// earliest deadline, else the fair task with the smallest vruntime, else
+// the oldest idle-priority task (lock held)
+static struct task* run_queue_pop(struct run_queue* rq) {
+    struct task* task = rq->dl_first ? rq->dl_first : rq->fair_first;
+    if (task != NULL) {
+        run_queue_remove(rq, task);
+        return task;
+    }
+
+    task = rq->idle_head;
+    if (task != NULL) {
+        rq->idle_head = task->next_ready;
+        if (rq->idle_head == NULL) {
+            rq->idle_tail = NULL;
+        }
+        task->next_ready = NULL;
+    }
+    return task;
+}
+
+// Ticks a fair task may run before the leftmost queued task gets its
+// turn: its weighted share of the scheduling latency. A deadline task
+// runs until its budget is spent, rounded up to whole ticks.
+static uint64_t run_queue_slice(struct run_queue* rq, struct task* task) {
+    if (task_is_deadline(task)) {
+        uint64_t tick = vruntime_per_tick();
+        if (task->dl.remaining <= 0 || tick == 0) {
+            return 1;
+        }
+        return ((uint64_t)task->dl.remaining + tick - 1) / tick;
+    }
+    if (!task_is_fair(task)) {
+        return SCHED_LATENCY_TICKS;
+    }
+    uint64_t weight = priority_weights[task->priority];
+    uint64_t slice = SCHED_LATENCY_TICKS * weight / (rq->fair_weight + weight);
+    return slice < SCHED_MIN_GRANULARITY_TICKS ? SCHED_MIN_GRANULARITY_TICKS : slice;
+}
+
+// Place a task that is becoming ready on rq after sleeping or being
+// created. A sleeper keeps its own vruntime unless that has fallen far
+// behind, in which case it starts half a latency period before the queue
+// minimum: enough credit to run promptly after a short wait, as
+// interactive and I/O-bound tasks do, without banking a long sleep into
+// a monopoly of the CPU (lock held).
+//
+// A deadline task starts a new job with a fresh deadline and budget,
+// unless what is left of its current job still fits its bandwidth (the
+// constant bandwidth server rule), so waking early cannot be used to run
+// more than runtime/period.
+static void run_queue_place(struct run_queue* rq, struct task* task) {
+    if (task_is_deadline(task)) {
+        uint64_t now = rdtsc();
+        struct task_deadline* dl = &task->dl;
+        if (!vruntime_before(now, dl->abs_deadline) || dl->remaining <= 0 ||
+            ((uint64_t)dl->remaining << SCHED_DL_BW_SHIFT) / (dl->abs_deadline - now) > dl->bw) {
+            dl->abs_deadline = now + dl->deadline;
+            dl->remaining = (int64_t)dl->runtime;
+        }
+        return;
+    }
+    if (!task_is_fair(task)) {
+        return;
+    }
+    uint64_t credit = SCHED_LATENCY_TICKS * vruntime_per_tick() / 2;
+    uint64_t floor = rq->min_vruntime - credit;
+    if (vruntime_before(task->vruntime, floor)) {
+        task->vruntime = floor;
+    }
+}
+
+// Whether a task just queued on rq should take the CPU from its current
+// task right away (lock held)
+static int run_queue_should_preempt(struct run_queue* rq, struct task* task) {
+    struct task* curr = rq->current;
+    if (curr != NULL && task_is_deadline(curr)) {
+        return task_is_deadline(task) &&
+               vruntime_before(task->dl.abs_deadline, curr->dl.abs_deadline);
+    }
+    if (task_is_deadline(task)) {
+        return 1;
+    }
+    if (curr == NULL || !task_is_fair(curr)) {
+        return task_is_fair(task) || curr == NULL;
+    }
+    if (!task_is_fair(task)) {
+        return 0;
+    }
+
+    // Only preempt for a clear lead, so tasks do not ping-pong on every
+    // wake-up; heavier current tasks are given a proportionally smaller
+    // margin
+    run_queue_update_curr(rq);
+    uint64_t gran = vruntime_per_tick() * SCHED_WAKEUP_GRANULARITY / 100 *
+                    SCHED_WEIGHT_NORMAL / priority_weights[curr->priority];
+    return vruntime_before(task->vruntime + gran, curr->vruntime);
+}
+
+// Tasks that count towards a CPU's load: queued plus the running one,
+// ignoring idle-priority work
+static uint32_t run_queue_load(struct run_queue* rq) {
+    struct task* curr = rq->current;
+    return rq->nr_ready + (curr != NULL && (task_is_fair(curr) || task_is_deadline(curr)));
+}
+
+// Online CPU with the lowest load, for placing a new task
+static uint32_t scheduler_pick_cpu(void) {
+    uint32_t best = cpu_current_id();
+    uint32_t best_load = run_queue_load(&run_queues[best]);
+    uint32_t online = cpu_online_count();
+
+    for (uint32_t cpu = 0; cpu < online && best_load > 0; cpu++) {
+        uint32_t load = run_queue_load(&run_queues[cpu]);
+        if (load < best_load) {
+            best = cpu;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+// Pull one task from the CPU with the most queued work onto rq. Tasks
+// whose cache footprint has had time to go cold on the source CPU are
+// preferred, since moving them costs the least; a hot one is taken only
+// if there is nothing else. Deadline, idle-priority, pinned and
+// still-switching tasks never move. Called with interrupts off and no run
+// queue lock held.
+static void scheduler_steal(struct run_queue* rq) {
+    uint32_t self = rq - run_queues;
+    uint32_t online = cpu_online_count();
+    struct run_queue* busiest = NULL;
+    uint32_t most = 0;
+
+    for (uint32_t cpu = 0; cpu < online; cpu++) {
+        uint32_t ready = run_queues[cpu].nr_ready;
+        if (cpu != self && ready > most) {
+            busiest = &run_queues[cpu];
+            most = ready;
+        }
+    }
+    if (busiest == NULL) {
+        return;
+    }
+
+    uint64_t now = timer_now();
+    struct task* victim = NULL;
+
+    // Walk in vruntime order, so the fallback is the task owed the most
+    spin_lock(&busiest->lock);
+    for (struct rb_node* node = rb_first(&busiest->fair); node; node = rb_next(node)) {
+        struct task* task = rb_entry(node, struct task, run_node);
+        if ((task->flags & TASK_FLAG_PINNED) || task->on_cpu) {
+            continue;
+        }
+        if (now - task->last_ran >= SCHED_CACHE_HOT_TICKS) {
+            victim = task;
+            break;
+        }
+        if (victim == NULL) {
+            victim = task;
+        }
+    }
+    if (victim != NULL) {
+        run_queue_remove(busiest, victim);
+        // Carry the task's lag relative to its old queue over to the new one
+        victim->vruntime -= busiest->min_vruntime;
+        victim->cpu = self;
+    }
+    spin_unlock(&busiest->lock);
+
+    if (victim != NULL) {
+        spin_lock(&rq->lock);
+        victim->vruntime += rq->min_vruntime;
+        run_queue_push(rq, victim);
+        spin_unlock(&rq->lock);
+    }
+}
+
+// Called from this CPU's timer interrupt; returns whether it should
+// reschedule, either because the time slice ran out or a wake-up asked
+// for preemption
+int scheduler_tick(void) {
+    struct run_queue* rq = this_rq();
+    if (rq->current == NULL) {
+        return 0;
+    }
+    return rq->need_resched || timer_now() >= rq->slice_end;
+}
+
+// Tick this CPU's timer must fire on for the scheduler: the end of the
+// time slice if a queued task could take over then, otherwise never.
+// A task running alone, or only idle work, needs no timer at all, unless
+// it is a deadline task whose budget must be enforced.
+uint64_t scheduler_next_event(void) {
+    struct run_queue* rq = this_rq();
+    struct task* curr = rq->current;
+    if (curr == NULL) {
+        return TIMER_NEVER;
+    }
+    if (rq->need_resched) {
+        return timer_now();
+    }
+    
+    return rq->nr_ready || task_is_deadline(curr) ? rq->slice_end : TIMER_NEVER;
+}
+
+// A CPU's run queue gained a task. Its timer may be stopped, so make it
+// look again; and if that leaves it with work queued while another CPU
+// idles, wake the idle one to steal it.
+static void scheduler_notify(struct run_queue* rq) {
+    uint32_t target = rq - run_queues;
+    uint32_t self = cpu_current_id();
+    
+    if (target == self) {
+        timer_program_next();
+    } else {
+        timer_kick(target);
+    }
+    
+    if (rq->nr_ready == 0 || run_queue_load(rq) < 2) {
+        return;
+    }
+    uint32_t online = cpu_online_count();
+    for (uint32_t cpu = 0; cpu < online; cpu++) {
+        struct run_queue* other = &run_queues[cpu];
+        if (cpu != target && run_queue_load(other) == 0) {
+            if (cpu == self) {
+                other->need_resched = 1;
+                timer_program_next();
+            } else {
+                timer_kick(cpu);
+            }
+            break;
+        }
+    }
+}
+
+// Sleep timer callback: put the task back on its CPU's run queue
+static void scheduler_wake(void* arg) {
+    struct task* task = (struct task*)arg;
+    struct run_queue* rq = &run_queues[task->cpu];
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    
+    int woken = 0;
+    if (task->state == TASK_SLEEPING) {
+        task->state = TASK_READY;
+        run_queue_place(rq, task);
+        run_queue_push(rq, task);
+        // If the task has not even left its CPU yet, just make sure that
+        // CPU looks at its queue again
+        if (task == rq->current || run_queue_should_preempt(rq, task)) {
+            rq->need_resched = 1;
+        }
+        woken = 1;
+    }
+    
+    spin_unlock_irqrestore(&rq->lock, flags);
+    
+    if (woken) {
+        scheduler_notify(rq);
+    }
+}
 
 // Get current task
 struct task* scheduler_get_current_task(void) {
-    return &tasks[current_task];
+    return this_rq()->current;
+}
+
+// Task with the given ID, or NULL if there is none
+struct task* scheduler_find_task(uint32_t id) {
+    return (struct task*)idr_find(&task_ids, id);
+}
+
+// Context switches performed by a CPU so far
+uint64_t scheduler_switch_count(uint32_t cpu) {
+    return run_queues[cpu].switches;
+}
+
+// Deadline misses of the tasks on a CPU so far
+uint64_t scheduler_deadline_misses(uint32_t cpu) {
+    return run_queues[cpu].dl_misses;
+}
+
+// Convert microseconds to TSC cycles
+static uint64_t scheduler_us_to_tsc(uint64_t us) {
+    return us * timer_tsc_per_tick() * TIMER_FREQUENCY / 1000000;
+}
+
+// Move the running task into the deadline class with the given runtime,
+// relative deadline and period (microseconds), or back to the fair class
+// if runtime is 0. The task stays on its current CPU, which must have
+// room for its bandwidth next to the deadline tasks it already has.
+// Returns 0 on success, -1 if the parameters are invalid or the task
+// was not admitted.
+int scheduler_set_deadline(uint64_t runtime_us, uint64_t deadline_us, uint64_t period_us) {
+    if (runtime_us != 0 &&
+        (runtime_us > deadline_us || deadline_us > period_us || period_us > SCHED_DL_MAX_PERIOD_US)) {
+        return -1;
+    }
+    
+    uint64_t flags = local_irq_save();
+    struct run_queue* rq = this_rq();
+    struct task* current = rq->current;
+    if (current == NULL || (!task_is_fair(current) && !task_is_deadline(current))) {
+        local_irq_restore(flags);
+        return -1;
+    }
+    
+    spin_lock(&rq->lock);
+    run_queue_update_curr(rq);
+    
+    uint64_t old_bw = task_is_deadline(current) ? current->dl.bw : 0;
+    uint64_t bw = runtime_us ? (runtime_us << SCHED_DL_BW_SHIFT) / period_us : 0;
+    if (rq->dl_bw - old_bw + bw > SCHED_DL_BW_LIMIT) {
+        spin_unlock(&rq->lock);
+        local_irq_restore(flags);
+        return -1;
+    }
+    rq->dl_bw = rq->dl_bw - old_bw + bw;
+    
+    if (runtime_us == 0) {
+        if (task_is_deadline(current)) {
+            current->flags &= ~TASK_FLAG_DEADLINE;
+            current->vruntime = rq->min_vruntime;
+        }
+    } else {
+        struct task_deadline* dl = &current->dl;
+        if (!task_is_deadline(current)) {
+            dl->misses = 0;
+            dl->overruns = 0;
+        }
+        dl->runtime = scheduler_us_to_tsc(runtime_us);
+        dl->deadline = scheduler_us_to_tsc(deadline_us);
+        dl->period = scheduler_us_to_tsc(period_us);
+        dl->bw = bw;
+        // The first job is released now
+        dl->abs_deadline = rdtsc() + dl->deadline;
+        dl->remaining = (int64_t)dl->runtime;
+        current->flags |= TASK_FLAG_DEADLINE;
+    }
+    spin_unlock(&rq->lock);
+    
+    // Let the dispatcher rank the task in its new class
+    scheduler_schedule();
+    local_irq_restore(flags);
+    return 0;
+}
+
+// Deadline-miss counters of the running task; returns -1 if it is not in
+// the deadline class
+int scheduler_get_deadline_stats(struct sched_deadline_stats* stats) {
+    struct task* current = scheduler_get_current_task();
+    if (current == NULL || !task_is_deadline(current) || stats == NULL) {
+        return -1;
+    }
+    stats->misses = current->dl.misses;
+    stats->overruns = current->dl.overruns;
+    return 0;
+}
+
+// Clear the previous task's on-CPU mark once its registers are saved and
+// we are running on another stack; until then no other CPU may pick it up.
+// A task that exited is now done with its stack and can be recycled.
+static void scheduler_finish_switch(void) {
+    struct run_queue* rq = this_rq();
+    struct task* prev = rq->prev;
+    if (prev == NULL) {
+        return;
+    }
+    rq->prev = NULL;
+    __atomic_store_n(&prev->on_cpu, 0, __ATOMIC_RELEASE);
+    
+    if (prev->state == TASK_ZOMBIE) {
+        // So is a process that exited on this task
+        if (prev->process != NULL) {
+            process_release(prev->process);
+            prev->process = NULL;
+        }
+        
+        spin_lock(&tasks_lock);
+        prev->next_ready = dead_tasks;
+        dead_tasks = prev;
+        dead_count++;
+        spin_unlock(&tasks_lock);
+    }
+}
+
+// First code a new task runs, with interrupts still off from the switch
+static void scheduler_task_start(void* arg) {
+    struct task* task = (struct task*)arg;
+    scheduler_finish_switch();
+    asm volatile("sti");
+    task->entry();
+    scheduler_exit();
+}
+
+// Build the frame context_switch() pops on a fresh stack so that the
+// first switch to it calls fn(arg) through context_first_run; returns the
+// stack pointer to switch to. fn must never return.
+uint64_t context_init_stack(uint64_t stack_top, void (*fn)(void*), void* arg) {
+    uint64_t* sp = (uint64_t*)(stack_top & ~0xFULL);
+    
+    *--sp = (uint64_t)context_first_run;    // Return address
+    *--sp = 0;                              // rbp
+    *--sp = (uint64_t)fn;                   // rbx
+    *--sp = (uint64_t)arg;                  // r12
+    *--sp = 0;                              // r13
+    *--sp = 0;                              // r14
+    *--sp = 0;                              // r15
+    return (uint64_t)sp;
+}
+
+// Give a task a stack whose first switch enters scheduler_task_start;
+// a recycled task keeps the stack of its last life. Returns -1 when out
+// of memory.
+static int task_init_stack(struct task* task) {
+    if (task->stack == NULL) {
+        task->stack = vmalloc(SCHED_STACK_SIZE);
+        if (task->stack == NULL) {
+            return -1;
+        }
+    }
+    task->rsp = context_init_stack((uint64_t)task->stack + SCHED_STACK_SIZE,
+                                   scheduler_task_start, task);
+    return 0;
+}
+
+// Release everything an exited task owns
+static void task_free(struct task* task) {
+    fpu_task_release(task);
+    idr_remove(&task_ids, task->id);
+    vfree(task->stack);
+    kmem_cache_free(task_cache, task);
+}
+
+// Set up a task control block with an ID; the task starts out BLOCKED
+static void task_setup(struct task* task, uint32_t id) {
+    task->id = id;
+    task->state = TASK_BLOCKED;
+    task->on_cpu = 0;
+    task->flags = 0;
+    task->stack = NULL;
+    task->process = NULL;
+    task->fpu = NULL;
+    task->fpu_cpu = FPU_CPU_NONE;
+    task->next_ready = NULL;
+    timer_setup(&task->sleep_timer, scheduler_wake, task);
+}
+
+// Get a task control block, preferably an exited task's, whose ID and
+// stack are kept. Dead tasks beyond SCHED_DEAD_CACHE are freed here,
+// where interrupts are on and freeing stacks is safe. Returns NULL when
+// out of memory or IDs.
+static struct task* task_alloc(void) {
+    struct task* surplus = NULL;
+    uint64_t flags = spin_lock_irqsave(&tasks_lock);
+    
+    struct task* task = dead_tasks;
+    if (task != NULL) {
+        dead_tasks = task->next_ready;
+        dead_count--;
+    }
+    while (dead_count > SCHED_DEAD_CACHE) {
+        struct task* dead = dead_tasks;
+        dead_tasks = dead->next_ready;
+        dead_count--;
+        dead->next_ready = surplus;
+        surplus = dead;
+    }
+    
+    spin_unlock_irqrestore(&tasks_lock, flags);
+    
+    while (surplus != NULL) {
+        struct task* next = surplus->next_ready;
+        task_free(surplus);
+        surplus = next;
+    }
+    
+    if (task != NULL) {
+        // Whatever the last task left in its FPU state is not ours
+        fpu_task_release(task);
+        task->state = TASK_BLOCKED;
+        task->flags = 0;
+        task->process = NULL;
+        task->next_ready = NULL;
+        return task;
+    }
+    
+    if (task_cache == NULL) {
+        task_cache = kmem_cache_create("task", sizeof(struct task), CACHE_LINE_SIZE, NULL);
+        if (task_cache == NULL) {
+            return NULL;
+        }
+    }
+    task = (struct task*)kmem_cache_alloc(task_cache);
+    if (task == NULL) {
+        return NULL;
+    }
+    int id = idr_alloc(&task_ids, task);
+    if (id < 0) {
+        kmem_cache_free(task_cache, task);
+        return NULL;
+    }
+    task_setup(task, id);
+    return task;
+}
+
+static void run_queue_init(struct run_queue* rq) {
+    spin_lock_init(&rq->lock);
+    rq->dl.node = NULL;
+    rq->dl_first = NULL;
+    rq->dl_bw = 0;
+    rq->dl_misses = 0;
+    rq->fair.node = NULL;
+    rq->fair_first = NULL;
+    rq->fair_weight = 0;
+    rq->min_vruntime = 0;
+    rq->idle_head = NULL;
+    rq->idle_tail = NULL;
+    rq->nr_ready = 0;
+    rq->current = NULL;
+    rq->idle = NULL;
+    rq->prev = NULL;
+    rq->slice_end = 0;
+    rq->need_resched = 0;
+    rq->switches = 0;
 }
 
 // Initialize scheduler
 void scheduler_init(void) {
     console_write("Initializing scheduler...\n");
     
-    // Initialize task array
-    for (int i = 0; i < MAX_TASKS; i++) {
-        tasks[i].id = 0;
-        tasks[i].state = TASK_ZOMBIE;
+    for (int i = 0; i < MAX_CPUS; i++) {
+        run_queue_init(&run_queues[i]);
     }
     
-    task_count = 0;
-    current_task = 0;
+    // Task 0 is the boot context; its registers are filled in by the
+    // first context switch away from it
+    int id = idr_alloc(&task_ids, &boot_task);
+    if (id < 0) {
+        console_write("ERROR: No task ID for the boot context\n");
+        return;
+    }
+    task_setup(&boot_task, id);
+    boot_task.state = TASK_RUNNING;
+    boot_task.priority = TASK_PRIORITY_NORMAL;
+    boot_task.ticks = 0;
+    boot_task.cpu = 0;
+    boot_task.flags = TASK_FLAG_PINNED;
+    boot_task.on_cpu = 1;
+    boot_task.last_ran = 0;
+    boot_task.vruntime = 0;
+    boot_task.exec_start = rdtsc();
+    boot_task.sum_exec = 0;
+    run_queues[0].current = &boot_task;
+    
+    // The boot context is the kernel's main thread, not an idle loop, so
+    // the BSP gets an idle task of its own for when everything else sleeps
+    struct task* idle = task_alloc();
+    if (idle == NULL || task_init_stack(idle) < 0) {
+        console_write("ERROR: No idle task for the boot CPU\n");
+        return;
+    }
+    idle->priority = TASK_PRIORITY_IDLE;
+    idle->ticks = 0;
+    idle->entry = scheduler_idle;
+    idle->cpu = 0;
+    idle->flags = TASK_FLAG_PINNED;
+    idle->last_ran = 0;
+    idle->vruntime = 0;
+    idle->sum_exec = 0;
+    idle->state = TASK_READY;
+    run_queues[0].idle = idle;
     
     console_write("Scheduler initialized.\n");
 }
 
+// Idle loop: run whatever becomes ready, halting with interrupts on in
+// between. A wake-up or steal request arrives as an interrupt, whose
+// handler reschedules.
+void scheduler_idle(void) {
+    for (;;) {
+        cpu_poll_calls();
+        scheduler_schedule();
+        asm volatile("sti; hlt");
+    }
+}
+
+// Adopt the calling application processor's boot context as its idle
+// task, so the CPU can take part in scheduling; the caller then enters
+// scheduler_idle()
+void scheduler_init_cpu(void) {
+    struct run_queue* rq = this_rq();
+    struct task* task = task_alloc();
+    if (task == NULL) {
+        console_write("ERROR: No task for a CPU's idle context\n");
+        return;
+    }
+    
+    task->priority = TASK_PRIORITY_IDLE;
+    task->ticks = 0;
+    task->cpu = rq - run_queues;
+    task->flags = TASK_FLAG_PINNED;
+    task->on_cpu = 1;
+    task->last_ran = timer_now();
+    task->vruntime = 0;
+    task->exec_start = rdtsc();
+    task->sum_exec = 0;
+    task->state = TASK_RUNNING;
+    rq->current = task;
+    rq->idle = task;
+}
+
 // Add a new task
 void scheduler_add_task(void (*entry_point)(void)) {
-    if (task_count >= MAX_TASKS) {
-        console_write("ERROR: Maximum number of tasks reached!\n");
-        return;
+    scheduler_add_task_priority(entry_point, TASK_PRIORITY_NORMAL);
+}
+
+// Add a new task with the given priority on the least-loaded CPU
+void scheduler_add_task_priority(void (*entry_point)(void), uint32_t priority) {
+    scheduler_spawn(entry_point, priority, -1);
+}
+
+// Create a task and queue it. With cpu < 0 it goes to the least-loaded
+// CPU and may later migrate; otherwise it is pinned to that CPU.
+// Returns the task id, or -1 on failure.
+int scheduler_spawn(void (*entry_point)(void), uint32_t priority, int cpu) {
+    if (cpu >= (int)cpu_online_count()) {
+        console_write("ERROR: Task pinned to a CPU that is not online\n");
+        return -1;
+    }
+    if (priority >= TASK_PRIORITY_LEVELS) {
+        priority = TASK_PRIORITY_LEVELS - 1;
     }
     
-    // Find a free task slot
-    uint32_t task_id = task_count;
+    struct task* task = task_alloc();
+    if (task == NULL) {
+        console_write("ERROR: Out of memory or IDs for a new task\n");
+        return -1;
+    }
+    uint32_t task_id = task->id;
     
     // Initialize task
-    tasks[task_id].id = task_id;
-    tasks[task_id].state = TASK_READY;
-    tasks[task_id].priority = 1;
-    tasks[task_id].ticks = 0;
-    tasks[task_id].sleep_ticks = 0;
-    
-    // Set up initial registers
-    tasks[task_id].rip = (uint64_t)entry_point;
-    tasks[task_id].cs = 0x08;  // Kernel code segment
-    tasks[task_id].rflags = 0x202;  // Interrupts enabled
-    tasks[task_id].rsp = 0xFFFF800000000000 + (task_id + 1) * 0x10000;  // Allocate stack space
-    tasks[task_id].ss = 0x10;  // Kernel data segment
-    
-    // Zero out other registers
-    tasks[task_id].rax = 0;
-    tasks[task_id].rbx = 0;
-    tasks[task_id].rcx = 0;
-    tasks[task_id].rdx = 0;
-    tasks[task_id].rsi = 0;
-    tasks[task_id].rdi = 0;
-    tasks[task_id].rbp = 0;
-    tasks[task_id].r8 = 0;
-    tasks[task_id].r9 = 0;
-    tasks[task_id].r10 = 0;
-    tasks[task_id].r11 = 0;
-    tasks[task_id].r12 = 0;
-    tasks[task_id].r13 = 0;
-    tasks[task_id].r14 = 0;
-    tasks[task_id].r15 = 0;
-    tasks[task_id].ds = 0x10;
-    tasks[task_id].es = 0x10;
-    tasks[task_id].fs = 0x10;
-    tasks[task_id].gs = 0x10;
-    
-    // Map stack pages
-    for (uint64_t addr = tasks[task_id].rsp - 0x10000; addr < tasks[task_id].rsp; addr += 0x1000) {
-        void* phys_page = alloc_physical_page();
-        if (phys_page != NULL) {
-            map_page(addr, (uint64_t)phys_page, 0x07);  // Present, writable, kernel
-        }
-    }
-    
-    task_count++;
-    
-    console_write("Task added. Task count: ");
-    // Print task count (simplified)
-    console_write("\n");
+    task->priority = priority;
+    task->ticks = 0;
+    task->entry = entry_point;
+    task->flags = cpu >= 0 ? TASK_FLAG_PINNED : 0;
+    task->last_ran = 0;
+    task->sum_exec = 0;
+    
+    // The first switch to the task lands in scheduler_task_start, which
+    // calls entry_point
+    if (task_init_stack(task) < 0) {
+        console_write("ERROR: Out of memory for a task stack\n");
+        task_free(task);
+        return -1;
+    }
+    
+    task->cpu = cpu >= 0 ? (uint32_t)cpu : scheduler_pick_cpu();
+    struct run_queue* rq = &run_queues[task->cpu];
+    
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    // New tasks start level with the queue, owed nothing
+    task->vruntime = rq->min_vruntime;
+    task->state = TASK_READY;
+    run_queue_push(rq, task);
+    if (run_queue_should_preempt(rq, task)) {
+        rq->need_resched = 1;
+    }
+    spin_unlock_irqrestore(&rq->lock, flags);
+    
+    scheduler_notify(rq);
+    return task_id;
+}
+
+// End the running task; it is recycled once it is off the CPU
+void scheduler_exit(void) {
+    struct run_queue* rq = this_rq();
+    local_irq_save();
+    
+    spin_lock(&rq->lock);
+    // Give back any bandwidth the task reserved
+    if (task_is_deadline(rq->current)) {
+        rq->dl_bw -= rq->current->dl.bw;
+        rq->current->flags &= ~TASK_FLAG_DEADLINE;
+    }
+    rq->current->state = TASK_ZOMBIE;
+    spin_unlock(&rq->lock);
+    
+    scheduler_schedule();
+    
+    // Not reached: a zombie is never queued again, and the idle task is
+    // always there to switch to
+    console_write("ERROR: Exited task resumed\n");
+    for (;;) {
+        asm volatile("sti; hlt");
+    }
 }
 
 // Yield to next task
@@ -95,39 +899,155 @@ void scheduler_yield(void) {
     scheduler_schedule();
 }
 
-// Sleep for specified ticks
+// Change the priority (and so the fair-share weight) of the running task
+void scheduler_set_priority(uint32_t priority) {
+    struct run_queue* rq;
+    uint64_t flags = local_irq_save();
+    rq = this_rq();
+    struct task* current = rq->current;
+    if (current == NULL) {
+        local_irq_restore(flags);
+        return;
+    }
+    
+    if (priority >= TASK_PRIORITY_LEVELS) {
+        priority = TASK_PRIORITY_LEVELS - 1;
+    }
+    
+    // Time run so far is charged at the old weight
+    spin_lock(&rq->lock);
+    run_queue_update_curr(rq);
+    if (!task_is_fair(current) && priority > TASK_PRIORITY_IDLE) {
+        current->vruntime = rq->min_vruntime;
+    }
+    current->priority = priority;
+    spin_unlock(&rq->lock);
+    
+    local_irq_restore(flags);
+}
+
+// Sleep for specified ticks; the task is woken on the tick it is due
 void scheduler_sleep(uint32_t ticks) {
-    if (task_count == 0) return;
+    if (ticks == 0) {
+        scheduler_yield();
+        return;
+    }
     
-    tasks[current_task].state = TASK_SLEEPING;
-    tasks[current_task].sleep_ticks = ticks;
+    // Interrupts stay off until the switch so the timer cannot wake the
+    // task before it has left the CPU; the state changes under the run
+    // queue lock the wake-up takes, which may run on another CPU
+    uint64_t flags = local_irq_save();
+    struct run_queue* rq = this_rq();
+    struct task* current = rq->current;
+    spin_lock(&rq->lock);
+    current->state = TASK_SLEEPING;
+    spin_unlock(&rq->lock);
+    timer_add(&current->sleep_timer, ticks);
     scheduler_schedule();
+    local_irq_restore(flags);
 }
 
-// Schedule next task
+// Schedule next task on this CPU
 void scheduler_schedule(void) {
-    if (task_count <= 1) return;
+    uint64_t flags = local_irq_save();
+    struct run_queue* rq = this_rq();
+    struct task* old = rq->current;
+    if (old == NULL) {
+        local_irq_restore(flags);
+        return;
+    }
     
-    // Update current task
-    uint32_t old_task = current_task;
+    spin_lock(&rq->lock);
+    rq->need_resched = 0;
     
-    // Find next task
-    do {
-        current_task = (current_task + 1) % task_count;
-        
-        // Handle sleeping tasks
-        if (tasks[current_task].state == TASK_SLEEPING) {
-            if (tasks[current_task].sleep_ticks > 0) {
-                tasks[current_task].sleep_ticks--;
-            }
-            if (tasks[current_task].sleep_ticks == 0) {
-                tasks[current_task].state = TASK_READY;
+    // A wake-up that beat us here has already queued the caller; take it
+    // out again, since charging it changes its position
+    int requeue = old->state == TASK_RUNNING && old != rq->idle;
+    if (old->state == TASK_READY && (task_is_fair(old) || task_is_deadline(old))) {
+        run_queue_remove(rq, old);
+        requeue = 1;
+    }
+    run_queue_update_curr(rq);
+    
+    // A deadline task that used up its budget waits for its next period;
+    // one that blocks has finished its job, possibly too late
+    uint64_t throttle_ticks = 0;
+    if (task_is_deadline(old)) {
+        struct task_deadline* dl = &old->dl;
+        if (requeue && dl->remaining <= 0) {
+            uint64_t now = rdtsc();
+            uint64_t release = dl->abs_deadline - dl->deadline + dl->period;
+            uint64_t tick = vruntime_per_tick();
+            throttle_ticks = 1;
+            if (vruntime_before(now, release) && tick != 0) {
+                throttle_ticks = (release - now + tick - 1) / tick;
             }
+            dl->overruns++;
+            old->state = TASK_SLEEPING;
+            requeue = 0;
+        } else if (old->state == TASK_SLEEPING && vruntime_before(dl->abs_deadline, rdtsc())) {
+            dl->misses++;
+            rq->dl_misses++;
         }
-    } while (tasks[current_task].state != TASK_READY && current_task != old_task);
+    }
+    
+    // A task that is still runnable competes on its new vruntime (or goes
+    // to the back of the idle FIFO)
+    if (requeue) {
+        old->state = TASK_READY;
+        run_queue_push(rq, old);
+    }
+    
+    // Only idle work left here: try to pull some from a busier CPU
+    if (rq->dl_first == NULL && rq->fair_first == NULL && cpu_online_count() > 1) {
+        spin_unlock(&rq->lock);
+        scheduler_steal(rq);
+        spin_lock(&rq->lock);
+    }
     
-    // If we're switching to a different task, perform context switch
-    if (current_task != old_task) {
-        context_switch(&tasks[old_task], &tasks[current_task]);
+    // With nothing runnable, not even the caller, the CPU idles; a
+    // sleeping or exited caller is never resumed early
+    struct task* next = run_queue_pop(rq);
+    if (next == NULL) {
+        next = rq->idle;
+    }
+    if (next == NULL) {
+        // Only before the idle task exists: nothing to switch to
+        next = old;
     }
-}
\ No newline at end of file
+    if (old == rq->idle && next != old) {
+        old->state = TASK_READY;
+    }
+    next->state = TASK_RUNNING;
+    next->cpu = rq - run_queues;
+    next->exec_start = rdtsc();
+    rq->current = next;
+    rq->slice_end = timer_now() + run_queue_slice(rq, next);
+    old->last_ran = timer_now();
+    
+    if (next != old) {
+        next->on_cpu = 1;
+        rq->prev = old;
+        rq->switches++;
+    }
+    spin_unlock(&rq->lock);
+    
+    // The sleep timer doubles as the replenishment timer; its wake-up
+    // releases the next job
+    if (throttle_ticks != 0) {
+        timer_add(&old->sleep_timer, throttle_ticks);
+    }
+    
+    // Arm the timer for the new slice, or stop it if nothing competes
+    timer_program_next();
+    
+    // If we're switching to a different task, perform context switch. The
+    // next task runs in its process's address space, or the kernel's.
+    if (next != old) {
+        fpu_switch_out(old);
+        process_activate(next->process);
+        context_switch(&old->rsp, next->rsp);
+        scheduler_finish_switch();
+    }
+    local_irq_restore(flags);
+}
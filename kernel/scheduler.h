@@ -3,6 +3,8 @@
 #define SCHEDULER_H
 
 #include <stdint.h>
+#include "timer.h"
+#include "rbtree.h"
 
 // Task states
 #define TASK_RUNNING  0
@@ -11,36 +13,121 @@
 #define TASK_SLEEPING 3
 #define TASK_ZOMBIE   4
 
-// Maximum number of tasks
-#define MAX_TASKS 64
+// Task priorities. Deadline-class tasks (scheduler_set_deadline) run
+// ahead of all of these, earliest deadline first. Levels above idle
+// share the CPU in proportion to a weight that grows 25% per level (the
+// fair class); idle-priority tasks run only when no other task is ready.
+#define TASK_PRIORITY_LEVELS 32
+#define TASK_PRIORITY_IDLE   0      // Runs only when no other task is ready
+#define TASK_PRIORITY_NORMAL 16
+#define TASK_PRIORITY_MAX    (TASK_PRIORITY_LEVELS - 1)
+
+// Kernel stack of each spawned task
+#define SCHED_STACK_SIZE 16384
+
+// Exited tasks kept, stack included, for reuse by the next spawn
+#define SCHED_DEAD_CACHE 64
+
+// Fair class tuning. Every ready task should get a turn within
+// SCHED_LATENCY_TICKS, each slice being the task's weighted share of it
+// but no shorter than SCHED_MIN_GRANULARITY_TICKS. A woken task preempts
+// only when it is behind by more than SCHED_WAKEUP_GRANULARITY percent of
+// a tick (scaled by the running task's weight).
+#define SCHED_LATENCY_TICKS          4
+#define SCHED_MIN_GRANULARITY_TICKS  1
+#define SCHED_WAKEUP_GRANULARITY     25
+#define SCHED_WEIGHT_NORMAL          1024   // Weight of TASK_PRIORITY_NORMAL
+
+// Deadline class. A task's bandwidth (runtime/period) is kept in
+// SCHED_DL_BW_SHIFT fixed point; a CPU admits deadline tasks only while
+// their total stays within SCHED_DL_BW_LIMIT, leaving the rest for the
+// fair class.
+#define SCHED_DL_BW_SHIFT       20
+#define SCHED_DL_BW_LIMIT       ((95ULL << SCHED_DL_BW_SHIFT) / 100)
+#define SCHED_DL_MAX_PERIOD_US  10000000    // Longest period accepted (10 s)
+
+// A task that ran on its CPU within this many ticks is assumed to still
+// have its working set in that CPU's caches, so stealing avoids it
+#define SCHED_CACHE_HOT_TICKS 2
+
+// Task flags
+#define TASK_FLAG_PINNED   0x01     // Never migrated to another CPU
+#define TASK_FLAG_DEADLINE 0x02     // In the deadline class (see task.dl)
+
+// Deadline class state, all times in TSC cycles. Each wake-up releases a
+// job that must receive up to `runtime` of CPU before `deadline` after
+// its release; releases are at least `period` apart.
+struct task_deadline {
+    uint64_t runtime;
+    uint64_t deadline;
+    uint64_t period;
+    uint64_t bw;                    // runtime/period, SCHED_DL_BW_SHIFT fixed point
+    uint64_t abs_deadline;          // Current job's absolute deadline
+    int64_t remaining;              // Budget left in the current job
+    uint64_t misses;                // Jobs completed after their deadline
+    uint64_t overruns;              // Jobs throttled for exhausting their budget
+};
+
+// Deadline-miss counters reported for a task
+struct sched_deadline_stats {
+    uint64_t misses;
+    uint64_t overruns;
+};
+
+struct process;
 
 // Task Control Block
 struct task {
-    uint64_t rsp;           // Stack pointer
-    uint64_t rip;           // Instruction pointer
-    uint64_t rbp;           // Base pointer
-    uint64_t rax, rbx, rcx, rdx, rsi, rdi;
-    uint64_t r8, r9, r10, r11, r12, r13, r14, r15;
-    uint64_t cs, ds, es, fs, gs, ss;
-    uint64_t rflags;
+    uint64_t rsp;                   // Kernel stack pointer while switched out
     uint32_t id;
     uint32_t state;
     uint32_t priority;
     uint32_t ticks;
-    uint32_t sleep_ticks;
+    uint32_t cpu;                   // CPU whose run queue owns the task
+    uint32_t flags;
+    volatile uint32_t on_cpu;       // Registers still live on a CPU
+    uint64_t last_ran;              // Tick the task last left a CPU
+    uint64_t vruntime;              // Weighted CPU time (TSC cycles at normal weight)
+    uint64_t exec_start;            // TSC when the task was last charged
+    uint64_t sum_exec;              // Total CPU time in TSC cycles
+    struct rb_node run_node;        // Fair or deadline run queue link
+    struct task_deadline dl;
+    void (*entry)(void);            // Function the task runs
+    struct process* process;        // User process the task runs (NULL: none)
+    void* stack;                    // vmalloc'd kernel stack (NULL for boot contexts)
+    void* fpu;                      // XSAVE area, allocated on first FPU use
+    uint32_t fpu_cpu;               // CPU that last loaded the task's FPU state
+    struct task* next_ready;        // Idle run queue or dead list link
+    struct timer sleep_timer;       // Wakes the task from scheduler_sleep()
 };
 
 // Function prototypes
 void scheduler_init(void);
+void scheduler_init_cpu(void);
 void scheduler_add_task(void (*entry_point)(void));
+void scheduler_add_task_priority(void (*entry_point)(void), uint32_t priority);
+int scheduler_spawn(void (*entry_point)(void), uint32_t priority, int cpu);
+void scheduler_exit(void);
+void scheduler_idle(void);
 void scheduler_schedule(void);
 void scheduler_yield(void);
 void scheduler_sleep(uint32_t ticks);
+void scheduler_set_priority(uint32_t priority);
+int scheduler_tick(void);
+uint64_t scheduler_next_event(void);
+uint64_t scheduler_switch_count(uint32_t cpu);
+int scheduler_set_deadline(uint64_t runtime_us, uint64_t deadline_us, uint64_t period_us);
+int scheduler_get_deadline_stats(struct sched_deadline_stats* stats);
+uint64_t scheduler_deadline_misses(uint32_t cpu);
 struct task* scheduler_get_current_task(void);
+struct task* scheduler_find_task(uint32_t id);
+
+uint64_t context_init_stack(uint64_t stack_top, void (*fn)(void*), void* arg);
 
 // Assembly functions
-extern void context_switch(struct task* current, struct task* next);
-extern void save_context(struct task* task);
-extern void restore_context(struct task* task);
+// Save callee-saved registers on the current stack, store the stack
+// pointer in *old_rsp and resume the context saved at new_rsp
+extern void context_switch(uint64_t* old_rsp, uint64_t new_rsp);
+extern void context_first_run(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,316 @@
+// kernel/slab.c
+#include "slab.h"
+#include "pmm.h"
+#include "memory.h"
+#include "drivers/console.h"
+#include <stdint.h>
+
+// Which list a slab currently sits on
+#define SLAB_LIST_EMPTY   0
+#define SLAB_LIST_PARTIAL 1
+#define SLAB_LIST_FULL    2
+
+// Cache descriptors
+static struct kmem_cache caches[SLAB_MAX_CACHES];
+static spinlock_t caches_lock = SPINLOCK_INIT;
+
+// Insert a slab at the head of a list
+static void slab_list_add(struct slab** head, struct slab* slab) {
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head) {
+        (*head)->prev = slab;
+    }
+    *head = slab;
+}
+
+// Unlink a slab from a list
+static void slab_list_remove(struct slab** head, struct slab* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *head = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+static struct slab** slab_list_head(struct kmem_cache* cache, uint32_t list) {
+    if (list == SLAB_LIST_FULL) {
+        return &cache->full;
+    }
+    if (list == SLAB_LIST_PARTIAL) {
+        return &cache->partial;
+    }
+    return &cache->empty;
+}
+
+// Put a slab on the list matching its usage (cache lock held)
+static void slab_relist(struct kmem_cache* cache, struct slab* slab) {
+    uint32_t list = SLAB_LIST_PARTIAL;
+    if (slab->in_use == 0) {
+        list = SLAB_LIST_EMPTY;
+    } else if (slab->in_use == cache->objects_per_slab) {
+        list = SLAB_LIST_FULL;
+    }
+
+    if (list != slab->list) {
+        slab_list_remove(slab_list_head(cache, slab->list), slab);
+        slab_list_add(slab_list_head(cache, list), slab);
+        slab->list = list;
+    }
+}
+
+// Find the slab that owns an object; slabs are naturally aligned buddy blocks
+// and the direct map preserves that alignment
+static struct slab* slab_of(struct kmem_cache* cache, void* obj) {
+    uint64_t slab_bytes = (uint64_t)PAGE_SIZE << cache->order;
+    return (struct slab*)((uint64_t)obj & ~(slab_bytes - 1));
+}
+
+// Allocate a new slab and construct its objects (cache lock held)
+static struct slab* slab_grow(struct kmem_cache* cache) {
+    void* pages = pmm_alloc_pages(cache->order);
+    if (pages == NULL) {
+        return NULL;
+    }
+    struct slab* slab = (struct slab*)phys_to_virt((uint64_t)pages);
+
+    slab->cache = cache;
+    slab->in_use = 0;
+    slab->free_list = NULL;
+    slab->list = SLAB_LIST_EMPTY;
+
+    // Thread objects onto the free list back to front so allocation walks forward
+    uint8_t* base = (uint8_t*)slab + cache->first_offset;
+    for (uint32_t i = cache->objects_per_slab; i > 0; i--) {
+        void* obj = base + (i - 1) * cache->stride;
+        if (cache->ctor) {
+            cache->ctor(obj);
+        }
+        *(void**)obj = slab->free_list;
+        slab->free_list = obj;
+    }
+
+    slab_list_add(&cache->empty, slab);
+    cache->slab_count++;
+    return slab;
+}
+
+// Release empty slabs, keeping at most `keep` of them (cache lock held)
+static void slab_reap(struct kmem_cache* cache, uint32_t keep) {
+    uint32_t kept = 0;
+    struct slab* slab = cache->empty;
+
+    while (slab) {
+        struct slab* next = slab->next;
+        if (kept < keep) {
+            kept++;
+        } else {
+            slab_list_remove(&cache->empty, slab);
+            cache->slab_count--;
+            pmm_free_pages(virt_to_phys(slab), cache->order);
+        }
+        slab = next;
+    }
+}
+
+// Move up to a batch of objects from the slabs into a per-CPU cache
+static void cache_refill(struct kmem_cache* cache, struct kmem_cpu_cache* cpu_cache) {
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+    while (cpu_cache->avail < SLAB_CPU_BATCH) {
+        struct slab* slab = cache->partial ? cache->partial : cache->empty;
+        if (slab == NULL) {
+            slab = slab_grow(cache);
+            if (slab == NULL) {
+                break;
+            }
+        }
+
+        void* obj = slab->free_list;
+        slab->free_list = *(void**)obj;
+        slab->in_use++;
+        slab_relist(cache, slab);
+
+        cpu_cache->objects[cpu_cache->avail++] = obj;
+    }
+
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+// Return the oldest `count` objects of a per-CPU cache to their slabs
+static void cache_flush(struct kmem_cache* cache, struct kmem_cpu_cache* cpu_cache, uint32_t count) {
+    if (count > cpu_cache->avail) {
+        count = cpu_cache->avail;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+    for (uint32_t i = 0; i < count; i++) {
+        void* obj = cpu_cache->objects[i];
+        struct slab* slab = slab_of(cache, obj);
+
+        *(void**)obj = slab->free_list;
+        slab->free_list = obj;
+        slab->in_use--;
+        slab_relist(cache, slab);
+    }
+
+    // One spare empty slab absorbs alloc/free ping-pong at a slab boundary
+    slab_reap(cache, 1);
+
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    for (uint32_t i = count; i < cpu_cache->avail; i++) {
+        cpu_cache->objects[i - count] = cpu_cache->objects[i];
+    }
+    cpu_cache->avail -= count;
+}
+
+// Create a named cache of fixed-size objects.
+// align == 0 picks cache-line alignment (or 16 bytes for small objects).
+struct kmem_cache* kmem_cache_create(const char* name, size_t size, size_t align, kmem_ctor_t ctor) {
+    if (size == 0) {
+        return NULL;
+    }
+
+    if (align == 0) {
+        align = (size >= CACHE_LINE_SIZE / 2) ? CACHE_LINE_SIZE : 16;
+    }
+    if (align & (align - 1)) {
+        console_write("ERROR: Slab alignment must be a power of two\n");
+        return NULL;
+    }
+    if (size < sizeof(void*)) {
+        size = sizeof(void*);
+    }
+
+    size_t stride = (size + align - 1) & ~(align - 1);
+    size_t first_offset = (sizeof(struct slab) + align - 1) & ~(align - 1);
+
+    // Smallest slab order that holds enough objects
+    uint32_t order = 0;
+    while (order < SLAB_MAX_ORDER &&
+           (((size_t)PAGE_SIZE << order) - first_offset) / stride < SLAB_MIN_OBJECTS) {
+        order++;
+    }
+    size_t slab_bytes = (size_t)PAGE_SIZE << order;
+    if (slab_bytes < first_offset + stride) {
+        console_write("ERROR: Object too large for slab cache\n");
+        return NULL;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&caches_lock);
+
+    struct kmem_cache* cache = NULL;
+    for (int i = 0; i < SLAB_MAX_CACHES; i++) {
+        if (!caches[i].active) {
+            cache = &caches[i];
+            cache->active = 1;
+            break;
+        }
+    }
+
+    spin_unlock_irqrestore(&caches_lock, flags);
+
+    if (cache == NULL) {
+        console_write("ERROR: No free slab cache descriptors\n");
+        return NULL;
+    }
+
+    int i;
+    for (i = 0; i < SLAB_NAME_LEN - 1 && name[i] != '\0'; i++) {
+        cache->name[i] = name[i];
+    }
+    cache->name[i] = '\0';
+
+    cache->object_size = size;
+    cache->stride = stride;
+    cache->first_offset = first_offset;
+    cache->order = order;
+    cache->objects_per_slab = (slab_bytes - first_offset) / stride;
+    cache->ctor = ctor;
+    spin_lock_init(&cache->lock);
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty = NULL;
+    cache->slab_count = 0;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        cache->cpu[cpu].avail = 0;
+    }
+
+    return cache;
+}
+
+// Allocate an object, normally without touching shared state
+void* kmem_cache_alloc(struct kmem_cache* cache) {
+    uint64_t flags = local_irq_save();
+    struct kmem_cpu_cache* cpu_cache = &cache->cpu[cpu_current_id()];
+
+    if (cpu_cache->avail == 0) {
+        cache_refill(cache, cpu_cache);
+        if (cpu_cache->avail == 0) {
+            local_irq_restore(flags);
+            return NULL;
+        }
+    }
+
+    void* obj = cpu_cache->objects[--cpu_cache->avail];
+    local_irq_restore(flags);
+    return obj;
+}
+
+// Free an object back to this CPU's cache
+void kmem_cache_free(struct kmem_cache* cache, void* obj) {
+    if (obj == NULL) {
+        return;
+    }
+
+    uint64_t flags = local_irq_save();
+    struct kmem_cpu_cache* cpu_cache = &cache->cpu[cpu_current_id()];
+
+    if (cpu_cache->avail == SLAB_CPU_CACHE_SIZE) {
+        cache_flush(cache, cpu_cache, SLAB_CPU_BATCH);
+    }
+    cpu_cache->objects[cpu_cache->avail++] = obj;
+
+    local_irq_restore(flags);
+}
+
+// Drain this CPU's cache and give every empty slab back to the page allocator
+void kmem_cache_shrink(struct kmem_cache* cache) {
+    uint64_t flags = local_irq_save();
+    struct kmem_cpu_cache* cpu_cache = &cache->cpu[cpu_current_id()];
+    cache_flush(cache, cpu_cache, cpu_cache->avail);
+    local_irq_restore(flags);
+
+    flags = spin_lock_irqsave(&cache->lock);
+    slab_reap(cache, 0);
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+// Destroy a cache; all objects must have been freed and no CPU may be using it
+void kmem_cache_destroy(struct kmem_cache* cache) {
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        cache_flush(cache, &cache->cpu[cpu], cache->cpu[cpu].avail);
+    }
+
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+    if (cache->partial || cache->full) {
+        console_write("ERROR: Destroying slab cache with live objects: ");
+        console_write(cache->name);
+        console_write("\n");
+        spin_unlock_irqrestore(&cache->lock, flags);
+        return;
+    }
+    slab_reap(cache, 0);
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    flags = spin_lock_irqsave(&caches_lock);
+    cache->active = 0;
+    spin_unlock_irqrestore(&caches_lock, flags);
+}
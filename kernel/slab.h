@@ -0,0 +1,68 @@
+// kernel/slab.h
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "spinlock.h"
+#include "cpu.h"
+
+#define CACHE_LINE_SIZE 64
+
+// Limits
+#define SLAB_MAX_CACHES     32      // Caches that can exist at once
+#define SLAB_NAME_LEN       24
+#define SLAB_MAX_ORDER      3       // Largest slab is 2^3 pages
+#define SLAB_MIN_OBJECTS    8       // Grow the slab order until this many fit
+
+// Per-CPU object cache sizing
+#define SLAB_CPU_CACHE_SIZE 16      // Objects a CPU may hold
+#define SLAB_CPU_BATCH      8       // Objects moved per refill/drain
+
+// Object constructor, run once when an object is first carved from a slab.
+// The first word of an object is reused as the free-list link while it sits
+// in a slab, so constructors should not rely on it surviving a free.
+typedef void (*kmem_ctor_t)(void* obj);
+
+// Slab header, stored at the start of each slab's pages
+struct slab {
+    struct kmem_cache* cache;
+    struct slab* next;
+    struct slab* prev;
+    void* free_list;                // Free objects, linked through their first word
+    uint32_t in_use;                // Objects handed out (including per-CPU cached)
+    uint32_t list;                  // Which cache list the slab is on
+};
+
+// Per-CPU stack of free objects
+struct kmem_cpu_cache {
+    uint32_t avail;
+    void* objects[SLAB_CPU_CACHE_SIZE];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+// Object cache
+struct kmem_cache {
+    char name[SLAB_NAME_LEN];
+    size_t object_size;             // Size requested by the creator
+    size_t stride;                  // Aligned distance between objects
+    size_t first_offset;            // Offset of the first object in a slab
+    uint32_t order;                 // Pages per slab = 2^order
+    uint32_t objects_per_slab;
+    kmem_ctor_t ctor;
+    spinlock_t lock;
+    struct slab* partial;
+    struct slab* full;
+    struct slab* empty;
+    uint32_t slab_count;
+    uint32_t active;                // Cache slot in use
+    struct kmem_cpu_cache cpu[MAX_CPUS];
+};
+
+// Function prototypes
+struct kmem_cache* kmem_cache_create(const char* name, size_t size, size_t align, kmem_ctor_t ctor);
+void kmem_cache_destroy(struct kmem_cache* cache);
+void* kmem_cache_alloc(struct kmem_cache* cache);
+void kmem_cache_free(struct kmem_cache* cache, void* obj);
+void kmem_cache_shrink(struct kmem_cache* cache);
+
+#endif
@@ -0,0 +1,125 @@
+// kernel/smp.c
+#include "smp.h"
+#include "apic.h"
+#include "cpu.h"
+#include "fpu.h"
+#include "gdt.h"
+#include "interrupt.h"
+#include "memory.h"
+#include "scheduler.h"
+#include "syscall.h"
+#include "vmalloc.h"
+#include "drivers/console.h"
+#include "drivers/port_io.h"
+#include <stdint.h>
+
+// Trampoline image and the fields smp_init() fills in (ap_trampoline.asm)
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_end[];
+extern uint8_t ap_tramp_cr3[];
+extern uint8_t ap_tramp_stacks[];
+extern uint8_t ap_tramp_stack_count[];
+extern uint8_t ap_tramp_next_stack[];
+extern uint8_t ap_tramp_entry[];
+
+extern struct idt_ptr idtp;
+
+// Top of each AP's stack, claimed in order by the trampoline
+static uint64_t ap_stacks[MAX_CPUS - 1];
+
+// Busy-wait roughly us microseconds; each write to the POST port takes
+// about a microsecond on the ISA bus timing every chipset emulates
+static void smp_udelay(uint32_t us) {
+    for (uint32_t i = 0; i < us; i++) {
+        outb(0x80, 0);
+    }
+}
+
+// Address of a trampoline field inside the low-memory copy
+static void* trampoline_field(uint8_t* copy, uint8_t* field) {
+    return copy + (field - ap_trampoline_start);
+}
+
+// C entry point of every application processor
+void smp_ap_main(void) {
+    int id = cpu_register(cpu_initial_apic_id());
+    if (id < 0) {
+        // More CPUs than the kernel tracks
+        for (;;) {
+            asm volatile("cli; hlt");
+        }
+    }
+
+    gdt_init_cpu(id);
+    asm volatile("lidt %0" : : "m"(idtp));
+    vmm_init_cpu();
+    fpu_init_cpu();
+    syscall_init_cpu();
+    lapic_enable();
+
+    // This context becomes the CPU's idle task; from here on the CPU
+    // runs whatever its run queue holds or it can steal
+    scheduler_init_cpu();
+    timer_init_cpu();
+    asm volatile("sti");
+
+    scheduler_idle();
+}
+
+// Start every application processor with INIT-SIPI-SIPI
+void smp_init(void) {
+    console_write("Starting application processors...\n");
+
+    uint64_t size = ap_trampoline_end - ap_trampoline_start;
+    if (size > PAGE_SIZE) {
+        console_write("ERROR: AP trampoline does not fit in one page\n");
+        return;
+    }
+
+    // Stacks come from vmalloc so an overflow hits a guard page
+    uint32_t stack_count = 0;
+    while (stack_count < MAX_CPUS - 1) {
+        void* stack = vmalloc(AP_STACK_SIZE);
+        if (stack == NULL) {
+            break;
+        }
+        ap_stacks[stack_count++] = (uint64_t)stack + AP_STACK_SIZE;
+    }
+
+    uint8_t* copy = (uint8_t*)phys_to_virt(AP_TRAMPOLINE_BASE);
+    for (uint64_t i = 0; i < size; i++) {
+        copy[i] = ap_trampoline_start[i];
+    }
+
+    *(uint64_t*)trampoline_field(copy, ap_tramp_cr3) = virt_to_phys(vmm.kernel_pml4);
+    *(uint64_t*)trampoline_field(copy, ap_tramp_stacks) = (uint64_t)ap_stacks;
+    *(uint64_t*)trampoline_field(copy, ap_tramp_entry) = (uint64_t)smp_ap_main;
+    *(uint32_t*)trampoline_field(copy, ap_tramp_stack_count) = stack_count;
+    *(uint32_t*)trampoline_field(copy, ap_tramp_next_stack) = 0;
+    asm volatile("mfence" : : : "memory");
+
+    // INIT, then two STARTUP IPIs as the MP specification asks
+    apic_send_ipi(0, APIC_ICR_INIT | APIC_ICR_LEVEL_ASSERT | APIC_ICR_DEST_ALL_BUT_SELF);
+    smp_udelay(10000);
+    for (int i = 0; i < 2; i++) {
+        apic_send_ipi(0, APIC_ICR_STARTUP | APIC_ICR_DEST_ALL_BUT_SELF | (AP_TRAMPOLINE_BASE >> 12));
+        smp_udelay(200);
+    }
+
+    smp_udelay(AP_STARTUP_WAIT_MS * 1000);
+
+    // Close the stack array: any AP that shows up from now on parks, so
+    // the stacks nobody claimed can be returned
+    volatile uint32_t* next = (volatile uint32_t*)trampoline_field(copy, ap_tramp_next_stack);
+    uint32_t claimed = __atomic_exchange_n(next, 0x80000000, __ATOMIC_ACQ_REL);
+    if (claimed > stack_count) {
+        claimed = stack_count;
+    }
+    for (uint32_t i = claimed; i < stack_count; i++) {
+        vfree((void*)(ap_stacks[i] - AP_STACK_SIZE));
+    }
+
+    console_write("CPUs online: ");
+    console_write_dec(cpu_online_count());
+    console_write("\n");
+}
@@ -0,0 +1,20 @@
+// kernel/smp.h
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+
+// Physical page the AP startup trampoline is copied to (SIPI vector 0x08)
+#define AP_TRAMPOLINE_BASE 0x8000
+
+// Kernel stack for each application processor
+#define AP_STACK_SIZE 16384
+
+// How long the BSP waits for APs to check in after the STARTUP IPIs
+#define AP_STARTUP_WAIT_MS 100
+
+// Function prototypes
+void smp_init(void);
+void smp_ap_main(void);
+
+#endif
@@ -0,0 +1,56 @@
+// kernel/spinlock.h
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+
+// Simple test-and-test-and-set spinlock
+typedef struct {
+    volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+static inline void spin_lock_init(spinlock_t* lock) {
+    lock->locked = 0;
+}
+
+static inline void spin_lock(spinlock_t* lock) {
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        while (lock->locked) {
+            asm volatile("pause");
+        }
+    }
+}
+
+static inline void spin_unlock(spinlock_t* lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+// Disable local interrupts, returning the previous RFLAGS
+static inline uint64_t local_irq_save(void) {
+    uint64_t flags;
+    asm volatile("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+// Re-enable local interrupts if they were enabled in flags
+static inline void local_irq_restore(uint64_t flags) {
+    if (flags & 0x200) {
+        asm volatile("sti" ::: "memory");
+    }
+}
+
+// Lock variants that also disable local interrupts, for data shared with IRQ context
+static inline uint64_t spin_lock_irqsave(spinlock_t* lock) {
+    uint64_t flags = local_irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t* lock, uint64_t flags) {
+    spin_unlock(lock);
+    local_irq_restore(flags);
+}
+
+#endif
@@ -0,0 +1,79 @@
+// kernel/string.c
+#include <stddef.h>
+#include <string.h>
+
+// The few C library string routines the kernel uses. GCC may also emit
+// calls to memcpy/memset for struct copies and zeroing, so they must
+// exist even where no code calls them by name. Loop-to-call pattern
+// recognition is turned off so they do not end up calling themselves.
+#define NO_LIBCALLS __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+NO_LIBCALLS void* memcpy(void* dest, const void* src, size_t n) {
+    unsigned char* d = (unsigned char*)dest;
+    const unsigned char* s = (const unsigned char*)src;
+    for (size_t i = 0; i < n; i++) {
+        d[i] = s[i];
+    }
+    return dest;
+}
+
+NO_LIBCALLS void* memmove(void* dest, const void* src, size_t n) {
+    unsigned char* d = (unsigned char*)dest;
+    const unsigned char* s = (const unsigned char*)src;
+    if (d < s) {
+        for (size_t i = 0; i < n; i++) {
+            d[i] = s[i];
+        }
+    } else {
+        for (size_t i = n; i > 0; i--) {
+            d[i - 1] = s[i - 1];
+        }
+    }
+    return dest;
+}
+
+NO_LIBCALLS void* memset(void* dest, int c, size_t n) {
+    unsigned char* d = (unsigned char*)dest;
+    for (size_t i = 0; i < n; i++) {
+        d[i] = (unsigned char)c;
+    }
+    return dest;
+}
+
+int memcmp(const void* a, const void* b, size_t n) {
+    const unsigned char* x = (const unsigned char*)a;
+    const unsigned char* y = (const unsigned char*)b;
+    for (size_t i = 0; i < n; i++) {
+        if (x[i] != y[i]) {
+            return x[i] - y[i];
+        }
+    }
+    return 0;
+}
+
+size_t strlen(const char* s) {
+    size_t n = 0;
+    while (s[n] != '\0') {
+        n++;
+    }
+    return n;
+}
+
+char* strchr(const char* s, int c) {
+    for (; ; s++) {
+        if (*s == (char)c) {
+            return (char*)s;
+        }
+        if (*s == '\0') {
+            return NULL;
+        }
+    }
+}
+
+NO_LIBCALLS char* strcpy(char* dest, const char* src) {
+    size_t i = 0;
+    do {
+        dest[i] = src[i];
+    } while (src[i++] != '\0');
+    return dest;
+}
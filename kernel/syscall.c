@@ -1,9 +1,33 @@
 #include "syscall.h"
 #include "drivers/console.h"
 #include "process.h"
+#include "scheduler.h"
+#include "cpu.h"
+#include "gdt.h"
+#include "memory.h"
 #include "fs/vfs.h"
 #include <stdint.h>
 
+// MSRs that configure the SYSCALL instruction
+#define IA32_EFER_MSR           0xC0000080
+#define IA32_STAR_MSR           0xC0000081
+#define IA32_LSTAR_MSR          0xC0000082
+#define IA32_FMASK_MSR          0xC0000084
+#define IA32_KERNEL_GS_BASE_MSR 0xC0000102
+
+#define EFER_SCE                0x1     // SYSCALL/SYSRET enable
+
+// Per-CPU state syscall_entry reaches through GS after SWAPGS. The layout
+// is shared with syscall_entry.asm.
+struct syscall_cpu {
+    uint64_t kernel_rsp;            // Top of the running process's kernel stack
+    uint64_t user_rsp;              // Scratch slot for the caller's RSP
+};
+
+static struct syscall_cpu syscall_cpus[MAX_CPUS];
+
+extern void syscall_entry(void);
+
 // System call handlers array
 syscall_handler_t syscall_handlers[MAX_SYSCALLS];
 
@@ -30,6 +54,10 @@ static uint64_t sys_getpid(uint64_t unused1, uint64_t unused2, uint64_t unused3,
                           uint64_t unused4, uint64_t unused5, uint64_t unused6);
 static uint64_t sys_yield(uint64_t unused1, uint64_t unused2, uint64_t unused3, 
                          uint64_t unused4, uint64_t unused5, uint64_t unused6);
+static uint64_t sys_sched_setdeadline(uint64_t runtime, uint64_t deadline, uint64_t period, 
+                                      uint64_t unused1, uint64_t unused2, uint64_t unused3);
+static uint64_t sys_sched_dlstats(uint64_t buf, uint64_t unused1, uint64_t unused2, 
+                                  uint64_t unused3, uint64_t unused4, uint64_t unused5);
 
 // Initialize system call interface and register handlers
 void syscall_init(void) {
@@ -52,10 +80,45 @@ void syscall_init(void) {
     syscall_register(SYSCALL_SLEEP, (syscall_handler_t)sys_sleep);
     syscall_register(SYSCALL_GETPID, (syscall_handler_t)sys_getpid);
     syscall_register(SYSCALL_YIELD, (syscall_handler_t)sys_yield);
+    syscall_register(SYSCALL_SCHED_SETDEADLINE, (syscall_handler_t)sys_sched_setdeadline);
+    syscall_register(SYSCALL_SCHED_DLSTATS, (syscall_handler_t)sys_sched_dlstats);
+    
+    syscall_init_cpu();
     
     console_write("System call interface initialized with core syscalls.\n");
 }
 
+// Point this CPU's SYSCALL instruction at syscall_entry. Interrupts and
+// the direction flag are cleared on entry; the kernel stack comes from
+// the per-CPU area set by syscall_set_kernel_stack().
+void syscall_init_cpu(void) {
+    wrmsr(IA32_KERNEL_GS_BASE_MSR, (uint64_t)&syscall_cpus[cpu_current_id()]);
+    wrmsr(IA32_STAR_MSR, (uint64_t)GDT_KERNEL_CODE << 32);
+    wrmsr(IA32_LSTAR_MSR, (uint64_t)syscall_entry);
+    wrmsr(IA32_FMASK_MSR, 0x600);
+    wrmsr(IA32_EFER_MSR, rdmsr(IA32_EFER_MSR) | EFER_SCE);
+}
+
+// Kernel stack system calls made on this CPU run on from now on
+void syscall_set_kernel_stack(uint64_t stack_top) {
+    syscall_cpus[cpu_current_id()].kernel_rsp = stack_top;
+}
+
+// Called by syscall_entry with the caller's saved user registers. The
+// frame stays on record in the process while the call runs, which is
+// what fork copies the child's starting state from.
+void syscall_handle(struct registers* frame) {
+    struct process* process = process_get_current();
+    process->syscall_frame = frame;
+    asm volatile("sti");
+    
+    frame->rax = syscall_dispatch(frame->rax, frame->rdi, frame->rsi, frame->rdx,
+                                  frame->r10, frame->r8, frame->r9);
+    
+    asm volatile("cli");
+    process->syscall_frame = NULL;
+}
+
 // Exit system call
 static uint64_t sys_exit(uint64_t status, uint64_t unused1, uint64_t unused2, 
                         uint64_t unused3, uint64_t unused4, uint64_t unused5) {
@@ -69,14 +132,14 @@ static uint64_t sys_exit(uint64_t status, uint64_t unused1, uint64_t unused2,
     // Print status (would need implementation)
     console_write(")\n");
     
-    // Get current process and terminate it
+    // Get current process and terminate it; its task ends there
     struct process* current = process_get_current();
     if (current) {
         process_exit(current->pid);
     }
     
-    // In a real implementation, we would switch to another process
-    // For now, just halt the system
+    // Only reached from the kernel's own context, which has nothing to
+    // exit to: halt the system
     for (;;)
         asm volatile ("hlt");
     
@@ -153,8 +216,12 @@ static uint64_t sys_fork(uint64_t unused1, uint64_t unused2, uint64_t unused3,
     (void)unused5;
     (void)unused6;
     
-    // For now, just return error as we don't implement process forking
-    return -1;
+    // Parent gets the child's PID; the child resumes with 0
+    pid_t pid = process_fork();
+    if (pid == 0) {
+        return -1;
+    }
+    return pid;
 }
 
 // Exec system call (placeholder)
@@ -193,12 +260,8 @@ static uint64_t sys_sleep(uint64_t ticks, uint64_t unused1, uint64_t unused2,
     (void)unused4;
     (void)unused5;
     
-    console_write("System call: sleep(");
-    // Print ticks (would need implementation)
-    console_write(")\n");
-    
-    // For now, just return success
-    // In a real implementation, we would put the process to sleep
+    // Block on the timer wheel until the requested tick
+    scheduler_sleep((uint32_t)ticks);
     return 0;
 }
 
@@ -236,6 +299,50 @@ static uint64_t sys_yield(uint64_t unused1, uint64_t unused2, uint64_t unused3,
     return 0;
 }
 
+// Set deadline class parameters system call: runtime, relative deadline
+// and period in microseconds, or runtime 0 to return to the fair class.
+// Applies to the scheduler task making the call.
+static uint64_t sys_sched_setdeadline(uint64_t runtime, uint64_t deadline, uint64_t period, 
+                                      uint64_t unused1, uint64_t unused2, uint64_t unused3) {
+    (void)unused1;
+    (void)unused2;
+    (void)unused3;
+    
+    // Fails if the parameters are inconsistent or the CPU has no
+    // bandwidth left for them
+    return scheduler_set_deadline(runtime, deadline, period);
+}
+
+// Deadline-miss counters system call: fills a struct sched_deadline_stats
+// in user memory. Like sched_setdeadline it acts on the scheduler task
+// making the call, not on the process as a whole.
+static uint64_t sys_sched_dlstats(uint64_t buf, uint64_t unused1, uint64_t unused2, 
+                                  uint64_t unused3, uint64_t unused4, uint64_t unused5) {
+    (void)unused1;
+    (void)unused2;
+    (void)unused3;
+    (void)unused4;
+    (void)unused5;
+    
+    // The whole buffer must lie in user space
+    struct sched_deadline_stats stats;
+    if (buf == 0 || buf > USER_SPACE_END - sizeof(stats)) {
+        return -1;
+    }
+    
+    if (scheduler_get_deadline_stats(&stats) != 0) {
+        return -1;
+    }
+    
+    // Copy out only once the kernel-side read has succeeded
+    const uint8_t* src = (const uint8_t*)&stats;
+    uint8_t* dst = (uint8_t*)buf;
+    for (uint64_t i = 0; i < sizeof(stats); i++) {
+        dst[i] = src[i];
+    }
+    return 0;
+}
+
 // Dispatch system call to appropriate handler
 uint64_t syscall_dispatch(uint64_t syscall_num, uint64_t arg1, uint64_t arg2, 
                          uint64_t arg3, uint64_t arg4, uint64_t arg5, uint64_t arg6) {
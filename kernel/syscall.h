@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 
+struct registers;
+
 // System call numbers
 #define SYSCALL_EXIT     0
 #define SYSCALL_WRITE    1
@@ -15,6 +17,8 @@
 #define SYSCALL_SLEEP    8
 #define SYSCALL_GETPID   9
 #define SYSCALL_YIELD    10
+#define SYSCALL_SCHED_SETDEADLINE 11
+#define SYSCALL_SCHED_DLSTATS     12
 
 // Maximum number of system calls
 #define MAX_SYSCALLS 128
@@ -24,6 +28,9 @@ typedef uint64_t (*syscall_handler_t)(uint64_t, uint64_t, uint64_t, uint64_t, ui
 
 // Function prototypes
 void syscall_init(void);
+void syscall_init_cpu(void);
+void syscall_set_kernel_stack(uint64_t stack_top);
+void syscall_handle(struct registers* frame);
 void syscall_register(uint64_t syscall_num, syscall_handler_t handler);
 uint64_t syscall_dispatch(uint64_t syscall_num, uint64_t arg1, uint64_t arg2, 
                          uint64_t arg3, uint64_t arg4, uint64_t arg5, uint64_t arg6);
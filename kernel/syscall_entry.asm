@@ -1,83 +1,86 @@
 [BITS 64]
 
 ; System call entry point
-; Uses SYSCALL/SYSRET instruction pair for fast system calls
+; Uses the SYSCALL instruction for fast system calls
 ; RAX contains the system call number
 ; RDI, RSI, RDX, R10, R8, R9 contain the arguments (R10 is used instead of RCX for the 4th argument)
 
-; MSR (Model Specific Register) addresses for SYSCALL/SYSRET
-IA32_LSTAR equ 0xC0000082
-IA32_STAR  equ 0xC0000081
-IA32_SFMASK equ 0xC0000084
+global syscall_entry
+global syscall_return
 
+extern syscall_handle
+
+; User selectors with RPL 3, as the frame must hold them for IRETQ
+USER_CODE_SELECTOR equ 0x1B
+USER_DATA_SELECTOR equ 0x23
+
+; Offsets in the per-CPU area IA32_KERNEL_GS_BASE points at (struct syscall_cpu)
+SYSCALL_CPU_KERNEL_RSP equ 0
+SYSCALL_CPU_USER_RSP   equ 8
+
+; SYSCALL leaves the user RIP in RCX and RFLAGS in R11, and does not switch
+; stacks. Move to this CPU's kernel stack and save the complete user state
+; there as a struct registers, so the kernel can resume the caller (or
+; start a forked child) from it.
 syscall_entry:
-    ; Save registers that might be used as return values
-    push rcx    ; Save original return address
-    push r11    ; Save original RFLAGS
-    
-    ; At this point:
-    ; RAX = syscall number
-    ; RDI = arg1
-    ; RSI = arg2
-    ; RDX = arg3
-    ; RCX = arg4 (will be overwritten by return address)
-    ; R8 = arg5
-    ; R9 = arg6
-    ; R10 = arg4 (we'll use this instead of RCX for the 4th argument)
-    
-    ; Move arg4 to R10, and arg3 to RCX (so RCX has the original 4th argument)
-    mov r10, rdx
-    mov rcx, rsi
-    
-    ; Call syscall_dispatch with arguments
-    ; syscall_dispatch(uint64_t syscall_num, uint64_t arg1, uint64_t arg2, 
-    ;                 uint64_t arg3, uint64_t arg4, uint64_t arg5, uint64_t arg6)
-    ; RDI = syscall_num (already in RAX, so move it)
-    push rdi    ; Save original RDI
-    mov rdi, rax    ; syscall_num
-    mov rsi, rdi    ; arg1 (was in original RDI)
-    pop rdi     ; restore original RDI (arg1)
-    mov rdx, rcx    ; arg2 (was in original RSI)
-    mov rcx, r8     ; arg3 (was in original RDX) 
-    push r9     ; Save arg6 for later
-    mov r8, r10   ; arg4 (was in original RCX)
-    mov r9, r8    ; arg5 (was in original R8)
-    pop r10     ; arg6 (was in original R9)
-    
-    ; Call the C function syscall_dispatch
-    call syscall_dispatch
-    
-    ; Restore original R11 and RCX (return address)
-    pop r11     ; Restore RFLAGS
-    pop rcx     ; Restore return address
-    
-    ; Return to user mode using SYSRET
-    ; RAX contains the return value
-    ; RCX contains the return address
-    ; R11 contains the RFLAGS
-    sysretq
+    swapgs
+    mov [gs:SYSCALL_CPU_USER_RSP], rsp
+    mov rsp, [gs:SYSCALL_CPU_KERNEL_RSP]
+
+    ; Hardware part of the frame, in IRETQ order
+    push USER_DATA_SELECTOR             ; SS
+    push qword [gs:SYSCALL_CPU_USER_RSP] ; RSP
+    push r11                            ; RFLAGS
+    push USER_CODE_SELECTOR             ; CS
+    push rcx                            ; RIP
+    swapgs
+
+    ; General-purpose registers, in struct registers order
+    push rax
+    push rbx
+    push rcx
+    push rdx
+    push rbp
+    push rsi
+    push rdi
+    push r8
+    push r9
+    push r10
+    push r11
+    push r12
+    push r13
+    push r14
+    push r15
+
+    ; syscall_handle(frame) stores the result in the frame's RAX
+    mov rdi, rsp
+    call syscall_handle
+    mov rdi, rsp
+
+; Return to user mode from a struct registers frame
+; Parameters:
+;   RDI = frame to restore; it becomes the stack, so it must sit on a
+;         kernel stack that nothing else uses
+syscall_return:
+    cli
+    mov rsp, rdi
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rdi
+    pop rsi
+    pop rbp
+    pop rdx
+    pop rcx
+    pop rbx
+    pop rax
+
+    iretq
 
-; Function to initialize syscall MSR registers
-init_syscall_msr:
-    ; Set up STAR MSR: Contains CS and SS selectors for SYSCALL
-    ; Bits 47:32 = CS selector for syscall (kernel CS)
-    ; Bits 31:16 = SS selector for syscall (kernel SS)
-    mov ecx, IA32_STAR
-    mov edx, 0x00180008  ; CS = 0x08 (kernel code), SS = 0x10 (kernel data), shifted right by 16
-    mov eax, 0x00200010  ; CS = 0x20 (user code), SS = 0x28 (user data) - shifted left 16
-    wrmsr
-    
-    ; Set up LSTAR MSR: Contains the linear address of the syscall entry point
-    mov ecx, IA32_LSTAR
-    lea rax, [syscall_entry]
-    mov edx, eax
-    shr edx, 32
-    wrmsr
-    
-    ; Set up SFMASK MSR: Contains the mask of RFLAGS bits that are cleared during SYSCALL
-    mov ecx, IA32_SFMASK
-    mov eax, 0x00000200  ; Clear interrupt flag during SYSCALL
-    mov edx, 0x00000000
-    wrmsr
-    
-    ret
\ No newline at end of file
+section .note.GNU-stack noalloc noexec nowrite progbits
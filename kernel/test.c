@@ -8,6 +8,14 @@
 #include "elf.h"
 #include "syscall.h"
 #include "memory.h"
+#include "slab.h"
+#include "dma.h"
+#include "vmalloc.h"
+#include "timer.h"
+#include "fpu.h"
+#include "scheduler.h"
+#include "cpu.h"
+#include "idr.h"
 #include <stdint.h>
 
 // Test ATA driver functionality
@@ -167,10 +175,362 @@ void test_user_program_execution(void) {
     console_write("=== User Program Execution Test Complete ===\n\n");
 }
 
+// Constructor used by the slab test
+static void test_slab_ctor(void* obj) {
+    ((uint64_t*)obj)[1] = 0x5AB5AB;
+}
+
+// Test slab object caches
+void test_slab_allocator(void) {
+    console_write("=== Testing Slab Allocator ===\n");
+    
+    struct kmem_cache* cache = kmem_cache_create("test_obj", 40, 0, test_slab_ctor);
+    if (cache == NULL) {
+        console_write("Failed to create slab cache\n");
+        return;
+    }
+    
+    // Allocate more objects than one slab holds to force growth
+    void* objs[64];
+    int success = 1;
+    for (int i = 0; i < 64; i++) {
+        objs[i] = kmem_cache_alloc(cache);
+        if (objs[i] == NULL || ((uint64_t)objs[i] & (CACHE_LINE_SIZE - 1)) != 0 ||
+            ((uint64_t*)objs[i])[1] != 0x5AB5AB) {
+            success = 0;
+        }
+    }
+    
+    for (int i = 0; i < 64; i++) {
+        kmem_cache_free(cache, objs[i]);
+    }
+    
+    if (success) {
+        console_write("Slab allocation test passed\n");
+    } else {
+        console_write("Slab allocation test failed\n");
+    }
+    
+    kmem_cache_shrink(cache);
+    kmem_cache_destroy(cache);
+    
+    console_write("=== Slab Allocator Test Complete ===\n\n");
+}
+
+// Test zone-constrained DMA buffers
+void test_dma_allocator(void) {
+    console_write("=== Testing DMA Allocator ===\n");
+    
+    // Zeroed so dma_free() skips any buffer whose allocation failed
+    struct dma_buffer isa = {0}, low = {0}, any = {0};
+    int success = 1;
+    
+    // A PRD-table-sized buffer for a legacy controller
+    if (dma_alloc(512, 0, DMA_ZONE_ISA, &isa) == 0) {
+        success = success && isa.phys + isa.size <= DMA_ZONE_ISA_LIMIT;
+        success = success && ((uint64_t*)isa.virt)[0] == 0;
+    } else {
+        success = 0;
+    }
+    
+    // A 64KB-aligned ring for a 32-bit bus master
+    if (dma_alloc(3 * PAGE_SIZE, 0x10000, DMA_ZONE_32, &low) == 0) {
+        success = success && low.phys + low.size <= DMA_ZONE_32_LIMIT;
+        success = success && (low.phys & 0xFFFF) == 0 && low.size >= 3 * PAGE_SIZE;
+        success = success && virt_to_phys(low.virt) == low.phys;
+    } else {
+        success = 0;
+    }
+    
+    if (dma_alloc(8 * PAGE_SIZE, 0, DMA_ZONE_ANY, &any) == 0) {
+        success = success && (any.phys & (8 * PAGE_SIZE - 1)) == 0;
+    } else {
+        success = 0;
+    }
+    
+    dma_free(&isa);
+    dma_free(&low);
+    dma_free(&any);
+    
+    if (success) {
+        console_write("DMA allocation test passed\n");
+    } else {
+        console_write("DMA allocation test failed\n");
+    }
+    
+    console_write("=== DMA Allocator Test Complete ===\n\n");
+}
+
+// Test the vmalloc range
+void test_vmalloc(void) {
+    console_write("=== Testing vmalloc ===\n");
+    
+    // A FAT-sized buffer and a small one placed right after it
+    uint64_t size = 5 * PAGE_SIZE + 100;
+    uint8_t* big = (uint8_t*)vmalloc(size);
+    uint8_t* small = (uint8_t*)vmalloc(PAGE_SIZE);
+    int success = big != NULL && small != NULL && is_vmalloc_addr(big);
+    
+    if (success) {
+        for (uint64_t i = 0; i < size; i++) {
+            big[i] = (uint8_t)i;
+        }
+        for (uint64_t i = 0; i < size; i++) {
+            success = success && big[i] == (uint8_t)i;
+        }
+        
+        // The page after the area is a guard gap
+        uint64_t guard = (uint64_t)big + 6 * PAGE_SIZE;
+        success = success && get_physical_address(guard) == 0;
+        success = success && (uint64_t)small >= guard + VMALLOC_GUARD_SIZE;
+    }
+    
+    vfree(big);
+    success = success && get_physical_address((uint64_t)big) == 0;
+    
+    // The freed hole is reused
+    uint8_t* again = (uint8_t*)vmalloc(2 * PAGE_SIZE);
+    success = success && again == big;
+    vfree(again);
+    vfree(small);
+    
+    if (success) {
+        console_write("vmalloc test passed\n");
+    } else {
+        console_write("vmalloc test failed\n");
+    }
+    
+    console_write("=== vmalloc Test Complete ===\n\n");
+}
+
+// Timer callback used by the timer wheel test
+static void test_timer_fired(void* arg) {
+    *(volatile int*)arg = 1;
+}
+
+// Test timer wheel insertion, deletion and expiry
+void test_timer_wheel(void) {
+    console_write("=== Testing Timer Wheel ===\n");
+    
+    volatile int fired = 0;
+    struct timer timers[3];
+    uint64_t delays[3] = { 10, 5000, 3000000 };  // Root wheel, level 0, level 2
+    int success = 1;
+    
+    for (int i = 0; i < 3; i++) {
+        timer_setup(&timers[i], test_timer_fired, (void*)&fired);
+        timer_add(&timers[i], delays[i]);
+        success = success && timer_pending(&timers[i]);
+    }
+    for (int i = 0; i < 3; i++) {
+        success = success && timer_del(&timers[i]) == 1;
+        success = success && !timer_pending(&timers[i]) && timer_del(&timers[i]) == 0;
+    }
+    success = success && !fired;
+    
+    // Expiry needs the tick interrupt; only wait for it if interrupts are on
+    uint64_t rflags;
+    asm volatile("pushfq; pop %0" : "=r"(rflags));
+    if (rflags & 0x200) {
+        struct timer timer;
+        timer_setup(&timer, test_timer_fired, (void*)&fired);
+        uint64_t start = timer_now();
+        timer_add(&timer, 2);
+        while (!fired && timer_now() < start + 20) {
+            asm volatile("hlt");
+        }
+        success = success && fired && timer_now() >= start + 2;
+        timer_del(&timer);
+    }
+    
+    if (success) {
+        console_write("Timer wheel test passed\n");
+    } else {
+        console_write("Timer wheel test failed\n");
+    }
+    
+    console_write("=== Timer Wheel Test Complete ===\n\n");
+}
+
+// Test that a task's SSE registers survive kernel SIMD use and a switch
+void test_fpu(void) {
+    console_write("=== Testing FPU State Switching ===\n");
+    
+    uint64_t value[2] = { 0x0123456789ABCDEFULL, 0xFEDCBA9876543210ULL };
+    uint64_t scratch[2] = { 0, 0 };
+    uint64_t result[2] = { 0, 0 };
+    
+    // The first use faults the task's state in
+    asm volatile("movdqu (%0), %%xmm0" : : "r"(value) : "memory");
+    
+    // Kernel SIMD code clobbers the register...
+    kernel_fpu_begin();
+    asm volatile("movdqu (%0), %%xmm0" : : "r"(scratch) : "memory");
+    kernel_fpu_end();
+    
+    // ...and other tasks may run before the task looks again
+    scheduler_yield();
+    asm volatile("movdqu %%xmm0, (%0)" : : "r"(result) : "memory");
+    
+    if (result[0] == value[0] && result[1] == value[1]) {
+        console_write("FPU state test passed\n");
+    } else {
+        console_write("FPU state test failed\n");
+    }
+    
+    console_write("=== FPU State Test Complete ===\n\n");
+}
+
+// Test ID allocation and lookup past the first few bitmap words
+#define IDR_TEST_IDS 3000
+static struct idr idr_under_test = IDR_INIT;
+
+void test_idr(void) {
+    console_write("=== Testing ID Allocator ===\n");
+    
+    int passed = 1;
+    for (int i = 0; i < IDR_TEST_IDS; i++) {
+        if (idr_alloc(&idr_under_test, (void*)(uint64_t)(i + 1)) != i) {
+            passed = 0;
+            break;
+        }
+    }
+    
+    // Freed IDs are found by lookup no longer, and the lowest is reused
+    idr_remove(&idr_under_test, 1234);
+    idr_remove(&idr_under_test, 77);
+    if (idr_find(&idr_under_test, 1234) != NULL ||
+        idr_find(&idr_under_test, 2999) != (void*)3000ULL ||
+        idr_alloc(&idr_under_test, (void*)1ULL) != 77 ||
+        idr_alloc(&idr_under_test, (void*)1ULL) != 1234 ||
+        idr_alloc(&idr_under_test, (void*)1ULL) != IDR_TEST_IDS) {
+        passed = 0;
+    }
+    
+    for (int i = 0; i <= IDR_TEST_IDS; i++) {
+        idr_remove(&idr_under_test, i);
+    }
+    if (idr_under_test.count != 0) {
+        passed = 0;
+    }
+    
+    console_write(passed ? "ID allocator test passed\n" : "ID allocator test failed\n");
+    console_write("=== ID Allocator Test Complete ===\n\n");
+}
+
+// Fair-share test: two CPU-bound tasks share this CPU with four priority
+// levels (a weight ratio of about 2.4) between them
+#define FAIR_TEST_TICKS 20
+static volatile uint64_t fair_test_count[2];
+static volatile uint32_t fair_test_deadline;
+static volatile uint32_t fair_test_live;
+
+static void fair_test_spin(volatile uint64_t* count) {
+    while (get_tick_count() < fair_test_deadline) {
+        (*count)++;
+    }
+    __atomic_fetch_sub(&fair_test_live, 1, __ATOMIC_RELEASE);
+}
+
+static void fair_test_low(void) {
+    fair_test_spin(&fair_test_count[0]);
+}
+
+static void fair_test_high(void) {
+    fair_test_spin(&fair_test_count[1]);
+}
+
+void test_fair_share(void) {
+    console_write("=== Testing Fair Scheduling ===\n");
+    
+    int cpu = cpu_current_id();
+    fair_test_count[0] = 0;
+    fair_test_count[1] = 0;
+    fair_test_live = 2;
+    fair_test_deadline = get_tick_count() + FAIR_TEST_TICKS;
+    
+    if (scheduler_spawn(fair_test_low, TASK_PRIORITY_NORMAL, cpu) < 0 ||
+        scheduler_spawn(fair_test_high, TASK_PRIORITY_NORMAL + 4, cpu) < 0) {
+        console_write("Fair scheduling test failed: could not spawn tasks\n");
+        return;
+    }
+    while (__atomic_load_n(&fair_test_live, __ATOMIC_ACQUIRE) != 0) {
+        scheduler_sleep(1);
+    }
+    
+    // Both must have run, the heavier one clearly more
+    uint64_t low = fair_test_count[0];
+    uint64_t high = fair_test_count[1];
+    if (low > 0 && high > low + low / 2) {
+        console_write("Fair scheduling test passed\n");
+    } else {
+        console_write("Fair scheduling test failed\n");
+    }
+    
+    console_write("=== Fair Scheduling Test Complete ===\n\n");
+}
+
+// Deadline class test: admission control, then periodic jobs that must
+// keep meeting their deadlines while a CPU-bound task shares the CPU
+#define DEADLINE_TEST_JOBS 10
+static volatile uint32_t deadline_test_done;
+
+static void deadline_test_hog(void) {
+    while (!deadline_test_done) {
+        asm volatile("pause");
+    }
+}
+
+void test_deadline_class(void) {
+    console_write("=== Testing Deadline Scheduling ===\n");
+    
+    int passed = 1;
+    
+    // Inconsistent parameters and more than the CPU has are refused
+    if (scheduler_set_deadline(2000, 1000, 10000) == 0 ||
+        scheduler_set_deadline(9900, 10000, 10000) == 0) {
+        console_write("Deadline admission test failed\n");
+        passed = 0;
+    }
+    
+    deadline_test_done = 0;
+    if (scheduler_spawn(deadline_test_hog, TASK_PRIORITY_MAX, cpu_current_id()) < 0 ||
+        scheduler_set_deadline(2000, 20000, 20000) < 0) {
+        console_write("Deadline test failed: could not set up tasks\n");
+        deadline_test_done = 1;
+        return;
+    }
+    
+    for (int i = 0; i < DEADLINE_TEST_JOBS; i++) {
+        scheduler_sleep(2);
+    }
+    
+    struct sched_deadline_stats stats;
+    if (scheduler_get_deadline_stats(&stats) < 0 || stats.misses != 0 || stats.overruns != 0) {
+        console_write("Deadline miss test failed\n");
+        passed = 0;
+    }
+    scheduler_set_deadline(0, 0, 0);
+    deadline_test_done = 1;
+    
+    if (passed) {
+        console_write("Deadline scheduling test passed\n");
+    }
+    console_write("=== Deadline Scheduling Test Complete ===\n\n");
+}
+
 // Run all tests
 void run_tests(void) {
     console_write("=== Running All Tests ===\n\n");
     
+    test_slab_allocator();
+    test_dma_allocator();
+    test_vmalloc();
+    test_timer_wheel();
+    test_fpu();
+    test_idr();
+    test_fair_share();
+    test_deadline_class();
     test_ata_driver();
     test_vfs();
     test_fat();
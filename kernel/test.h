@@ -12,6 +12,14 @@ void test_process_creation(void);
 void test_elf_loading(void);
 void test_syscalls(void);
 void test_user_program_execution(void);
+void test_slab_allocator(void);
+void test_dma_allocator(void);
+void test_vmalloc(void);
+void test_timer_wheel(void);
+void test_fpu(void);
+void test_idr(void);
+void test_fair_share(void);
+void test_deadline_class(void);
 void run_tests(void);
 
 #endif // TEST_H
\ No newline at end of file
@@ -4,92 +4,453 @@
 #include "drivers/port_io.h"
 #include "interrupt.h"
 #include "apic.h"
+#include "cpu.h"
 #include "scheduler.h"
+#include "spinlock.h"
 #include <stdint.h>
 
-// Tick counter
-static volatile uint32_t tick_count = 0;
+// Timekeeping. Ticks are derived from the TSC rather than counted by a
+// periodic interrupt, so time keeps moving while the timer is stopped.
+// The TSC is assumed to run at a constant rate and in step on all CPUs.
+static uint64_t tsc_base = 0;       // TSC at tick 0
+static uint64_t tsc_per_tick = 0;   // 0 until timer_init() calibrates
+static uint32_t lapic_per_tick = 0; // LAPIC timer counts per tick (divide by 16)
+static int use_tsc_deadline = 0;
+
+// Timer wheel; `ticks` is the next tick whose slot has not been run yet
+struct timer_wheel {
+    uint64_t ticks;
+    struct timer* root[TIMER_WHEEL_ROOT_SIZE];
+    struct timer* levels[TIMER_WHEEL_LEVELS][TIMER_WHEEL_LEVEL_SIZE];
+};
+
+static struct timer_wheel wheel;
+static spinlock_t wheel_lock = SPINLOCK_INIT;
+
+// Earliest tick the wheel may have work on (a lower bound: deleting a
+// timer does not raise it), and the event the BSP's timer is armed for.
+// The BSP runs the wheel, so other CPUs kick it when they add a timer
+// that is due sooner.
+static uint64_t wheel_next = TIMER_NEVER;
+static volatile uint64_t bsp_next_event = TIMER_NEVER;
 
 // PIT constants
-#define PIT_CHANNEL0_DATA 0x40
+#define PIT_CHANNEL2_DATA 0x42
 #define PIT_COMMAND      0x43
+#define PIT_GATE_PORT    0x61
 #define PIT_FREQUENCY    1193182
 
 // Get tick count
 uint32_t get_tick_count(void) {
-    return tick_count;
+    return (uint32_t)timer_now();
+}
+
+// Ticks since boot, without wrapping
+uint64_t timer_now(void) {
+    if (tsc_per_tick == 0) {
+        return 0;
+    }
+    return (rdtsc() - tsc_base) / tsc_per_tick;
+}
+
+// TSC cycles per tick (0 before calibration)
+uint64_t timer_tsc_per_tick(void) {
+    return tsc_per_tick;
+}
+
+// TSC value at the start of the given tick
+uint64_t timer_tick_to_tsc(uint64_t tick) {
+    return tsc_base + tick * tsc_per_tick;
+}
+
+// Link a timer into a slot list
+static void timer_link(struct timer** slot, struct timer* timer) {
+    timer->next = *slot;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+// File a timer in the slot covering its expiry (wheel lock held)
+static void wheel_insert(struct timer* timer) {
+    uint64_t expires = timer->expires;
+    uint64_t delta = expires - wheel.ticks;
+    struct timer** slot;
+
+    if ((int64_t)delta < 0) {
+        // Already due: run it on the next tick processed
+        slot = &wheel.root[wheel.ticks & (TIMER_WHEEL_ROOT_SIZE - 1)];
+    } else if (delta < TIMER_WHEEL_ROOT_SIZE) {
+        slot = &wheel.root[expires & (TIMER_WHEEL_ROOT_SIZE - 1)];
+    } else {
+        if (delta > TIMER_MAX_DELAY) {
+            expires = wheel.ticks + TIMER_MAX_DELAY;
+            timer->expires = expires;
+            delta = TIMER_MAX_DELAY;
+        }
+
+        // Level n covers delays below 2^(8 + 6(n+1)) ticks
+        int level = 0;
+        while (delta >= 1ULL << (TIMER_WHEEL_ROOT_BITS + (level + 1) * TIMER_WHEEL_LEVEL_BITS)) {
+            level++;
+        }
+        uint64_t index = (expires >> (TIMER_WHEEL_ROOT_BITS + level * TIMER_WHEEL_LEVEL_BITS)) &
+                         (TIMER_WHEEL_LEVEL_SIZE - 1);
+        slot = &wheel.levels[level][index];
+    }
+
+    timer_link(slot, timer);
+}
+
+// Re-file every timer of one slot in a higher level, which moves each of
+// them down at least one level. Returns the slot index so the caller knows
+// whether the level wrapped and the next one up must cascade as well.
+static uint64_t wheel_cascade(int level) {
+    uint64_t index = (wheel.ticks >> (TIMER_WHEEL_ROOT_BITS + level * TIMER_WHEEL_LEVEL_BITS)) &
+                     (TIMER_WHEEL_LEVEL_SIZE - 1);
+
+    struct timer* timer = wheel.levels[level][index];
+    wheel.levels[level][index] = NULL;
+    while (timer) {
+        struct timer* next = timer->next;
+        wheel_insert(timer);
+        timer = next;
+    }
+    return index;
+}
+
+// First tick at or after wheel.ticks that has timers to run or cascade
+// (wheel lock held)
+static uint64_t wheel_next_expiry(void) {
+    // The upper levels only need attention when the root wraps and
+    // cascades the next stretch down
+    uint64_t next = TIMER_NEVER;
+    for (int level = 0; level < TIMER_WHEEL_LEVELS && next == TIMER_NEVER; level++) {
+        for (int i = 0; i < TIMER_WHEEL_LEVEL_SIZE; i++) {
+            if (wheel.levels[level][i]) {
+                next = (wheel.ticks + TIMER_WHEEL_ROOT_SIZE - 1) & ~(uint64_t)(TIMER_WHEEL_ROOT_SIZE - 1);
+                break;
+            }
+        }
+    }
+
+    for (uint64_t tick = wheel.ticks; tick < wheel.ticks + TIMER_WHEEL_ROOT_SIZE && tick < next; tick++) {
+        if (wheel.root[tick & (TIMER_WHEEL_ROOT_SIZE - 1)]) {
+            return tick;
+        }
+    }
+    return next;
+}
+
+// Move wheel.ticks straight past ticks with nothing to run or cascade.
+// While the timer is stopped the wheel is not run, and it would otherwise
+// step through every tick it missed with interrupts off (wheel lock held).
+static void wheel_skip_idle(uint64_t now) {
+    if (wheel.ticks < wheel_next) {
+        wheel.ticks = wheel_next <= now ? wheel_next : now + 1;
+    }
+}
+
+// Run every timer due up to and including the current tick
+static void wheel_run(void) {
+    uint64_t flags = spin_lock_irqsave(&wheel_lock);
+    uint64_t now = timer_now();
+
+    for (;;) {
+        wheel_skip_idle(now);
+        if (wheel.ticks > now) {
+            break;
+        }
+        uint64_t index = wheel.ticks & (TIMER_WHEEL_ROOT_SIZE - 1);
+
+        // The root wheel wrapped: pull the next stretch down from above
+        if (index == 0) {
+            for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+                if (wheel_cascade(level) != 0) {
+                    break;
+                }
+            }
+        }
+
+        // Detach the slot so timers re-armed by their callbacks land in a
+        // later one
+        struct timer* expired = wheel.root[index];
+        wheel.root[index] = NULL;
+        if (expired) {
+            expired->pprev = &expired;
+        }
+        wheel.ticks++;
+
+        while (expired) {
+            struct timer* timer = expired;
+            expired = timer->next;
+            if (expired) {
+                expired->pprev = &expired;
+            }
+            timer->next = NULL;
+            timer->pprev = NULL;
+
+            spin_unlock_irqrestore(&wheel_lock, flags);
+            timer->fn(timer->arg);
+            flags = spin_lock_irqsave(&wheel_lock);
+        }
+
+        // Find the next tick worth stopping at
+        if (wheel.ticks > wheel_next) {
+            wheel_next = wheel_next_expiry();
+        }
+    }
+
+    wheel_next = wheel_next_expiry();
+    spin_unlock_irqrestore(&wheel_lock, flags);
+}
+
+// Prepare a timer for use
+void timer_setup(struct timer* timer, timer_fn_t fn, void* arg) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    timer->fn = fn;
+    timer->arg = arg;
+}
+
+// Arm (or re-arm) a timer to fire `ticks` ticks from now
+void timer_add(struct timer* timer, uint64_t ticks) {
+    uint64_t flags = spin_lock_irqsave(&wheel_lock);
+
+    if (timer->pprev) {
+        *timer->pprev = timer->next;
+        if (timer->next) {
+            timer->next->pprev = timer->pprev;
+        }
+    }
+    if (ticks > TIMER_MAX_DELAY) {
+        ticks = TIMER_MAX_DELAY;
+    }
+    uint64_t now = timer_now();
+    
+    // File the timer relative to the current tick, not one the wheel was
+    // left at before the timer was stopped
+    wheel_skip_idle(now);
+    timer->expires = now + ticks;
+    wheel_insert(timer);
+    if (timer->expires < wheel_next) {
+        wheel_next = timer->expires;
+    }
+
+    spin_unlock_irqrestore(&wheel_lock, flags);
+
+    // Make sure the BSP wakes up in time to run it
+    if (timer->expires < bsp_next_event) {
+        if (cpu_current_id() == 0) {
+            timer_program_next();
+        } else {
+            timer_kick(0);
+        }
+    }
+}
+
+// Disarm a timer. Returns 1 if it was pending, 0 if it had already fired
+// or was never armed.
+int timer_del(struct timer* timer) {
+    uint64_t flags = spin_lock_irqsave(&wheel_lock);
+
+    int pending = timer->pprev != NULL;
+    if (pending) {
+        *timer->pprev = timer->next;
+        if (timer->next) {
+            timer->next->pprev = timer->pprev;
+        }
+        timer->next = NULL;
+        timer->pprev = NULL;
+    }
+
+    spin_unlock_irqrestore(&wheel_lock, flags);
+    return pending;
+}
+
+// Whether a timer is armed and has not fired yet
+int timer_pending(const struct timer* timer) {
+    return timer->pprev != NULL;
 }
 
 // Sleep function
 void sleep(uint32_t milliseconds) {
-    uint32_t start = get_tick_count();
+    uint64_t start = timer_now();
     uint32_t ticks = milliseconds / (1000 / TIMER_FREQUENCY);
     
-    while ((get_tick_count() - start) < ticks) {
-        // Wait
-        asm volatile("hlt");
+    // No periodic interrupt is guaranteed to end a hlt, so spin
+    while ((timer_now() - start) < ticks) {
+        asm volatile("pause");
     }
 }
 
-// Timer callback function
+// Timer callback function; runs when this CPU's timer event is due or
+// another CPU kicks it
 void timer_callback(void) {
-    tick_count++;
-    
-    // Call scheduler every few ticks
-    if (tick_count % 5 == 0) {
-        scheduler_schedule();
+    // The BSP owns the timer wheel
+    if (cpu_current_id() == 0) {
+        // Expire timers; a wake-up that should preempt the running task
+        // asks for a reschedule instead of waiting for the end of its
+        // time slice
+        wheel_run();
     }
     
-    // Send EOI to APIC
+    // Send EOI to APIC before switching away, or this CPU gets no more
+    // timer interrupts until the interrupted task runs again
     apic_eoi();
+    
+    // Rescheduling arms the timer for the new task; otherwise re-arm it
+    // for whatever is due next
+    if (scheduler_tick()) {
+        scheduler_schedule();
+    } else {
+        timer_program_next();
+    }
 }
 
-// Initialize PIT
-void pit_init(void) {
-    console_write("Initializing PIT...\n");
+// Arm this CPU's LAPIC timer for its next event: the end of the running
+// task's time slice, and on the BSP also the next timer wheel expiry. With
+// neither pending the timer is stopped, so an idle CPU sleeps until
+// something interrupts it.
+void timer_program_next(void) {
+    if (tsc_per_tick == 0) {
+        return;
+    }
     
-    // Calculate divisor
-    uint32_t divisor = PIT_FREQUENCY / TIMER_FREQUENCY;
+    uint64_t flags = local_irq_save();
     
-    // Send command byte
-    outb(PIT_COMMAND, 0x36);  // Channel 0, low/high byte, mode 3 (square wave), binary
+    uint64_t next = scheduler_next_event();
+    if (cpu_current_id() == 0) {
+        uint64_t wheel_flags = spin_lock_irqsave(&wheel_lock);
+        if (wheel_next < next) {
+            next = wheel_next;
+        }
+        spin_unlock_irqrestore(&wheel_lock, wheel_flags);
+        bsp_next_event = next;
+    }
     
-    // Send divisor
-    outb(PIT_CHANNEL0_DATA, divisor & 0xFF);         // Low byte
-    outb(PIT_CHANNEL0_DATA, (divisor >> 8) & 0xFF);  // High byte
+    if (next == TIMER_NEVER) {
+        if (use_tsc_deadline) {
+            wrmsr(IA32_TSC_DEADLINE_MSR, 0);
+        } else {
+            apic_write(APIC_TIMER_INITIAL, 0);
+        }
+    } else if (use_tsc_deadline) {
+        // Fires immediately if the deadline has already passed
+        wrmsr(IA32_TSC_DEADLINE_MSR, tsc_base + next * tsc_per_tick);
+    } else {
+        uint64_t target = tsc_base + next * tsc_per_tick;
+        uint64_t now = rdtsc();
+        uint64_t count = 1;
+        if (target > now) {
+            // Too far out for the 32-bit counter: wake early and re-arm
+            uint64_t delta = target - now;
+            if (delta / tsc_per_tick >= 0xFFFFFFFFULL / lapic_per_tick) {
+                count = 0xFFFFFFFF;
+            } else {
+                count = delta * lapic_per_tick / tsc_per_tick + 1;
+            }
+        }
+        apic_write(APIC_TIMER_INITIAL, (uint32_t)count);
+    }
     
-    console_write("PIT initialized.\n");
+    local_irq_restore(flags);
 }
 
-// Initialize APIC timer
-void apic_timer_init(void) {
-    console_write("Initializing APIC timer...\n");
+// Make another CPU run timer_callback (and so reschedule or re-arm its
+// timer) as soon as possible
+void timer_kick(uint32_t cpu) {
+    struct cpu_info* info = cpu_get(cpu);
+    if (info == NULL || !info->online) {
+        return;
+    }
+    apic_send_ipi(info->apic_id, TIMER_VECTOR);
+}
+
+// Measure the TSC and LAPIC timer rates over one tick, timed by PIT
+// channel 2 counting down in one-shot mode
+static void timer_calibrate(void) {
+    uint64_t flags = local_irq_save();
+    uint16_t count = PIT_FREQUENCY / TIMER_FREQUENCY;
     
-    // Calculate divisor for 100Hz frequency
-    // This is a simplified calculation and would need to be calibrated in a real implementation
-    uint32_t divisor = 1000000;  // This value would need calibration
+    // Gate channel 2 on with the speaker disconnected
+    uint8_t gate = inb(PIT_GATE_PORT);
+    outb(PIT_GATE_PORT, (gate & ~0x02) | 0x01);
     
-    // Set timer initial count
-    apic_write(APIC_TIMER_INITIAL, divisor);
+    outb(PIT_COMMAND, 0xB0);  // Channel 2, low/high byte, mode 0, binary
+    outb(PIT_CHANNEL2_DATA, count & 0xFF);
+    outb(PIT_CHANNEL2_DATA, (count >> 8) & 0xFF);
     
-    // Set timer divide configuration
     apic_write(APIC_TIMER_DIVIDE, 0x03);  // Divide by 16
+    apic_write(APIC_LVT_TIMER, TIMER_VECTOR | APIC_LVT_MASKED);
+    apic_write(APIC_TIMER_INITIAL, 0xFFFFFFFF);
+    uint64_t tsc_start = rdtsc();
+    
+    // OUT2 goes high when the count reaches zero
+    while (!(inb(PIT_GATE_PORT) & 0x20)) {
+        asm volatile("pause");
+    }
+    
+    uint64_t tsc_end = rdtsc();
+    uint32_t lapic_elapsed = 0xFFFFFFFF - apic_read(APIC_TIMER_CURRENT);
+    apic_write(APIC_TIMER_INITIAL, 0);
+    outb(PIT_GATE_PORT, gate);
+    
+    tsc_per_tick = tsc_end - tsc_start;
+    lapic_per_tick = lapic_elapsed;
+    if (tsc_per_tick == 0) {
+        tsc_per_tick = 1;
+    }
+    if (lapic_per_tick == 0) {
+        // Uncalibrated fallback
+        lapic_per_tick = 1000000;
+    }
+    tsc_base = tsc_end;
     
-    // Set timer LVT entry
-    apic_write(APIC_LVT_TIMER, 32 | 0x20000);  // Vector 32, periodic mode
+    local_irq_restore(flags);
+}
+
+// Initialize APIC timer
+void apic_timer_init(void) {
+    console_write("Initializing APIC timer...\n");
     
-    console_write("APIC timer initialized.\n");
+    use_tsc_deadline = cpu_features.tsc_deadline;
+    timer_calibrate();
+    timer_init_cpu();
+    
+    console_write("APIC timer initialized (");
+    console_write(use_tsc_deadline ? "TSC-deadline" : "one-shot");
+    console_write(" mode, ");
+    console_write_dec(lapic_per_tick);
+    console_write(" counts/tick).\n");
+}
+
+// Put this CPU's LAPIC timer in one-shot or TSC-deadline mode and arm it
+void timer_init_cpu(void) {
+    if (use_tsc_deadline) {
+        apic_write(APIC_LVT_TIMER, TIMER_VECTOR | APIC_LVT_TIMER_TSC_DEADLINE);
+        // Order the LVT write before the first deadline, as the SDM asks
+        asm volatile("mfence" : : : "memory");
+    } else {
+        apic_write(APIC_TIMER_DIVIDE, 0x03);  // Divide by 16
+        apic_write(APIC_LVT_TIMER, TIMER_VECTOR | APIC_LVT_TIMER_ONESHOT);
+    }
+    timer_program_next();
 }
 
 // Main timer initialization function
 void timer_init(void) {
     console_write("Initializing timer...\n");
     
-    // Initialize PIT
-    pit_init();
+    // The PIT is only the calibration reference; ticks come from the
+    // LAPIC timer, so keep IRQ 0 from delivering a second tick stream
+    ioapic_set_irq_redirect(0, TIMER_VECTOR, APIC_LVT_MASKED);
     
     // Initialize APIC timer
     apic_timer_init();
     
     console_write("Timer initialization complete.\n");
-}
\ No newline at end of file
+}
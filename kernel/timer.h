@@ -4,17 +4,56 @@
 
 #include <stdint.h>
 
-// Timer frequency (Hz)
+// Timer frequency (Hz): the length of a tick. The LAPIC timer is armed
+// one-shot for the next event rather than interrupting every tick.
 #define TIMER_FREQUENCY 100
 
+// Interrupt vector of the LAPIC timer, also used to kick another CPU
+#define TIMER_VECTOR 32
+
+// Tick value meaning "no event pending"
+#define TIMER_NEVER 0xFFFFFFFFFFFFFFFFULL
+
+// Hierarchical timer wheel: 256 one-tick slots, then three levels of 64
+// slots that each cover 64 times the span of the level below. Timers are
+// filed by expiry tick and cascade down a level as their time approaches,
+// so adding and deleting are O(1) and expiry needs no scan of pending timers.
+#define TIMER_WHEEL_ROOT_BITS  8
+#define TIMER_WHEEL_LEVEL_BITS 6
+#define TIMER_WHEEL_ROOT_SIZE  (1 << TIMER_WHEEL_ROOT_BITS)
+#define TIMER_WHEEL_LEVEL_SIZE (1 << TIMER_WHEEL_LEVEL_BITS)
+#define TIMER_WHEEL_LEVELS     3
+// Longest delay that can be represented; longer ones are clamped
+#define TIMER_MAX_DELAY ((1ULL << (TIMER_WHEEL_ROOT_BITS + TIMER_WHEEL_LEVELS * TIMER_WHEEL_LEVEL_BITS)) - 1)
+
+typedef void (*timer_fn_t)(void* arg);
+
+// A one-shot timer. The callback runs from the timer interrupt on the tick
+// the timer expires.
+struct timer {
+    struct timer* next;
+    struct timer** pprev;           // Link pointing at this timer (NULL when idle)
+    uint64_t expires;               // Tick the timer fires on
+    timer_fn_t fn;
+    void* arg;
+};
+
 // Function prototypes
 void timer_init(void);
-void pit_init(void);
+void timer_init_cpu(void);
 void timer_callback(void);
+void timer_program_next(void);
+void timer_kick(uint32_t cpu);
 uint32_t get_tick_count(void);
+uint64_t timer_now(void);
+uint64_t timer_tsc_per_tick(void);
+uint64_t timer_tick_to_tsc(uint64_t tick);
+void timer_setup(struct timer* timer, timer_fn_t fn, void* arg);
+void timer_add(struct timer* timer, uint64_t ticks);
+int timer_del(struct timer* timer);
+int timer_pending(const struct timer* timer);
 void sleep(uint32_t milliseconds);
 
-// For APIC timer (to be implemented later)
 void apic_timer_init(void);
 
 #endif
\ No newline at end of file
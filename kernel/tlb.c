@@ -0,0 +1,285 @@
+// kernel/tlb.c
+#include "tlb.h"
+#include "memory.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "apic.h"
+#include <stdint.h>
+
+// Set once CR4.PCIDE is on
+int tlb_pcid_enabled = 0;
+
+// PCID allocation. Every change to a user half bumps the generation of its
+// PCID; a CPU that last saw an older generation must not keep that PCID's
+// TLB entries when it switches to it (the process may have run elsewhere
+// in between, or the PCID may have been reused).
+static uint64_t pcid_bitmap[TLB_PCID_COUNT / 64];
+static uint32_t pcid_generation[TLB_PCID_COUNT];
+static uint32_t pcid_seen[MAX_CPUS][TLB_PCID_COUNT];
+static spinlock_t pcid_lock = SPINLOCK_INIT;
+
+// Cross-CPU shootdown request. It is delivered as an NMI, so a CPU
+// spinning with interrupts off (perhaps on a lock the initiator holds)
+// still services it. One request is in flight at a time.
+struct tlb_shootdown {
+    uint64_t addrs[TLB_GATHER_MAX];
+    uint32_t count;
+    uint32_t flush_all;
+    uint32_t kernel;
+    uint32_t user;
+    uint32_t tables;
+    uint64_t pml4;                      // Address space of the user-half changes
+    volatile uint32_t pending[MAX_CPUS];
+};
+
+static struct tlb_shootdown shootdown;
+static spinlock_t shootdown_lock = SPINLOCK_INIT;
+static volatile uint32_t shootdown_ready[MAX_CPUS];    // CPU can take the NMI
+
+// Enable global pages and, when supported, PCIDs on this CPU
+void tlb_init_cpu(void) {
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_PGE;
+    if (cpu_features.pcid) {
+        // Requires CR3[11:0] == 0, which holds for the kernel's PML4
+        cr4 |= CR4_PCIDE;
+        tlb_pcid_enabled = 1;
+    }
+    asm volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+
+    // The IDT is loaded by now, so shootdown NMIs can be handled
+    shootdown_ready[cpu_current_id()] = 1;
+}
+
+// Drop every TLB entry of every PCID, global entries included
+void flush_tlb_all_contexts(void) {
+    if (cpu_features.invpcid) {
+        invpcid(INVPCID_ALL_GLOBAL, 0, 0);
+        return;
+    }
+
+    // Toggling CR4.PGE flushes all entries for all PCIDs
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    asm volatile("mov %0, %%cr4" :: "r"(cr4 ^ CR4_PGE) : "memory");
+    asm volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+}
+
+// Claim a PCID for a new address space (0 if PCIDs are off or all in use)
+uint64_t tlb_pcid_alloc(void) {
+    if (!tlb_pcid_enabled) {
+        return 0;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&pcid_lock);
+    for (uint32_t word = 0; word < TLB_PCID_COUNT / 64; word++) {
+        uint64_t free_bits = ~pcid_bitmap[word];
+        if (word == 0) {
+            free_bits &= ~1ULL;     // PCID 0 belongs to the kernel
+        }
+        if (free_bits != 0) {
+            uint32_t pcid = word * 64 + __builtin_ctzll(free_bits);
+            pcid_bitmap[word] |= 1ULL << (pcid % 64);
+            // Entries left behind by a previous owner must not survive
+            pcid_generation[pcid]++;
+            spin_unlock_irqrestore(&pcid_lock, flags);
+            return pcid;
+        }
+    }
+    spin_unlock_irqrestore(&pcid_lock, flags);
+    return 0;
+}
+
+// Release a PCID claimed by tlb_pcid_alloc()
+void tlb_pcid_free(uint64_t pcid) {
+    if (pcid == 0 || pcid >= TLB_PCID_COUNT) {
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&pcid_lock);
+    pcid_bitmap[pcid / 64] &= ~(1ULL << (pcid % 64));
+    spin_unlock_irqrestore(&pcid_lock, flags);
+}
+
+// Value to load into CR3 to switch to an address space: keeps the TLB
+// entries of its PCID when this CPU has seen every change made to it
+uint64_t tlb_cr3_for_switch(uint64_t cr3) {
+    uint64_t pcid = cr3 & CR3_PCID_MASK;
+    if (!tlb_pcid_enabled || pcid == 0) {
+        return cr3;
+    }
+
+    uint32_t cpu = cpu_current_id();
+    uint32_t generation = __atomic_load_n(&pcid_generation[pcid], __ATOMIC_ACQUIRE);
+    if (pcid_seen[cpu][pcid] == generation) {
+        return cr3 | CR3_NOFLUSH;
+    }
+    pcid_seen[cpu][pcid] = generation;
+    return cr3;
+}
+
+// Note that this CPU flushed its own entries for the current PCID after a
+// user-half change; every other CPU now holds stale ones
+static void tlb_pcid_changed(void) {
+    uint64_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    uint64_t pcid = cr3 & CR3_PCID_MASK;
+    if (pcid == 0) {
+        return;
+    }
+
+    uint32_t generation = __atomic_add_fetch(&pcid_generation[pcid], 1, __ATOMIC_ACQ_REL);
+    pcid_seen[cpu_current_id()][pcid] = generation;
+}
+
+// Start an empty batch
+void tlb_gather_init(struct tlb_gather* tlb) {
+    tlb->count = 0;
+    tlb->flush_all = 0;
+    tlb->user = 0;
+    tlb->kernel = 0;
+    tlb->tables = 0;
+    tlb->free_count = 0;
+}
+
+// Record that the translation for virtual_addr changed. For a large page any
+// address inside it is enough: invlpg drops the whole large translation.
+void tlb_gather_add(struct tlb_gather* tlb, uint64_t virtual_addr) {
+    if (virtual_addr >= USER_SPACE_END) {
+        tlb->kernel = 1;
+    } else {
+        tlb->user = 1;
+    }
+    if (tlb->flush_all) {
+        return;
+    }
+    if (tlb->count == TLB_GATHER_MAX) {
+        tlb->flush_all = 1;
+        return;
+    }
+    tlb->addrs[tlb->count++] = virtual_addr & ~(uint64_t)(PAGE_SIZE - 1);
+}
+
+// Free a frame (a data page or a page table) only once no TLB can still
+// reference it through a stale translation
+void tlb_gather_free_page(struct tlb_gather* tlb, uint64_t physical_addr) {
+    if (tlb->free_count == TLB_GATHER_MAX_FREES) {
+        // Flush early so the queued frames can be released
+        tlb_gather_commit(tlb);
+    }
+    tlb->frees[tlb->free_count++] = physical_addr;
+}
+
+// Free a page table unlinked from the tree. Paging-structure caches may
+// hold it under any PCID, which the commit has to account for.
+void tlb_gather_free_table(struct tlb_gather* tlb, uint64_t physical_addr) {
+    tlb_gather_free_page(tlb, physical_addr);
+    tlb->tables = 1;
+}
+
+// Invalidate this CPU's translations for a batch of addresses. Kernel-half
+// leaves are global, and invlpg drops a global entry under every PCID, so
+// kernel changes are invalidated per address like user ones. Only a CR3
+// reload leaves global entries behind, and invlpg clears paging-structure
+// caches for the current PCID alone; those two cases flush everything.
+static void tlb_flush_local(const uint64_t* addrs, uint32_t count, uint32_t flush_all,
+                            uint32_t kernel, uint32_t tables) {
+    uint32_t full = flush_all || count > TLB_FLUSH_THRESHOLD;
+    if (kernel && (full || (tables && tlb_pcid_enabled))) {
+        flush_tlb_all_contexts();
+    } else if (full) {
+        flush_tlb();
+    } else {
+        for (uint32_t i = 0; i < count; i++) {
+            flush_tlb_single(addrs[i]);
+        }
+    }
+}
+
+static inline uint64_t tlb_current_pml4(void) {
+    uint64_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    return cr3 & PAGE_FRAME_MASK;
+}
+
+// NMI handler side of a shootdown. Returns 0 if a request for this CPU
+// was handled, -1 if the NMI was not ours.
+int tlb_handle_shootdown(void) {
+    uint32_t cpu = cpu_current_id();
+    if (!__atomic_load_n(&shootdown.pending[cpu], __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+
+    // User-half changes only matter to a CPU in that address space; any
+    // other reloads CR3 (or checks the PCID generation) on its way in
+    if (shootdown.kernel || tlb_current_pml4() == shootdown.pml4) {
+        tlb_flush_local(shootdown.addrs, shootdown.count, shootdown.flush_all, shootdown.kernel,
+                        shootdown.tables);
+    }
+
+    __atomic_store_n(&shootdown.pending[cpu], 0, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Have every other online CPU apply a batch and wait until they all have,
+// so no stale translation survives the release of the batch's frames
+static void tlb_shootdown(struct tlb_gather* tlb) {
+    uint32_t online = cpu_online_count();
+    if (online <= 1) {
+        return;
+    }
+
+    // Interrupts off so the wait cannot be preempted; NMIs from a
+    // concurrent initiator still get through while we spin for the lock
+    uint64_t flags = local_irq_save();
+    spin_lock(&shootdown_lock);
+
+    uint32_t self = cpu_current_id();
+    for (uint32_t i = 0; i < tlb->count; i++) {
+        shootdown.addrs[i] = tlb->addrs[i];
+    }
+    shootdown.count = tlb->count;
+    shootdown.flush_all = tlb->flush_all;
+    shootdown.kernel = tlb->kernel;
+    shootdown.user = tlb->user;
+    shootdown.tables = tlb->tables;
+    shootdown.pml4 = tlb_current_pml4();
+
+    for (uint32_t cpu = 0; cpu < online; cpu++) {
+        struct cpu_info* info = cpu_get(cpu);
+        if (cpu == self || info == NULL || !info->online || !shootdown_ready[cpu]) {
+            continue;
+        }
+        __atomic_store_n(&shootdown.pending[cpu], 1, __ATOMIC_RELEASE);
+        apic_send_ipi(info->apic_id, APIC_ICR_NMI);
+    }
+    for (uint32_t cpu = 0; cpu < online; cpu++) {
+        while (__atomic_load_n(&shootdown.pending[cpu], __ATOMIC_ACQUIRE)) {
+            asm volatile("pause");
+        }
+    }
+
+    spin_unlock(&shootdown_lock);
+    local_irq_restore(flags);
+}
+
+// Apply the deferred invalidations on every CPU, then release deferred
+// frames
+void tlb_gather_commit(struct tlb_gather* tlb) {
+    if (tlb->count == 0 && !tlb->flush_all && tlb->free_count == 0) {
+        return;
+    }
+
+    tlb_flush_local(tlb->addrs, tlb->count, tlb->flush_all, tlb->kernel, tlb->tables);
+    if (tlb_pcid_enabled && tlb->user) {
+        tlb_pcid_changed();
+    }
+    tlb_shootdown(tlb);
+
+    for (uint32_t i = 0; i < tlb->free_count; i++) {
+        free_physical_page(tlb->frees[i]);
+    }
+
+    tlb_gather_init(tlb);
+}
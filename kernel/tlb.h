@@ -0,0 +1,77 @@
+// kernel/tlb.h
+#ifndef TLB_H
+#define TLB_H
+
+#include <stdint.h>
+
+// Addresses tracked individually before a gather degrades to a full flush
+#define TLB_GATHER_MAX       32
+// Above this many pages a CR3 reload is cheaper than one invlpg per page
+#define TLB_FLUSH_THRESHOLD  16
+// Physical pages whose release is deferred until after the flush
+#define TLB_GATHER_MAX_FREES 32
+
+// Process-context identifiers. CR3 bits 0-11 tag TLB entries with the
+// address space they belong to, so a CR3 load with CR3_NOFLUSH keeps them.
+// PCID 0 is the kernel's and is shared by any address space that could not
+// get its own, so loads with PCID 0 always flush.
+#define TLB_PCID_COUNT  256
+#define CR3_PCID_MASK   0xFFFULL
+#define CR3_NOFLUSH     (1ULL << 63)
+#define CR4_PGE         (1ULL << 7)
+#define CR4_PCIDE       (1ULL << 17)
+
+// INVPCID types
+#define INVPCID_ADDRESS     0       // One address in one PCID
+#define INVPCID_CONTEXT     1       // All non-global entries of one PCID
+#define INVPCID_ALL_GLOBAL  2       // Everything, global entries included
+
+// Batch of page-table updates whose TLB invalidation is deferred to
+// tlb_gather_commit(). Callers stage any number of map/unmap/protect
+// operations against a gather and pay for a single flush at the end.
+struct tlb_gather {
+    uint64_t addrs[TLB_GATHER_MAX];     // Virtual addresses needing invlpg
+    uint32_t count;
+    uint32_t flush_all;                 // Too many addresses: reload CR3
+    uint32_t user;                      // Touched the user half
+    uint32_t kernel;                    // Touched the (shared) kernel half
+    uint32_t tables;                    // Freed paging structures
+    uint64_t frees[TLB_GATHER_MAX_FREES];   // Frames to free after the flush
+    uint32_t free_count;
+};
+
+static inline void flush_tlb_single(uint64_t addr) {
+    asm volatile("invlpg (%0)" ::"r" (addr) : "memory");
+}
+
+// Drop the non-global entries of the current PCID
+static inline void flush_tlb(void) {
+    uint64_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r" (cr3));
+    asm volatile("mov %0, %%cr3" :: "r" (cr3) : "memory");
+}
+
+static inline void invpcid(uint64_t type, uint64_t pcid, uint64_t addr) {
+    struct {
+        uint64_t pcid;
+        uint64_t addr;
+    } desc = { pcid, addr };
+    asm volatile("invpcid %0, %1" :: "m" (desc), "r" (type) : "memory");
+}
+
+extern int tlb_pcid_enabled;
+
+// Function prototypes
+void tlb_gather_init(struct tlb_gather* tlb);
+void tlb_gather_add(struct tlb_gather* tlb, uint64_t virtual_addr);
+void tlb_gather_free_page(struct tlb_gather* tlb, uint64_t physical_addr);
+void tlb_gather_free_table(struct tlb_gather* tlb, uint64_t physical_addr);
+void tlb_gather_commit(struct tlb_gather* tlb);
+int tlb_handle_shootdown(void);
+void tlb_init_cpu(void);
+void flush_tlb_all_contexts(void);
+uint64_t tlb_pcid_alloc(void);
+void tlb_pcid_free(uint64_t pcid);
+uint64_t tlb_cr3_for_switch(uint64_t cr3);
+
+#endif
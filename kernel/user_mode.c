@@ -1,6 +1,7 @@
 #include "user_mode.h"
 #include "drivers/console.h"
 #include "memory.h"
+#include "pmm.h"
 #include <stdint.h>
 
 // Assembly function prototypes
@@ -50,7 +51,7 @@ void enter_user_mode(void (*user_function)(void)) {
     // Map user stack to virtual address
     uint64_t user_stack_virt = 0x100000000; // User stack at 4GB
     for (uint64_t i = 0; i < user_stack_size; i += PAGE_SIZE) {
-        void* phys_page = alloc_physical_page();
+        void* phys_page = pmm_alloc_page_flags(PMM_ALLOC_ZERO);
         if (phys_page == NULL) {
             console_write("ERROR: Failed to allocate physical page for user stack\n");
             return;
@@ -0,0 +1,147 @@
+// kernel/vmalloc.c
+#include "vmalloc.h"
+#include "memory.h"
+#include "pmm.h"
+#include "slab.h"
+#include "tlb.h"
+#include "spinlock.h"
+#include "drivers/console.h"
+#include <stdint.h>
+
+// Areas in address order
+static struct vmalloc_area* areas = NULL;
+static spinlock_t vmalloc_lock = SPINLOCK_INIT;
+static struct kmem_cache* area_cache = NULL;
+
+// Reserve size bytes plus a guard gap in the first hole that fits
+// (returns the start address, or 0 if the range is full)
+static uint64_t vmalloc_reserve(struct vmalloc_area* area, uint64_t size) {
+    uint64_t span = size + VMALLOC_GUARD_SIZE;
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+
+    uint64_t start = VMALLOC_BASE;
+    struct vmalloc_area** link = &areas;
+    while (*link != NULL && (*link)->start - start < span) {
+        start = (*link)->start + (*link)->size + VMALLOC_GUARD_SIZE;
+        link = &(*link)->next;
+    }
+
+    if (start + span > VMALLOC_BASE + VMALLOC_SIZE) {
+        spin_unlock_irqrestore(&vmalloc_lock, flags);
+        return 0;
+    }
+
+    area->start = start;
+    area->size = size;
+    area->next = *link;
+    *link = area;
+
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+    return start;
+}
+
+// Area starting at start, left in place (NULL if there is none)
+static struct vmalloc_area* vmalloc_find(uint64_t start) {
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+
+    struct vmalloc_area* area = areas;
+    while (area != NULL && area->start != start) {
+        area = area->next;
+    }
+
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+    return area;
+}
+
+// Unlink the area starting at start (NULL if there is none)
+static struct vmalloc_area* vmalloc_release(uint64_t start) {
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+
+    struct vmalloc_area** link = &areas;
+    while (*link != NULL && (*link)->start != start) {
+        link = &(*link)->next;
+    }
+
+    struct vmalloc_area* area = *link;
+    if (area != NULL) {
+        *link = area->next;
+    }
+
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+    return area;
+}
+
+// Set up the area descriptor cache; called once from memory_init(),
+// before other CPUs run and could race to create it
+void vmalloc_init(void) {
+    area_cache = kmem_cache_create("vmalloc_area", sizeof(struct vmalloc_area), 0, NULL);
+    if (area_cache == NULL) {
+        console_write("ERROR: Failed to create the vmalloc area cache\n");
+    }
+}
+
+// Allocate size bytes of virtually contiguous kernel memory
+void* vmalloc(size_t size) {
+    if (size == 0 || area_cache == NULL) {
+        return NULL;
+    }
+    size = (size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+
+    struct vmalloc_area* area = kmem_cache_alloc(area_cache);
+    if (area == NULL) {
+        return NULL;
+    }
+
+    uint64_t start = vmalloc_reserve(area, size);
+    if (start == 0) {
+        console_write("ERROR: vmalloc range exhausted\n");
+        kmem_cache_free(area_cache, area);
+        return NULL;
+    }
+
+    // Fresh mappings replace nothing, so the gather only has work to do
+    // if a failure below makes us tear the area down again
+    struct tlb_gather tlb;
+    tlb_gather_init(&tlb);
+    for (uint64_t addr = start; addr < start + size; addr += PAGE_SIZE) {
+        void* page = pmm_alloc_page();
+        if (page == NULL || map_page_batched(&tlb, addr, (uint64_t)page,
+                                             PAGE_PRESENT | PAGE_WRITABLE | PAGE_GLOBAL) != 0) {
+            if (page != NULL) {
+                free_physical_page((uint64_t)page);
+            }
+            tlb_gather_commit(&tlb);
+            console_write("ERROR: Out of memory in vmalloc\n");
+            unmap_and_free_pages(start, addr - start);
+            kmem_cache_free(area_cache, vmalloc_release(start));
+            return NULL;
+        }
+    }
+    tlb_gather_commit(&tlb);
+
+    return (void*)start;
+}
+
+// Free memory returned by vmalloc
+void vfree(void* addr) {
+    if (addr == NULL) {
+        return;
+    }
+
+    struct vmalloc_area* area = vmalloc_find((uint64_t)addr);
+    if (area == NULL) {
+        console_write("ERROR: vfree of an address vmalloc did not return\n");
+        return;
+    }
+
+    // Tear down (and shoot down) the mappings before the range can be
+    // handed out again
+    unmap_and_free_pages(area->start, area->size);
+    kmem_cache_free(area_cache, vmalloc_release(area->start));
+}
+
+// Whether addr lies in the vmalloc range
+int is_vmalloc_addr(const void* addr) {
+    uint64_t a = (uint64_t)addr;
+    return a >= VMALLOC_BASE && a < VMALLOC_BASE + VMALLOC_SIZE;
+}
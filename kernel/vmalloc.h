@@ -0,0 +1,30 @@
+// kernel/vmalloc.h
+#ifndef VMALLOC_H
+#define VMALLOC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Kernel virtual range for large, virtually contiguous allocations backed
+// by scattered physical pages. Kept apart from the heap so multi-megabyte
+// buffers do not fragment it.
+#define VMALLOC_BASE 0xFFFFC90000000000ULL
+#define VMALLOC_SIZE (1ULL << 40)   // 1TB
+
+// Unmapped pages left after every area so overruns fault
+#define VMALLOC_GUARD_SIZE 4096
+
+// A reserved piece of the vmalloc range
+struct vmalloc_area {
+    uint64_t start;
+    uint64_t size;                  // Mapped bytes, excluding the guard gap
+    struct vmalloc_area* next;      // Next area by address
+};
+
+// Function prototypes
+void vmalloc_init(void);
+void* vmalloc(size_t size);
+void vfree(void* addr);
+int is_vmalloc_addr(const void* addr);
+
+#endif